@@ -0,0 +1,126 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+// Compare probe_tag_header() against get_tag_header(). Without arguments a
+// temporary file holding a small tag is probed.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "id3v2lib.h"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, long probes, double seconds)
+{
+    printf("%-24s %10ld probes %8.3f s %12.0f probes/s\n", name, probes, seconds, probes / seconds);
+}
+
+static char *make_sample(void)
+{
+    static const char tag[] = "ID3\x03\x00\x00\x00\x00\x00\x10"
+                              "TIT2\x00\x00\x00\x06\x00\x00\x00Title";
+    char *path = strdup("/tmp/id3v2probeXXXXXX");
+    int fd = mkstemp(path);
+
+    if (fd < 0 || write(fd, tag, sizeof(tag) - 1) != sizeof(tag) - 1) {
+        perror("mkstemp");
+        exit(1);
+    }
+    close(fd);
+    return path;
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = 200000;
+    char *sample = NULL;
+    char **files;
+    int count;
+    int *fds;
+    long probes, found;
+    double start;
+    ID3v2_header header;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') {
+            iterations = atol(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-n iterations] [file...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind < argc) {
+        files = argv + optind;
+        count = argc - optind;
+    } else {
+        sample = make_sample();
+        files = &sample;
+        count = 1;
+    }
+
+    fds = malloc(count * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        fds[i] = open(files[i], O_RDONLY);
+        if (fds[i] < 0) {
+            perror(files[i]);
+            return 1;
+        }
+    }
+
+    set_error_reporting(0);
+
+    // probe on a descriptor that is already open
+    found = 0;
+    start = now();
+    for (probes = 0; probes < iterations; probes++) {
+        found += probe_tag_header(fds[probes % count], &header) == 1;
+    }
+    report("probe_tag_header (fd)", probes, now() - start);
+
+    // open, probe and close, the cost of probing a file by name
+    start = now();
+    for (probes = 0; probes < iterations; probes++) {
+        int fd = open(files[probes % count], O_RDONLY);
+        if (fd < 0) break;
+        found += probe_tag_header(fd, &header) == 1;
+        close(fd);
+    }
+    report("open+probe_tag_header", probes, now() - start);
+
+    start = now();
+    for (probes = 0; probes < iterations; probes++) {
+        ID3v2_header *tag_header = get_tag_header(files[probes % count]);
+        found += tag_header != NULL;
+        free(tag_header);
+    }
+    report("get_tag_header", probes, now() - start);
+
+    printf("%ld tags found\n", found);
+
+    for (int i = 0; i < count; i++) close(fds[i]);
+    free(fds);
+    if (sample) {
+        unlink(sample);
+        free(sample);
+    }
+
+    return 0;
+}
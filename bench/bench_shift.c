@@ -0,0 +1,223 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+// Throughput of moving the audio payload when a tag grows or is removed:
+// the old tmpfile()/getc()/putc() copy against io_shift() through a buffer,
+// with copy_file_range() and with fallocate() block insertion, and of
+// set_tag_atomic() writing the file anew.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "id3v2lib.h"
+
+#define SHIFT_BUFFERED 0
+#define SHIFT_COPY_RANGE 1	// io->move only
+#define SHIFT_BLOCKS 2		// io->move and io->shift
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, long long bytes, double seconds)
+{
+    printf("%-32s %8.3f s %10.1f MB/s\n", name, seconds, bytes / seconds / (1024 * 1024));
+}
+
+// What set_tag() and remove_tag() used to do: the new tag and the payload
+// go to a tmpfile() one byte at a time, and back into the file the same way
+static void legacy_shift(const char *file_name, long long offset, long long distance)
+{
+    int c;
+    long long size;
+    FILE *file = fopen(file_name, "r+b");
+    FILE *temp_file = tmpfile();
+
+    if (!file || !temp_file) {
+        perror(file_name);
+        exit(1);
+    }
+
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+
+    for (long long i = 0; i < offset + distance; i++) {
+        putc(0, temp_file);
+    }
+    fseek(file, offset, SEEK_SET);
+    while ((c = getc(file)) != EOF) {
+        putc(c, temp_file);
+    }
+
+    fseek(temp_file, 0, SEEK_SET);
+    fseek(file, 0, SEEK_SET);
+    while ((c = getc(temp_file)) != EOF) {
+        putc(c, file);
+    }
+
+    fclose(file);
+    fclose(temp_file);
+
+    // remove_tag() left the end of the file behind, cut it here so every
+    // test starts from the same file
+    if (distance < 0 && truncate(file_name, size + distance) != 0) {
+        perror(file_name);
+        exit(1);
+    }
+}
+
+static void io_shift_file(const char *file_name, int mode, long long offset, long long distance)
+{
+    ID3v2_io io;
+    int fd = open(file_name, O_RDWR);
+
+    if (fd < 0) {
+        perror(file_name);
+        exit(1);
+    }
+
+    io_from_fd(&io, fd);
+    if (mode < SHIFT_BLOCKS) io.shift = NULL;
+    if (mode < SHIFT_COPY_RANGE) io.move = NULL;
+
+    if (io_shift(&io, offset, distance) != 0) {
+        fprintf(stderr, "io_shift failed\n");
+        exit(1);
+    }
+    close(fd);
+}
+
+// Every test starts without dirty pages, fallocate() would have to write them back first
+static void sync_file(const char *file_name)
+{
+    int fd = open(file_name, O_RDWR);
+
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+static void make_file(const char *file_name, long long size)
+{
+    char *block = malloc(1024 * 1024);
+    int fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0 || !block) {
+        perror(file_name);
+        exit(1);
+    }
+
+    for (int i = 0; i < 1024 * 1024; i++) block[i] = (char) rand();
+    for (long long done = 0; done < size; done += 1024 * 1024) {
+        int chunk = size - done < 1024 * 1024 ? (int) (size - done) : 1024 * 1024;
+        if (write(fd, block, chunk) != chunk) {
+            perror(file_name);
+            exit(1);
+        }
+    }
+
+    fsync(fd);
+    close(fd);
+    free(block);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *directory = "/tmp";
+    long long size = 256;
+    long long distance = 4096;
+    char file_name[4096];
+    double start;
+    ID3v2_tag *tag;
+    int skip_legacy = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:s:g:l")) != -1) {
+        switch (opt) {
+            case 'd': directory = optarg; break;
+            case 's': size = atoll(optarg); break;
+            case 'g': distance = atoll(optarg); break;
+            case 'l': skip_legacy = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-d directory] [-s MB] [-g grow bytes] [-l]\n", argv[0]);
+                fprintf(stderr, "  -l  skip the (slow) getc/putc baseline\n");
+                return 1;
+        }
+    }
+
+    size *= 1024 * 1024;
+    snprintf(file_name, sizeof(file_name), "%s/id3v2shift.%d", directory, (int) getpid());
+    make_file(file_name, size);
+
+    printf("%lld MB file in %s, tag grows by %lld bytes\n", size / (1024 * 1024), directory, distance);
+
+    // Each test grows the tag at the start of the file then removes it again
+    if (!skip_legacy) {
+        sync_file(file_name);
+        start = now();
+        legacy_shift(file_name, 0, distance);
+        report("getc/putc grow", size, now() - start);
+        sync_file(file_name);
+        start = now();
+        legacy_shift(file_name, distance, -distance);
+        report("getc/putc remove", size, now() - start);
+    }
+
+    sync_file(file_name);
+    start = now();
+    io_shift_file(file_name, SHIFT_BUFFERED, 0, distance);
+    report("io_shift buffered grow", size, now() - start);
+    sync_file(file_name);
+    start = now();
+    io_shift_file(file_name, SHIFT_BUFFERED, distance, -distance);
+    report("io_shift buffered remove", size, now() - start);
+
+    sync_file(file_name);
+    start = now();
+    io_shift_file(file_name, SHIFT_COPY_RANGE, 0, distance);
+    report("io_shift copy_file_range grow", size, now() - start);
+    sync_file(file_name);
+    start = now();
+    io_shift_file(file_name, SHIFT_COPY_RANGE, distance, -distance);
+    report("io_shift copy_file_range remove", size, now() - start);
+
+    sync_file(file_name);
+    start = now();
+    io_shift_file(file_name, SHIFT_BLOCKS, 0, distance);
+    report("io_shift blocks grow", size, now() - start);
+    sync_file(file_name);
+    start = now();
+    io_shift_file(file_name, SHIFT_BLOCKS, distance, -distance);
+    report("io_shift blocks remove", size, now() - start);
+
+    // Adding a tag rewrites the whole file, atomically through a new one
+    tag = new_tag();
+    tag_set_title("Title", 0, tag);
+    sync_file(file_name);
+    start = now();
+    if (set_tag_atomic(file_name, tag) != ID3_WRITE_REWRITE) {
+        fprintf(stderr, "set_tag_atomic failed\n");
+        return 1;
+    }
+    report("set_tag_atomic add", size, now() - start);
+    free_tag(tag);
+    remove_tag(file_name);
+
+    unlink(file_name);
+
+    return 0;
+}
@@ -0,0 +1,538 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+// Time the loaders, the frame and content parsers, the getters, the UTF-8 text
+// accessors, rendering, set_tag() and the text setters on the synthetic tags
+// of corpus.c. Every operation is repeated until it ran for at least the
+// minimum time, then reported as ns/op, allocations, bytes allocated and bytes
+// copied per op, and MB/s of tag processed. The counts come from the library
+// stats (see stats.h), taken on a separate run so counting does not slow down
+// the timed one.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "id3v2lib.h"
+#include "corpus.h"
+
+#define FORMAT_TEXT 0
+#define FORMAT_CSV 1
+#define FORMAT_JSON 2
+
+#define AUDIO_SIZE (64 * 1024)
+
+#define COUNTED_RUNS 16
+
+// One synthetic tag and what the operations need from it
+typedef struct
+{
+    const corpus_spec *spec;
+    char *bytes;
+    int size;
+    ID3v2_tag *tag;		// loaded once, for the content parsers, getters and render
+    char *frames;		// the frames, unsynchronisation reversed
+    int version;		// of the frames, for parse_frame()
+    int *offsets;		// of every frame in frames
+    int frame_count;
+    ID3v2_memory_file file;	// tag and audio for set_tag()
+    ID3v2_arena *arena;		// for get_frame_text_utf8_in_arena()
+} bench_case;
+
+#define TEXT_BUFFER_SIZE 4096
+
+typedef struct
+{
+    const char *name;
+    // Runs the operation once, returns 0 or -1 if it failed
+    int (*run)(bench_case *c);
+    // Bytes the operation goes through, for MB/s; 0 if not applicable
+    long long (*bytes)(bench_case *c);
+} bench_op;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run_load_buffer(bench_case *c)
+{
+    ID3v2_tag *tag = load_tag_with_buffer(c->bytes, c->size);
+
+    if (!tag) return -1;
+    free_tag(tag);
+    return 0;
+}
+
+static int run_load_lazy(bench_case *c)
+{
+    ID3v2_tag *tag = load_tag_with_buffer_lazy(c->bytes, c->size);
+
+    if (!tag) return -1;
+    free_tag(tag);
+    return 0;
+}
+
+static int run_parse_frame(bench_case *c)
+{
+    for (int i = 0; i < c->frame_count; i++) {
+        ID3v2_frame *frame = parse_frame(c->frames, c->offsets[i], c->version);
+
+        if (!frame) return -1;
+        mem_free(frame->data);
+        mem_free(frame);
+    }
+
+    return 0;
+}
+
+static int is_text_frame(ID3v2_frame *frame)
+{
+    return frame->frame_id[0] == 'T' && memcmp(frame->frame_id, "TXXX", ID3_FRAME_ID) != 0;
+}
+
+static int is_comment_frame(ID3v2_frame *frame)
+{
+    return memcmp(frame->frame_id, COMMENT_FRAME_ID, ID3_FRAME_ID) == 0;
+}
+
+static int is_apic_frame(ID3v2_frame *frame)
+{
+    return memcmp(frame->frame_id, ALBUM_COVER_FRAME_ID, ID3_FRAME_ID) == 0;
+}
+
+// Every frame get_frame_text_utf8() reads: text, TXXX and comment frames
+static int has_text(ID3v2_frame *frame)
+{
+    return frame->frame_id[0] == 'T' || is_comment_frame(frame);
+}
+
+static int run_parse_text_content(bench_case *c)
+{
+    ID3v2_frame_list *frames = c->tag->frames;
+
+    for (int i = 0; i < frames->count; i++) {
+        ID3v2_frame_text_content *content;
+
+        if (!is_text_frame(frames->frames[i])) continue;
+        content = parse_text_frame_content(frames->frames[i]);
+        if (!content) return -1;
+        free_text_content(content);
+    }
+
+    return 0;
+}
+
+static int run_parse_comment_content(bench_case *c)
+{
+    ID3v2_frame_list *frames = c->tag->frames;
+
+    for (int i = 0; i < frames->count; i++) {
+        ID3v2_frame_comment_content *content;
+
+        if (!is_comment_frame(frames->frames[i])) continue;
+        content = parse_comment_frame_content(frames->frames[i]);
+        if (!content) return -1;
+        free_text_content(content->text);
+        free(content->language);
+        free(content);
+    }
+
+    return 0;
+}
+
+static int run_parse_apic_content(bench_case *c)
+{
+    ID3v2_frame_list *frames = c->tag->frames;
+
+    for (int i = 0; i < frames->count; i++) {
+        ID3v2_frame_apic_content *content;
+
+        if (!is_apic_frame(frames->frames[i])) continue;
+        content = parse_apic_frame_content(frames->frames[i]);
+        if (!content) return -1;
+        free_apic_content(content);
+    }
+
+    return 0;
+}
+
+static int run_text_utf8(bench_case *c)
+{
+    ID3v2_frame_list *frames = c->tag->frames;
+    char buffer[TEXT_BUFFER_SIZE];
+
+    for (int i = 0; i < frames->count; i++) {
+        if (!has_text(frames->frames[i])) continue;
+        if (get_frame_text_utf8(frames->frames[i], buffer, sizeof(buffer)) < 0) return -1;
+    }
+
+    return 0;
+}
+
+static int run_text_utf8_arena(bench_case *c)
+{
+    ID3v2_frame_list *frames = c->tag->frames;
+
+    for (int i = 0; i < frames->count; i++) {
+        if (!has_text(frames->frames[i])) continue;
+        if (!get_frame_text_utf8_in_arena(frames->frames[i], c->arena, NULL)) return -1;
+    }
+    arena_reset(c->arena);
+
+    return 0;
+}
+
+static int run_getters(bench_case *c)
+{
+    ID3v2_tag *tag = c->tag;
+    int found = 0;
+
+    found += tag_get_title(tag) != NULL;
+    found += tag_get_artist(tag) != NULL;
+    found += tag_get_album(tag) != NULL;
+    found += tag_get_album_artist(tag) != NULL;
+    found += tag_get_genre(tag) != NULL;
+    found += tag_get_track(tag) != NULL;
+    found += tag_get_year(tag) != NULL;
+    found += tag_get_comment(tag) != NULL;
+    found += tag_get_disc_number(tag) != NULL;
+    found += tag_get_composer(tag) != NULL;
+    found += tag_get_album_cover(tag) != NULL;
+
+    return found ? 0 : -1;
+}
+
+static int run_render(bench_case *c)
+{
+    int size = get_rendered_tag_size(c->tag, 0);
+    char *buffer = malloc(size);
+    int result;
+
+    if (!buffer) return -1;
+    result = render_tag(c->tag, 0, buffer, size) == size ? 0 : -1;
+    free(buffer);
+
+    return result;
+}
+
+static int run_set_tag(bench_case *c)
+{
+    ID3v2_io io;
+
+    io_from_memory(&io, &c->file);
+    return set_tag_with_io(&io, c->tag) == ID3_WRITE_FAILED ? -1 : 0;
+}
+
+// In the encoding of the case, UTF-16 for the mixed ones. It changes the
+// tag, so it comes last.
+static int run_set_text(bench_case *c)
+{
+    static const char text[] = "Caf\xC3\xA9 electric dreams (remastered)";
+    static const char list[] = "Orchestra\0Se\xC3\xB1or Blue\0\xC3\x9C" "ber Radio";
+    int encoding = c->spec->encoding;
+
+    if (encoding == CORPUS_MIXED) encoding = ID3_TEXT_ENCODING_UTF16_WITH_BOM;
+    if (encoding == CORPUS_ASCII) encoding = ID3_TEXT_ENCODING_ISO;
+
+    if (tag_set_text_frame(c->tag, TITLE_FRAME_ID, text, -1, (char) encoding) != 0) return -1;
+    if (tag_set_text_frame(c->tag, ARTIST_FRAME_ID, list, sizeof(list) - 1, (char) encoding) != 0) return -1;
+    if (tag_set_text_frame(c->tag, ALBUM_FRAME_ID, text, -1, (char) encoding) != 0) return -1;
+    return tag_set_text_frame(c->tag, COMMENT_FRAME_ID, text, -1, (char) encoding);
+}
+
+static long long tag_bytes(bench_case *c)
+{
+    return c->size;
+}
+
+static long long frame_bytes(bench_case *c)
+{
+    long long bytes = 0;
+    ID3v2_frame_list *frames = c->tag->frames;
+
+    for (int i = 0; i < frames->count; i++) bytes += frames->frames[i]->size;
+
+    return bytes;
+}
+
+static long long matching_bytes(bench_case *c, int (*matches)(ID3v2_frame *frame))
+{
+    long long bytes = 0;
+    ID3v2_frame_list *frames = c->tag->frames;
+
+    for (int i = 0; i < frames->count; i++) {
+        if (matches(frames->frames[i])) bytes += frames->frames[i]->size;
+    }
+
+    return bytes;
+}
+
+static long long text_bytes(bench_case *c)
+{
+    return matching_bytes(c, is_text_frame);
+}
+
+static long long text_utf8_bytes(bench_case *c)
+{
+    return matching_bytes(c, has_text);
+}
+
+static long long comment_bytes(bench_case *c)
+{
+    return matching_bytes(c, is_comment_frame);
+}
+
+static long long apic_bytes(bench_case *c)
+{
+    return matching_bytes(c, is_apic_frame);
+}
+
+static long long no_bytes(bench_case *c)
+{
+    (void) c;
+    return 0;
+}
+
+static const bench_op ops[] = {
+    { "load_buffer", run_load_buffer, tag_bytes },
+    { "load_lazy", run_load_lazy, tag_bytes },
+    { "parse_frame", run_parse_frame, frame_bytes },
+    { "parse_text_content", run_parse_text_content, text_bytes },
+    { "parse_comment_content", run_parse_comment_content, comment_bytes },
+    { "parse_apic_content", run_parse_apic_content, apic_bytes },
+    { "text_utf8", run_text_utf8, text_utf8_bytes },
+    { "text_utf8_arena", run_text_utf8_arena, text_utf8_bytes },
+    { "getters", run_getters, no_bytes },
+    { "render", run_render, tag_bytes },
+    { "set_tag", run_set_tag, tag_bytes },
+    { "set_text", run_set_text, no_bytes },
+    { NULL, NULL, NULL }
+};
+
+// Returns 0 or -1 if the generated tag does not load
+static int prepare_case(bench_case *c, const corpus_spec *spec)
+{
+    ID3v2_header header;
+    ID3v2_frame frame;
+    int offset, end;
+
+    memset(c, 0, sizeof(*c));
+    c->spec = spec;
+    c->bytes = make_corpus_tag(spec, 1, &c->size);
+    c->arena = new_arena(0);
+
+    c->tag = load_tag_with_buffer(c->bytes, c->size);
+    if (!c->tag || !parse_tag_header(c->bytes, c->size, &header)) return -1;
+
+    // parse_frame() works on the frames as they are once decoded
+    c->frames = malloc(c->size);
+    memcpy(c->frames, c->bytes, c->size);
+    if (needs_tag_decoding(&header)) decode_unsynchronisation(c->frames, c->bytes, c->size);
+    c->version = get_tag_orig_version(&header);
+
+    offset = ID3_HEADER + (header.extended_header_size ? header.extended_header_size + ID3_EXTENDED_HEADER_SIZE : 0);
+    end = ID3_HEADER + header.tag_size;
+    c->offsets = malloc(c->tag->frames->count * sizeof(int));
+    while (c->frame_count < c->tag->frames->count && parse_frame_header(c->frames, offset, c->version, &frame)) {
+        c->offsets[c->frame_count++] = offset;
+        offset += frame.size + (c->version == ID3v22 ? ID3_FRAME_v22 : ID3_FRAME);
+        if (offset >= end) break;
+    }
+
+    // the tag in front of some audio, set_tag() then rewrites it in place
+    c->file.size = c->size + AUDIO_SIZE;
+    c->file.capacity = c->file.size;
+    c->file.data = calloc(1, c->file.size);
+    memcpy(c->file.data, c->bytes, c->size);
+
+    return 0;
+}
+
+static void free_case(bench_case *c)
+{
+    free_tag(c->tag);
+    free(c->bytes);
+    free(c->frames);
+    free(c->offsets);
+    free(c->file.data);
+    free_arena(c->arena);
+}
+
+static void print_result(int format, bench_case *c, const bench_op *op, long iterations, double seconds,
+                         long long bytes, ID3v2_stats *stats, int runs)
+{
+    double ns_per_op = seconds * 1e9 / iterations;
+    double allocs_per_op = (double) stats->allocations / runs;
+    double bytes_allocated_per_op = (double) stats->bytes_allocated / runs;
+    double bytes_copied_per_op = (double) stats->bytes_copied / runs;
+    double mb_per_s = bytes * (double) iterations / seconds / (1024 * 1024);
+
+    if (format == FORMAT_JSON) {
+        printf("{\"case\":\"%s\",\"op\":\"%s\",\"tag_size\":%d,\"iterations\":%ld,\"ns_per_op\":%.1f,"
+               "\"allocs_per_op\":%.2f,\"bytes_allocated_per_op\":%.0f,\"bytes_copied_per_op\":%.0f,"
+               "\"mb_per_s\":%.2f}\n",
+               c->spec->name, op->name, c->size, iterations, ns_per_op, allocs_per_op,
+               bytes_allocated_per_op, bytes_copied_per_op, mb_per_s);
+    } else if (format == FORMAT_CSV) {
+        printf("%s,%s,%d,%ld,%.1f,%.2f,%.0f,%.0f,%.2f\n", c->spec->name, op->name, c->size, iterations,
+               ns_per_op, allocs_per_op, bytes_allocated_per_op, bytes_copied_per_op, mb_per_s);
+    } else {
+        printf("%-22s %-22s %14.1f ns/op %9.2f allocs/op %12.0f B/op %12.0f copied/op %10.2f MB/s\n",
+               c->spec->name, op->name, ns_per_op, allocs_per_op, bytes_allocated_per_op, bytes_copied_per_op,
+               mb_per_s);
+    }
+    fflush(stdout);
+}
+
+// Doubles the iterations until they take min_time, returns 0 or -1
+static int run_op(int format, bench_case *c, const bench_op *op, double min_time)
+{
+    long long bytes = op->bytes(c);
+    long iterations = 1;
+    double seconds;
+    ID3v2_stats stats;
+    int runs;
+
+    // frames the case does not have are not worth reporting
+    if (bytes == 0 && op->bytes != no_bytes) return 0;
+
+    // once untimed, so set_tag() finds its tag in place
+    if (op->run(c) != 0) return -1;
+
+    for (;;) {
+        double start = now();
+
+        for (long i = 0; i < iterations; i++) {
+            if (op->run(c) != 0) return -1;
+        }
+        seconds = now() - start;
+
+        if (seconds >= min_time) break;
+        iterations *= 2;
+    }
+
+    runs = iterations < COUNTED_RUNS ? (int) iterations : COUNTED_RUNS;
+    set_stats_enabled(1);
+    reset_thread_stats();
+    for (int i = 0; i < runs; i++) op->run(c);
+    get_thread_stats(&stats);
+    set_stats_enabled(0);
+
+    print_result(format, c, op, iterations, seconds, bytes, &stats, runs);
+    return 0;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "usage: %s [-t seconds] [-f text|csv|json] [-c case] [-o op] [-l]\n", program);
+    fprintf(stderr, "  -t seconds  minimum time per measurement (default: 0.2)\n");
+    fprintf(stderr, "  -f format   output format, json is one object per line (default: text)\n");
+    fprintf(stderr, "  -c case     only run this case, may be repeated\n");
+    fprintf(stderr, "  -o op       only run this operation, may be repeated\n");
+    fprintf(stderr, "  -l          list the cases and operations\n");
+}
+
+static int is_selected(const char *name, char **selected, int count)
+{
+    if (!count) return 1;
+
+    for (int i = 0; i < count; i++) {
+        if (strcmp(selected[i], name) == 0) return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    double min_time = 0.2;
+    int format = FORMAT_TEXT;
+    char **cases = calloc(argc, sizeof(char *));
+    char **op_names = calloc(argc, sizeof(char *));
+    int case_count = 0, op_count = 0;
+    int result = 0;
+    int option;
+
+    while ((option = getopt(argc, argv, "t:f:c:o:lh")) != -1) {
+        switch (option) {
+            case 't':
+                min_time = atof(optarg);
+                break;
+            case 'f':
+                if (strcmp(optarg, "text") == 0) {
+                    format = FORMAT_TEXT;
+                } else if (strcmp(optarg, "csv") == 0) {
+                    format = FORMAT_CSV;
+                } else if (strcmp(optarg, "json") == 0) {
+                    format = FORMAT_JSON;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'c':
+                if (!find_corpus_spec(optarg)) {
+                    fprintf(stderr, "%s: unknown case %s\n", argv[0], optarg);
+                    return 1;
+                }
+                cases[case_count++] = optarg;
+                break;
+            case 'o':
+                op_names[op_count++] = optarg;
+                break;
+            case 'l':
+                for (const corpus_spec *spec = corpus_specs; spec->name; spec++) printf("case %s\n", spec->name);
+                for (const bench_op *op = ops; op->name; op++) printf("op %s\n", op->name);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    set_error_reporting(0);
+
+    if (format == FORMAT_CSV) {
+        printf("case,op,tag_size,iterations,ns_per_op,allocs_per_op,bytes_allocated_per_op,bytes_copied_per_op,"
+               "mb_per_s\n");
+    }
+
+    for (const corpus_spec *spec = corpus_specs; spec->name; spec++) {
+        bench_case c;
+
+        if (!is_selected(spec->name, cases, case_count)) continue;
+
+        if (prepare_case(&c, spec) != 0) {
+            fprintf(stderr, "%s: could not load the %s tag\n", argv[0], spec->name);
+            free_case(&c);
+            result = 1;
+            continue;
+        }
+
+        for (const bench_op *op = ops; op->name; op++) {
+            if (!is_selected(op->name, op_names, op_count)) continue;
+
+            if (run_op(format, &c, op, min_time) != 0) {
+                fprintf(stderr, "%s: %s failed on %s\n", argv[0], op->name, spec->name);
+                result = 1;
+            }
+        }
+
+        free_case(&c);
+    }
+
+    free(cases);
+    free(op_names);
+    return result;
+}
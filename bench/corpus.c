@@ -0,0 +1,344 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+// Synthetic tags for the benchmarks. The content is pseudo random but only
+// depends on the spec and the seed, so every run measures the same bytes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "id3v2lib.h"
+#include "corpus.h"
+
+const corpus_spec corpus_specs[] = {
+    { "v22_10", 2, 10, 0, 0, 0, 256, CORPUS_MIXED, 6 },
+    { "v23_10", 3, 10, 0, 0, 0, 256, CORPUS_MIXED, 6 },
+    { "v24_10", 4, 10, 0, 0, 0, 256, CORPUS_MIXED, 6 },
+    { "v23_100", 3, 100, 0, 0, 0, 1024, CORPUS_MIXED, 6 },
+    { "v24_100", 4, 100, 0, 0, 0, 1024, CORPUS_MIXED, 6 },
+    { "v23_500", 3, 500, 0, 0, 0, 2048, CORPUS_MIXED, 6 },
+    { "v24_500", 4, 500, 0, 0, 0, 2048, CORPUS_MIXED, 6 },
+    { "v23_unsync_100", 3, 100, 1, 0, 0, 1024, CORPUS_MIXED, 6 },
+    { "v24_unsync_100", 4, 100, 1, 0, 0, 1024, CORPUS_MIXED, 6 },
+    { "v23_exthdr_100", 3, 100, 0, 1, 0, 1024, CORPUS_MIXED, 6 },
+    { "v24_exthdr_100", 4, 100, 0, 1, 0, 1024, CORPUS_MIXED, 6 },
+    { "v23_cover_64k", 3, 20, 0, 0, 64 * 1024, 2048, CORPUS_MIXED, 6 },
+    { "v23_cover_1m", 3, 20, 0, 0, 1024 * 1024, 2048, CORPUS_MIXED, 6 },
+    { "v24_cover_10m", 4, 20, 0, 0, 10 * 1024 * 1024, 2048, CORPUS_MIXED, 6 },
+    { "v23_unsync_cover_1m", 3, 20, 1, 0, 1024 * 1024, 2048, CORPUS_MIXED, 6 },
+    { "v24_ascii_100", 4, 100, 0, 0, 0, 1024, CORPUS_ASCII, 24 },
+    { "v24_latin1_100", 4, 100, 0, 0, 0, 1024, ID3_TEXT_ENCODING_ISO, 24 },
+    { "v24_utf16_100", 4, 100, 0, 0, 0, 1024, ID3_TEXT_ENCODING_UTF16_WITH_BOM, 24 },
+    { "v24_utf16be_100", 4, 100, 0, 0, 0, 1024, ID3_TEXT_ENCODING_UTF16BE_WITHOUT_BOM, 24 },
+    { "v24_utf8_100", 4, 100, 0, 0, 0, 1024, ID3_TEXT_ENCODING_UTF8, 24 },
+    { NULL, 0, 0, 0, 0, 0, 0, 0, 0 }
+};
+
+// Text frames that may appear once, with their ID3v2.2 IDs
+static const char *text_frame_ids[][2] = {
+    { "TIT2", "TT2" }, { "TPE1", "TP1" }, { "TALB", "TAL" }, { "TPE2", "TP2" },
+    { "TCON", "TCO" }, { "TRCK", "TRK" }, { "TYER", "TYE" }, { "TPOS", "TPA" },
+    { "TCOM", "TCM" }, { "TBPM", "TBP" }, { "TCOP", "TCR" }, { "TENC", "TEN" },
+    { "TIT1", "TT1" }, { "TIT3", "TT3" }, { "TLAN", "TLA" }, { "TPUB", "TPB" },
+    { "TSRC", "TRC" }, { "TSSE", "TSS" }, { "TEXT", "TXT" }, { "TOPE", "TOA" }
+};
+#define TEXT_FRAME_IDS ((int) (sizeof(text_frame_ids) / sizeof(text_frame_ids[0])))
+
+static const char *words[] = {
+    "the", "night", "river", "blue", "song", "of", "electric", "dreams", "love", "city",
+    "Orchestra", "live", "remastered", "Café", "über", "señor", "part", "II", "mix", "radio"
+};
+#define WORDS ((int) (sizeof(words) / sizeof(words[0])))
+
+typedef struct
+{
+    char *data;
+    int size;
+    int capacity;
+    unsigned int state;		// of the random generator
+} tag_buffer;
+
+static unsigned int next_random(tag_buffer *buffer)
+{
+    // xorshift32
+    buffer->state ^= buffer->state << 13;
+    buffer->state ^= buffer->state >> 17;
+    buffer->state ^= buffer->state << 5;
+    return buffer->state;
+}
+
+static char *reserve(tag_buffer *buffer, int size)
+{
+    if (buffer->size + size > buffer->capacity) {
+        int capacity = buffer->capacity ? buffer->capacity : 4096;
+        char *data;
+
+        while (buffer->size + size > capacity) capacity *= 2;
+        data = realloc(buffer->data, capacity);
+        if (!data) {
+            perror("realloc");
+            exit(1);
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+
+    buffer->size += size;
+    return buffer->data + buffer->size - size;
+}
+
+static void append(tag_buffer *buffer, const void *bytes, int size)
+{
+    memcpy(reserve(buffer, size), bytes, size);
+}
+
+// Big endian, syncsafe for ID3v2.4
+static void append_size(tag_buffer *buffer, int size, int bytes, int syncsafe)
+{
+    char *dest = reserve(buffer, bytes);
+
+    if (syncsafe) size = syncint_encode(size);
+    for (int i = bytes - 1; i >= 0; i--) {
+        dest[i] = (char) size;
+        size >>= 8;
+    }
+}
+
+// One character, written as encoding
+static void append_char(tag_buffer *buffer, char encoding, unsigned int c)
+{
+    if (encoding == ID3_TEXT_ENCODING_UTF16_WITH_BOM) {
+        append(buffer, (char[]) { (char) c, (char) (c >> 8) }, 2);
+    } else if (encoding == ID3_TEXT_ENCODING_UTF16BE_WITHOUT_BOM) {
+        append(buffer, (char[]) { (char) (c >> 8), (char) c }, 2);
+    } else if (encoding == ID3_TEXT_ENCODING_UTF8 && c >= 0x80) {
+        append(buffer, (char[]) { (char) (0xC0 | c >> 6), (char) (0x80 | (c & 0x3F)) }, 2);
+    } else {
+        append(buffer, (char[]) { (char) c }, 1);
+    }
+}
+
+// A UTF-8 string written as encoding, its characters are all Latin-1
+static void append_string(tag_buffer *buffer, char encoding, const char *string)
+{
+    const unsigned char *c = (const unsigned char *) string;
+
+    for (; *c; c++) {
+        if (*c >= 0xC0) {
+            append_char(buffer, encoding, (c[0] & 0x1F) << 6 | (c[1] & 0x3F));
+            c++;
+        } else {
+            append_char(buffer, encoding, *c);
+        }
+    }
+}
+
+static void append_terminator(tag_buffer *buffer, char encoding)
+{
+    int wide = encoding == ID3_TEXT_ENCODING_UTF16_WITH_BOM || encoding == ID3_TEXT_ENCODING_UTF16BE_WITHOUT_BOM;
+
+    append(buffer, "\0\0", wide ? 2 : 1);
+}
+
+static const char *pick_word(tag_buffer *buffer, int ascii)
+{
+    for (;;) {
+        const char *word = words[next_random(buffer) % WORDS];
+        const char *c = word;
+
+        if (!ascii) return word;
+        while (*c && (unsigned char) *c < 0x80) c++;
+        if (!*c) return word;
+    }
+}
+
+// Up to spec->words words, UTF-16 with a BOM in front
+static void append_text(tag_buffer *buffer, const corpus_spec *spec, char encoding)
+{
+    int count = 1 + next_random(buffer) % spec->words;
+
+    if (encoding == ID3_TEXT_ENCODING_UTF16_WITH_BOM) append(buffer, "\xFF\xFE", 2);
+
+    for (int i = 0; i < count; i++) {
+        if (i) append_char(buffer, encoding, ' ');
+        append_string(buffer, encoding, pick_word(buffer, spec->encoding == CORPUS_ASCII));
+    }
+}
+
+static char pick_encoding(tag_buffer *buffer, const corpus_spec *spec)
+{
+    unsigned int pick = next_random(buffer) % 8;
+
+    if (spec->encoding == CORPUS_ASCII) return ID3_TEXT_ENCODING_ISO;
+    if (spec->encoding != CORPUS_MIXED) return (char) spec->encoding;
+
+    if (pick == 0) return ID3_TEXT_ENCODING_UTF16_WITH_BOM;
+    if (pick == 1 && spec->version == 4) return ID3_TEXT_ENCODING_UTF8;
+    return ID3_TEXT_ENCODING_ISO;
+}
+
+// Starts the frame header, returns where its payload starts so the size can
+// be filled in by end_frame()
+static int begin_frame(tag_buffer *buffer, int version, const char *id, const char *id22)
+{
+    if (version == 2) {
+        append(buffer, id22, 3);
+        reserve(buffer, 3);
+    } else {
+        append(buffer, id, 4);
+        reserve(buffer, 4);
+        append(buffer, "\0\0", 2);
+    }
+
+    return buffer->size;
+}
+
+// An unsynchronised ID3v2.4 tag has every frame unsynchronised on its own,
+// flagged in its header and counted in its size
+static void end_frame(tag_buffer *buffer, const corpus_spec *spec, int start)
+{
+    int version = spec->version;
+    int size = buffer->size - start;
+
+    if (version == 4 && spec->unsynchronised) {
+        char *payload = malloc(size);
+        int encoded_size;
+
+        if (!payload) {
+            perror("malloc");
+            exit(1);
+        }
+        memcpy(payload, buffer->data + start, size);
+        buffer->size = start;
+        encoded_size = get_unsynchronised_size(payload, size);
+        encode_unsynchronisation(reserve(buffer, encoded_size), payload, size);
+        free(payload);
+
+        buffer->data[start - 1] |= ID3_FRAME_FLAG_V24_UNSYNCHRONISATION;
+        size = encoded_size;
+    }
+
+    buffer->size = start - (version == 2 ? 3 : 6);
+    append_size(buffer, size, version == 2 ? 3 : 4, version == 4);
+    buffer->size = start + size;
+}
+
+static void append_frame(tag_buffer *buffer, const corpus_spec *spec, int index)
+{
+    int version = spec->version;
+    char encoding = pick_encoding(buffer, spec);
+    char description[16];
+    int start;
+
+    if (index < TEXT_FRAME_IDS) {
+        start = begin_frame(buffer, version, text_frame_ids[index][0], text_frame_ids[index][1]);
+        append(buffer, &encoding, 1);
+        append_text(buffer, spec, encoding);
+    } else if (index % 7 == 0) {
+        start = begin_frame(buffer, version, "COMM", "COM");
+        append(buffer, &encoding, 1);
+        append(buffer, "eng", 3);
+        append_terminator(buffer, encoding);
+        append_text(buffer, spec, encoding);
+    } else {
+        // user defined text frames, as many as needed, Latin-1 in the mix
+        start = begin_frame(buffer, version, "TXXX", "TXX");
+        if (spec->encoding == CORPUS_MIXED) encoding = ID3_TEXT_ENCODING_ISO;
+        append(buffer, &encoding, 1);
+        snprintf(description, sizeof(description), "key%d", index);
+        if (encoding == ID3_TEXT_ENCODING_UTF16_WITH_BOM) append(buffer, "\xFF\xFE", 2);
+        append_string(buffer, encoding, description);
+        append_terminator(buffer, encoding);
+        append_text(buffer, spec, encoding);
+    }
+
+    end_frame(buffer, spec, start);
+}
+
+static void append_cover(tag_buffer *buffer, const corpus_spec *spec)
+{
+    int version = spec->version;
+    int size = spec->cover_size;
+    int start = begin_frame(buffer, version, "APIC", "PIC");
+    char *picture;
+
+    if (version == 2) {
+        append(buffer, "\0JPG\x03", 5);
+    } else {
+        append(buffer, "\0image/jpeg\0\x03", 13);
+    }
+    append(buffer, "Cover\0", 6);
+
+    // a JPEG start of image, then noise, which has its share of $FF bytes
+    picture = reserve(buffer, size);
+    for (int i = 0; i < size; i++) picture[i] = (char) (next_random(buffer) >> 24);
+    if (size >= 4) memcpy(picture, "\xFF\xD8\xFF\xE0", 4);
+
+    end_frame(buffer, spec, start);
+}
+
+// A whole tag for spec, from malloc(). *size is set to its length.
+char *make_corpus_tag(const corpus_spec *spec, unsigned int seed, int *size)
+{
+    tag_buffer frames = { NULL, 0, 0, seed ? seed : 1 };
+    tag_buffer tag = { NULL, 0, 0, 1 };
+    int ext_size = 0;
+    char flags = 0;
+
+    for (int i = 0; i < spec->frames; i++) append_frame(&frames, spec, i);
+    if (spec->cover_size > 0) append_cover(&frames, spec);
+
+    if (spec->extended_header && spec->version == 3) {
+        // its size (not counting itself), flags and padding size
+        ext_size = 10;
+        flags |= ID3_HEADER_FLAGS_HAS_EXTENDED_HEADER;
+    } else if (spec->extended_header && spec->version == 4) {
+        // its size (counting itself), one flag byte and no flags
+        ext_size = 6;
+        flags |= ID3_HEADER_FLAGS_HAS_EXTENDED_HEADER;
+    }
+    if (spec->unsynchronised) flags |= ID3_HEADER_FLAGS_HAS_UNSYNCHRONISATION;
+
+    append(&tag, "ID3", 3);
+    append(&tag, (char[]) { (char) spec->version, 0, flags }, 3);
+    reserve(&tag, 4);
+
+    if (ext_size == 10) {
+        append(&tag, "\0\0\0\x06\0\0", 6);
+        append_size(&tag, spec->padding, 4, 0);
+    } else if (ext_size == 6) {
+        append(&tag, "\0\0\0\x06\x01\0", 6);
+    }
+
+    if (spec->unsynchronised && spec->version != 4) {
+        char *dest = reserve(&tag, get_unsynchronised_size(frames.data, frames.size));
+        encode_unsynchronisation(dest, frames.data, frames.size);
+    } else {
+        append(&tag, frames.data, frames.size);
+    }
+    memset(reserve(&tag, spec->padding), 0, spec->padding);
+
+    // the size of everything after the header
+    *size = tag.size;
+    tag.size = 6;
+    append_size(&tag, *size - ID3_HEADER, 4, 1);
+
+    free(frames.data);
+    return tag.data;
+}
+
+const corpus_spec *find_corpus_spec(const char *name)
+{
+    for (const corpus_spec *spec = corpus_specs; spec->name; spec++) {
+        if (strcmp(spec->name, name) == 0) return spec;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,37 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#ifndef id3v2lib_corpus_h
+#define id3v2lib_corpus_h
+
+// Values of corpus_spec.encoding besides the ID3_TEXT_ENCODING_* ones
+#define CORPUS_MIXED -1		// mostly Latin-1, some UTF-16 and on ID3v2.4 UTF-8
+#define CORPUS_ASCII -2		// Latin-1 with only the ASCII words
+
+// What a synthetic tag looks like
+typedef struct
+{
+    const char *name;
+    int version;		// the major version byte: 2, 3 or 4
+    int frames;			// text and comment frames, the cover comes on top
+    int unsynchronised;
+    int extended_header;
+    int cover_size;		// bytes of picture, 0 for no cover
+    int padding;
+    int encoding;		// of the text, comment and TXXX frames
+    int words;			// most words in a value
+} corpus_spec;
+
+// The benchmark cases, ending with a spec without a name
+extern const corpus_spec corpus_specs[];
+
+char *make_corpus_tag(const corpus_spec *spec, unsigned int seed, int *size);
+const corpus_spec *find_corpus_spec(const char *name);
+
+#endif
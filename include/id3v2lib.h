@@ -19,13 +19,55 @@ extern "C" {
 #include "id3v2lib/header.h"
 #include "id3v2lib/frame.h"
 #include "id3v2lib/utils.h"
+#include "id3v2lib/alloc.h"
+#include "id3v2lib/stats.h"
+#include "id3v2lib/arena.h"
+#include "id3v2lib/unsync.h"
+#include "id3v2lib/fileio.h"
+#include "id3v2lib/padding.h"
+#include "id3v2lib/parser.h"
+#include "id3v2lib/render.h"
+#include "id3v2lib/cover.h"
+#include "id3v2lib/id3v1.h"
+#include "id3v2lib/text.h"
+#ifndef _WIN32
+#include "id3v2lib/batch.h"
+#include "id3v2lib/cache.h"
+#endif
 
 ID3v2_tag *load_tag(const char *file_name);
 ID3v2_tag *load_tag_with_buffer(const char *buffer, int length);
+ID3v2_tag *load_tag_mmap(const char *file_name);
+ID3v2_tag *load_tag_lazy(const char *file_name);
+ID3v2_tag *load_tag_with_buffer_lazy(const char *buffer, int length);
+ID3v2_tag *load_tag_frames(const char *file_name, char **frame_ids, int count);
+ID3v2_tag *load_tag_frames_with_buffer(const char *buffer, int length, char **frame_ids, int count);
+ID3v2_tag *load_tag_in_arena(const char *file_name, ID3v2_arena *arena);
+ID3v2_tag *load_any_tag(const char *file_name);
+ID3v2_tag *load_tag_with_buffer_in_arena(const char *buffer, int length, ID3v2_arena *arena);
 void remove_tag(const char *file_name);
-void set_tag(const char *file_name, ID3v2_tag *tag);
+int set_tag(const char *file_name, ID3v2_tag *tag);
+int set_tag_atomic(const char *file_name, ID3v2_tag *tag);
+int set_tag_append(const char *file_name, ID3v2_tag *tag);
+
+// The same without a path, see fileio.h for the backends
+ID3v2_tag *load_tag_with_io(ID3v2_io *io);
+ID3v2_tag *load_tag_lazy_with_io(ID3v2_io *io);
+ID3v2_tag *load_tag_frames_with_io(ID3v2_io *io, char **frame_ids, int count);
+ID3v2_tag *load_tag_in_arena_with_io(ID3v2_io *io, ID3v2_arena *arena);
+ID3v2_tag *load_any_tag_with_io(ID3v2_io *io);
+#ifndef _WIN32
+ID3v2_tag *load_tag_mmap_with_fd(int fd);
+ID3v2_tag *load_tag_lazy_with_fd(int fd);
+#endif
+int remove_tag_with_io(ID3v2_io *io);
+int set_tag_with_io(ID3v2_io *io, ID3v2_tag *tag);
+int set_tag_append_with_io(ID3v2_io *io, ID3v2_tag *tag);
 
 // Getter functions
+ID3v2_frame *tag_get_frame(ID3v2_tag *tag, char *frame_id);
+ID3v2_frame *tag_get_nth_frame(ID3v2_tag *tag, char *frame_id, int n);
+int tag_count_frames(ID3v2_tag *tag, char *frame_id);
 ID3v2_frame *tag_get_title(ID3v2_tag *tag);
 ID3v2_frame *tag_get_artist(ID3v2_tag *tag);
 ID3v2_frame *tag_get_album(ID3v2_tag *tag);
@@ -38,7 +80,8 @@ ID3v2_frame *tag_get_disc_number(ID3v2_tag *tag);
 ID3v2_frame *tag_get_composer(ID3v2_tag *tag);
 ID3v2_frame *tag_get_album_cover(ID3v2_tag *tag);
 
-// Setter functions
+// Setter functions, text is UTF-8
+int tag_set_text_frame(ID3v2_tag *tag, char *frame_id, const char *text, int size, char encoding);
 void tag_set_title(char *title, char encoding, ID3v2_tag *tag);
 void tag_set_artist(char *artist, char encoding, ID3v2_tag *tag);
 void tag_set_album(char *album, char encoding, ID3v2_tag *tag);
@@ -51,6 +94,8 @@ void tag_set_disc_number(char *disc_number, char encoding, ID3v2_tag *tag);
 void tag_set_composer(char *composer, char encoding, ID3v2_tag *tag);
 void tag_set_album_cover(const char *filename, ID3v2_tag *tag);
 void tag_set_album_cover_from_bytes(char *album_cover_bytes, char *mimetype, int picture_size, ID3v2_tag *tag);
+int tag_set_album_cover_with_io(ID3v2_io *io, char *mimetype, ID3v2_tag *tag);
+int tag_compress_frame(ID3v2_tag *tag, ID3v2_frame *frame);
 
 #ifdef __cplusplus
 } // end of extern C
@@ -0,0 +1,28 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#ifndef id3v2lib_alloc_h
+#define id3v2lib_alloc_h
+
+#include <stddef.h>
+
+#include "types.h"
+
+void set_allocator(const ID3v2_allocator *allocator);
+void get_allocator(ID3v2_allocator *allocator);
+
+// What the library allocates with, use mem_free() on what it hands out when
+// an allocator is set
+void *mem_alloc(size_t size);
+void *mem_calloc(size_t count, size_t size);
+void *mem_realloc(void *pointer, size_t size);
+void mem_free(void *pointer);
+char *mem_strdup(const char *string);
+
+#endif
@@ -0,0 +1,21 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#ifndef id3v2lib_arena_h
+#define id3v2lib_arena_h
+
+#include "types.h"
+
+ID3v2_arena *new_arena(int size);
+void *arena_alloc(ID3v2_arena *arena, int size);
+int arena_owns(ID3v2_arena *arena, const void *pointer);
+void arena_reset(ID3v2_arena *arena);
+void free_arena(ID3v2_arena *arena);
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#ifndef id3v2lib_batch_h
+#define id3v2lib_batch_h
+
+#include "types.h"
+
+// Called from the worker threads, possibly at the same time. The tag is NULL
+// if the file has no tag or could not be read (error is then the errno value),
+// and it is only valid until the callback returns.
+typedef void (*ID3v2_scan_callback)(const char *file_name, ID3v2_tag *tag, int error, void *user_data);
+
+typedef struct
+{
+    int threads;		// 0 uses one thread per online CPU
+    ID3v2_scan_callback callback;
+    void *user_data;
+    int id3v1;			// fall back to the ID3v1 tag, as load_any_tag() does
+    ID3v2_tag_cache *cache;	// answer unchanged files from it, not used with id3v1
+} ID3v2_scan_options;
+
+typedef struct
+{
+    long files;			// files scanned
+    long tags;			// files with a tag
+    long errors;		// files that could not be read
+    long cached;		// files answered from the cache without being opened
+    long long bytes;		// tag bytes read
+    double seconds;		// wall clock time of the scan
+} ID3v2_scan_stats;
+
+// A change edit_files() makes to every file. Text frames ("T...") and
+// comments ("COMM") can be set, frames of any type can be removed.
+typedef struct
+{
+    char *frame_id;
+    char *text;			// UTF-8, NULL removes every frame_id frame
+    char encoding;		// ID3_TEXT_ENCODING_* it is written in
+} ID3v2_frame_edit;
+
+typedef struct
+{
+    int threads;		// 0 uses one thread per online CPU
+    int atomic;			// write every changed file with set_tag_atomic()
+    int append;			// append the tag to files without one, see set_tag_append()
+} ID3v2_edit_options;
+
+typedef struct
+{
+    int result;			// ID3_WRITE_*
+    int error;			// errno value when result is ID3_WRITE_FAILED
+} ID3v2_edit_result;
+
+typedef struct
+{
+    long files;			// files edited
+    long in_place;		// files whose tag was overwritten in place
+    long rewritten;		// files whose audio had to be moved
+    long unchanged;		// files that already had the edits
+    long errors;		// files that could not be read or written
+    long long bytes;		// tag bytes written
+    double seconds;		// wall clock time of the batch
+} ID3v2_edit_stats;
+
+int scan_files(char **file_names, int count, ID3v2_scan_options *options, ID3v2_scan_stats *stats);
+int scan_directory(const char *path, ID3v2_scan_options *options, ID3v2_scan_stats *stats);
+int edit_files(char **file_names, int count, ID3v2_frame_edit *edits, int edit_count,
+               ID3v2_edit_options *options, ID3v2_edit_result *results, ID3v2_edit_stats *stats);
+
+#endif
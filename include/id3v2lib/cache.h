@@ -0,0 +1,27 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#ifndef id3v2lib_cache_h
+#define id3v2lib_cache_h
+
+#include "types.h"
+#include "batch.h"
+
+ID3v2_tag_cache *open_tag_cache(const char *file_name, char **frame_ids, int count);
+int save_tag_cache(ID3v2_tag_cache *cache);
+void close_tag_cache(ID3v2_tag_cache *cache);
+ID3v2_tag *load_cached_tag(ID3v2_tag_cache *cache, const char *file_name);
+int invalidate_cached_tag(ID3v2_tag_cache *cache, const char *file_name);
+void clear_tag_cache(ID3v2_tag_cache *cache);
+int warm_tag_cache(ID3v2_tag_cache *cache, char **file_names, int count, int threads, ID3v2_scan_stats *stats);
+
+// Called by scan_files()
+int read_cached_tag(ID3v2_tag_cache *cache, const char *file_name, ID3v2_tag **tag);
+
+#endif
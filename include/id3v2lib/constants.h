@@ -24,6 +24,8 @@
 #define ID3_HEADER_FLAGS_HAS_UNSYNCHRONISATION (1 << 7)
 #define ID3_HEADER_FLAGS_HAS_EXTENDED_HEADER   (1 << 6)
 #define ID3_HEADER_FLAGS_EXPERIMENTAL          (1 << 5)
+#define ID3_HEADER_FLAGS_HAS_FOOTER            (1 << 4)	// ID3v2.4
+#define ID3_FOOTER 10
 
 #define NO_COMPATIBLE_TAG 0
 #define ID3v22  1
@@ -44,6 +46,18 @@
 #define ID3_FRAME_ENCODING 1
 #define ID3_FRAME_LANGUAGE 3
 #define ID3_FRAME_SHORT_DESCRIPTION 1
+#define ID3_FRAME_DATA_LENGTH 4		// v2.4 data length indicator, v2.3 decompressed size
+
+// Format flags, in the second flags byte. A frame with any of them set
+// has to be decoded before its payload can be read, see load_frame_data()
+#define ID3_FRAME_FLAG_V23_COMPRESSION (1 << 7)
+#define ID3_FRAME_FLAG_V23_ENCRYPTION  (1 << 6)
+#define ID3_FRAME_FLAG_V23_GROUPING    (1 << 5)
+#define ID3_FRAME_FLAG_V24_GROUPING    (1 << 6)
+#define ID3_FRAME_FLAG_V24_COMPRESSION (1 << 3)
+#define ID3_FRAME_FLAG_V24_ENCRYPTION  (1 << 2)
+#define ID3_FRAME_FLAG_V24_UNSYNCHRONISATION (1 << 1)
+#define ID3_FRAME_FLAG_V24_DATA_LENGTH (1 << 0)
 
 #define ID3_TEXT_ENCODING_ISO 0
 #define ID3_TEXT_ENCODING_UTF16_WITH_BOM 1		// ID3v2.4 (was UCS-2 in v2.3)
@@ -51,6 +65,50 @@
 #define ID3_TEXT_ENCODING_UTF8 3			// ID3v2.4
 // END TAG_FRAME CONSTANTS
 
+/**
+ * ID3V1 CONSTANTS
+ */
+#define ID3V1_TAG_SIZE 128	// "TAG" and the fields, the last bytes of the file
+// END ID3V1 CONSTANTS
+
+/**
+ * SET_TAG RESULTS
+ */
+#define ID3_WRITE_FAILED -1
+#define ID3_WRITE_UNCHANGED 0	// edit_files(): the file already had the edits, it was not written
+#define ID3_WRITE_IN_PLACE 1	// the tag fitted in the old one, audio was not moved
+#define ID3_WRITE_REWRITE 2	// the whole file was rewritten
+// END SET_TAG RESULTS
+
+/**
+ * PADDING POLICY
+ */
+#define ID3_PADDING_FS_BLOCK -1	// block_size: the block size of the filesystem, where known
+#define ID3_PADDING_DEFAULT_FIXED 2048
+#define ID3_PADDING_DEFAULT_PERCENT 10
+// END PADDING POLICY
+
+/**
+ * STATS PHASES
+ */
+#define ID3_PHASE_HEADER 0	// parsing the tag header, looking for an appended one included
+#define ID3_PHASE_FRAMES 1	// walking the frames of a loaded tag
+#define ID3_PHASE_CONTENT 2	// parse_*_frame_content()
+#define ID3_PHASE_RENDER 3	// serializing a tag, see render_tag()
+#define ID3_PHASE_SHIFT 4	// moving the audio to make room for a tag
+#define ID3_PHASES 5
+// END STATS PHASES
+
+/**
+ * PARSER STATUS
+ */
+#define ID3_PARSE_ERROR -1
+#define ID3_PARSE_MORE 0	// feed more bytes, at least parser_needed() of them
+#define ID3_PARSE_DONE 1	// the whole tag has been read, the audio starts at parser->position
+#define ID3_PARSE_NO_TAG 2	// the stream does not start with a supported tag
+#define ID3_PARSE_STOPPED 3	// the frame callback asked to stop
+// END PARSER STATUS
+
 /**
  * FRAME IDs
  */
@@ -0,0 +1,38 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#ifndef id3v2lib_cover_h
+#define id3v2lib_cover_h
+
+#include "types.h"
+
+// Receives the picture in chunks, in order. Return 0 to go on, anything
+// else stops the extraction.
+typedef int (*ID3v2_picture_sink)(const char *bytes, int size, void *user_data);
+
+typedef struct
+{
+    char mime_type[64];		// "image/xxx" built from the image format for ID3v2.2
+    char picture_type;
+    int picture_size;
+    long long offset;		// of the picture in the file, -1 if it is not stored as is
+} ID3v2_picture_info;
+
+// All of them return 1 when the picture was extracted, 0 when the file has
+// no album cover and -1 on error. info may be NULL.
+int find_album_cover_with_io(ID3v2_io *io, ID3v2_picture_info *info);
+int stream_album_cover_with_io(ID3v2_io *io, ID3v2_picture_sink sink, void *user_data, ID3v2_picture_info *info);
+int stream_album_cover_with_buffer(const char *buffer, int length, ID3v2_picture_sink sink, void *user_data,
+                                   ID3v2_picture_info *info);
+#ifndef _WIN32
+int extract_album_cover(const char *file_name, int fd, ID3v2_picture_info *info);
+int extract_album_cover_with_io(ID3v2_io *io, int fd, ID3v2_picture_info *info);
+#endif
+
+#endif
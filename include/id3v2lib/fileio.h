@@ -0,0 +1,39 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#ifndef id3v2lib_fileio_h
+#define id3v2lib_fileio_h
+
+#include <stdio.h>
+
+#include "types.h"
+
+// Backends
+#ifndef _WIN32
+void io_from_fd(ID3v2_io *io, int fd);
+#endif
+void io_from_stdio(ID3v2_io *io, FILE *file);
+void io_from_memory(ID3v2_io *io, ID3v2_memory_file *memory);
+int io_open_file(ID3v2_io *io, const char *file_name, int writable);
+void io_close_file(ID3v2_io *io);
+
+// Helpers used by the loaders and writers
+int io_read_at(ID3v2_io *io, char *buffer, int size, long long offset);
+int io_write_at(ID3v2_io *io, const char *buffer, int size, long long offset);
+int io_writev(ID3v2_io *io, const ID3v2_iovec *iov, int count, long long offset);
+long long io_size(ID3v2_io *io);
+int io_truncate(ID3v2_io *io, long long size);
+int io_move(ID3v2_io *io, long long from, long long to, long long length);
+int io_shift(ID3v2_io *io, long long offset, long long distance);
+int io_copy(ID3v2_io *dest, long long dest_offset, ID3v2_io *src, long long src_offset, long long length);
+#ifndef _WIN32
+int io_send(ID3v2_io *src, long long offset, long long length, int fd);
+#endif
+
+#endif
@@ -14,6 +14,15 @@
 #include "constants.h"
 
 ID3v2_frame *parse_frame(char *bytes, int offset, int version);
+ID3v2_frame *parse_frame_in_place(char *bytes, int offset, int version);
+int parse_frame_header(char *bytes, int offset, int version, ID3v2_frame *frame);
+char *load_frame_data(ID3v2_frame *frame);
+char *load_frame_data_in_arena(ID3v2_frame *frame, ID3v2_arena *arena);
+const char *peek_frame_data(ID3v2_frame *frame, int *size, char **decoded);
+int is_frame_encoded(ID3v2_frame *frame);
+char *get_v23_frame(ID3v2_frame *frame, ID3v2_frame *converted);
+void convert_frame_to_v23(ID3v2_frame *frame);
+char *compress_frame_payload(const char *data, int size, int *compressed_size);
 ID3v2_frame_text_content *parse_text_frame_content(ID3v2_frame *frame);
 ID3v2_frame_comment_content *parse_comment_frame_content(ID3v2_frame *frame);
 ID3v2_frame_apic_content *parse_apic_frame_content(ID3v2_frame *frame);
@@ -16,8 +16,17 @@
 
 ID3v2_header *get_tag_header(const char *file_name);
 ID3v2_header *get_tag_header_with_buffer(const char *buffer, int length);
+int parse_tag_header(const char *buffer, int length, ID3v2_header *tag_header);
+#ifndef _WIN32
+int probe_tag_header(int fd, ID3v2_header *tag_header);
+#endif
+long long find_appended_tag(const char *tail, int length, long long size);
+long long find_appended_tag_with_io(ID3v2_io *io);
+int parse_extended_header_size(const char *bytes, int orig_major_version);
+int get_tag_total_size(ID3v2_header *tag_header);
 int get_tag_version(ID3v2_header *tag_header);
 int get_tag_orig_version(ID3v2_header *tag_header);
+int needs_tag_decoding(ID3v2_header *tag_header);
 void edit_tag_size(ID3v2_tag *tag);
 
 #endif
@@ -0,0 +1,22 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#ifndef id3v2lib_id3v1_h
+#define id3v2lib_id3v1_h
+
+#include "types.h"
+#include "constants.h"
+
+int parse_id3v1_tag(const char *bytes, ID3v1_tag *tag);
+int read_id3v1_tag(const char *file_name, ID3v1_tag *tag);
+int read_id3v1_tag_with_io(ID3v2_io *io, ID3v1_tag *tag);
+const char *get_id3v1_genre_name(int genre);
+ID3v2_frame_list *get_id3v1_frames(ID3v1_tag *tag);
+
+#endif
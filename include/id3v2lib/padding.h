@@ -0,0 +1,23 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#ifndef id3v2lib_padding_h
+#define id3v2lib_padding_h
+
+#include "types.h"
+
+void set_padding_policy(const ID3v2_padding_policy *policy);
+void get_padding_policy(ID3v2_padding_policy *policy);
+int get_padding(const ID3v2_padding_policy *policy, int frames_size, int block_size);
+
+void get_write_stats(ID3v2_write_stats *stats);
+void reset_write_stats(void);
+void count_tag_write(int result, int old_size, long long distance, long long bytes_moved);
+
+#endif
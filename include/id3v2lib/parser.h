@@ -0,0 +1,51 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#ifndef id3v2lib_parser_h
+#define id3v2lib_parser_h
+
+#include "types.h"
+#include "constants.h"
+
+// Called once per frame as soon as all of it has arrived. The frame and its
+// data are only valid until the callback returns. Return 0 to go on, anything
+// else stops the parser (parser_feed() then returns ID3_PARSE_STOPPED).
+typedef int (*ID3v2_frame_callback)(ID3v2_frame *frame, void *user_data);
+
+// Parses a tag from bytes pushed in chunks of any size, see parser_feed()
+typedef struct
+{
+    ID3v2_header tag_header;	// valid once the header has arrived
+    long long position;		// stream bytes consumed, where the audio starts once done
+    int status;			// ID3_PARSE_* of the last parser_feed()
+    int state;
+    int version;
+    int frame_header_size;
+    int frames_end;		// stream offset of the end of the frames (padding included)
+    int skip_to;		// stream offset the parser skips to
+    int last_ff;		// unsynchronisation: the last byte read was $FF
+    ID3v2_frame frame;		// the frame being read
+    char head[ID3_HEADER + ID3_EXTENDED_HEADER_SIZE];
+    int wanted;			// bytes of head or buffer being read
+    int buffered;
+    char *buffer;		// frame data, grows to the largest frame
+    int capacity;
+    char **frame_ids;		// only these frames are read, the others are skipped
+    int frame_count;
+    ID3v2_frame_callback callback;
+    void *user_data;
+} ID3v2_parser;
+
+ID3v2_parser *new_parser(ID3v2_frame_callback callback, void *user_data);
+void parser_select_frames(ID3v2_parser *parser, char **frame_ids, int count);
+int parser_feed(ID3v2_parser *parser, const char *bytes, int length);
+int parser_needed(ID3v2_parser *parser);
+void free_parser(ID3v2_parser *parser);
+
+#endif
@@ -0,0 +1,25 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#ifndef id3v2lib_render_h
+#define id3v2lib_render_h
+
+#include "types.h"
+
+int get_rendered_tag_version(ID3v2_tag *tag);
+int get_rendered_frames_size(ID3v2_tag *tag);
+int get_rendered_tag_size(ID3v2_tag *tag, int padding);
+int get_rendered_appended_tag_size(ID3v2_tag *tag);
+int render_tag(ID3v2_tag *tag, int padding, char *buffer, int size);
+int render_appended_tag(ID3v2_tag *tag, char *buffer, int size);
+int render_tag_iovec(ID3v2_tag *tag, int padding, ID3v2_rendered_tag *rendered);
+int render_appended_tag_iovec(ID3v2_tag *tag, ID3v2_rendered_tag *rendered);
+void free_rendered_tag(ID3v2_rendered_tag *rendered);
+
+#endif
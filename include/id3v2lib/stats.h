@@ -0,0 +1,32 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#ifndef id3v2lib_stats_h
+#define id3v2lib_stats_h
+
+#include "types.h"
+
+void set_stats_enabled(int enabled);
+int get_stats_enabled(void);
+void get_thread_stats(ID3v2_stats *stats);
+void reset_thread_stats(void);
+const char *get_phase_name(int phase);
+
+// Called by the library where the work is done
+void count_allocation(long long size);
+void count_free(void);
+void count_copy(long long size);
+void count_read(long long size);
+void count_written(long long size);
+void count_moved(long long size);
+void count_syscalls(int count);
+long long start_phase(void);
+void end_phase(int phase, long long start);
+
+#endif
@@ -0,0 +1,24 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#ifndef id3v2lib_text_h
+#define id3v2lib_text_h
+
+#include "types.h"
+
+int get_utf8_size(const char *src, int size, int encoding);
+int text_to_utf8(char *dest, int dest_size, const char *src, int size, int encoding);
+int get_frame_text_utf8(ID3v2_frame *frame, char *buffer, int size);
+char *get_frame_text_utf8_in_arena(ID3v2_frame *frame, ID3v2_arena *arena, int *length);
+int is_v24_text_frame(ID3v2_frame *frame);
+int get_encoded_text_size(const char *src, int size, int encoding);
+int utf8_to_text(char *dest, int dest_size, const char *src, int size, int encoding);
+char *new_text_frame_payload(const char *frame_id, const char *text, int size, int encoding, int *payload_size);
+
+#endif
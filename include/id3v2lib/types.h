@@ -10,8 +10,30 @@
 #ifndef id3v2lib_types_h
 #define id3v2lib_types_h
 
+// this piece of code makes this header usable under MSVC
+// without downloading msinttypes
+#ifndef _MSC_VER
+  #include <inttypes.h>
+#else
+  typedef unsigned short uint16_t;
+  typedef unsigned int uint32_t;
+#endif
+
 #include "constants.h"
 
+// One buffer of a gathered write, laid out as struct iovec where there is one
+#ifndef _WIN32
+  #include <sys/uio.h>
+  typedef struct iovec ID3v2_iovec;
+#else
+  #include <stddef.h>
+  typedef struct
+  {
+      void *iov_base;
+      size_t iov_len;
+  } ID3v2_iovec;
+#endif
+
 
 typedef struct
 {
@@ -23,6 +45,7 @@ typedef struct
     int tag_size;
     int extended_header_size;
     int unsynchronised;
+    int has_footer;
 } ID3v2_header;
 
 typedef struct
@@ -56,14 +79,36 @@ typedef struct
     int version;
     char flags[ID3_FRAME_FLAGS];
     char *data;
+    char *source;		// payload inside the loaded tag while data is not loaded yet
 } ID3v2_frame;
 
-typedef struct _ID3v2_frame_list
+typedef struct _ID3v2_arena_block
+{
+    struct _ID3v2_arena_block *next;
+    int size;
+    int used;
+} ID3v2_arena_block;
+
+typedef struct
+{
+    ID3v2_arena_block *blocks;	// the block being filled comes first
+    int size;			// sum of all block sizes
+} ID3v2_arena;
+
+typedef struct
 {
-    ID3v2_frame *frame;
-    struct _ID3v2_frame_list *start;
-    struct _ID3v2_frame_list *last;
-    struct _ID3v2_frame_list *next;
+    uint32_t id;		// the 4 frame ID bytes
+    int position;		// in ID3v2_frame_list.frames
+} ID3v2_frame_index_entry;
+
+typedef struct
+{
+    ID3v2_frame **frames;	// in tag order
+    int count;
+    int capacity;
+    ID3v2_frame_index_entry *index;	// sorted by id, then position
+    int index_valid;
+    ID3v2_arena *arena;		// the arrays come from here if set
 } ID3v2_frame_list;
 
 typedef struct
@@ -71,8 +116,113 @@ typedef struct
     char *raw;
     ID3v2_header *tag_header;
     ID3v2_frame_list *frames;
+    char *mapping;		// set by load_tag_mmap(), frame data may point into it
+    int mapping_size;
+    ID3v2_arena *arena;		// set by the *_in_arena() loaders
+    ID3v2_frame_list *fallback;	// made from the ID3v1 tag, see load_any_tag()
 } ID3v2_tag;
 
+// An ID3v1 or ID3v1.1 tag, the last 128 bytes of the file. The strings are
+// Latin-1, without the zero bytes or spaces padding them out.
+typedef struct
+{
+    char title[31];
+    char artist[31];
+    char album[31];
+    char year[5];
+    char comment[31];
+    int track;			// ID3v1.1 only, 0 if there is none
+    int genre;			// see get_id3v1_genre_name(), 255 if there is none
+} ID3v1_tag;
+
+// How much padding set_tag() gives a tag it has to resize
+typedef struct
+{
+    int fixed;			// bytes
+    int percent;		// of the size of the frames, on top of fixed
+    int block_size;		// the whole tag is rounded up to a multiple of this, 0 for none
+    int max;			// padding never exceeds this and bigger padding is shrunk, 0 for no limit
+} ID3v2_padding_policy;
+
+// What set_tag() had to do, counted across all threads since the last reset
+typedef struct
+{
+    long long writes;
+    long long in_place;
+    long long added;		// rewrites because the file had no tag
+    long long grown;		// rewrites because the frames no longer fitted
+    long long shrunk;		// rewrites because the padding was over the maximum
+    long long failed;
+    long long bytes_moved;	// audio moved by the rewrites
+} ID3v2_write_stats;
+
+// Replaces malloc(), realloc() and free() for everything the library
+// allocates, see set_allocator(). user_data is passed to every call.
+typedef struct
+{
+    void *(*malloc)(size_t size, void *user_data);
+    void *(*realloc)(void *pointer, size_t size, void *user_data);
+    void (*free)(void *pointer, void *user_data);
+    void *user_data;
+} ID3v2_allocator;
+
+// What the library did on the calling thread since reset_thread_stats(),
+// only counted while set_stats_enabled() is on
+typedef struct
+{
+    long long allocations;	// malloc(), calloc() and realloc() calls
+    long long frees;
+    long long bytes_allocated;
+    long long bytes_copied;	// frame data and payloads copied in memory
+    long long bytes_read;	// through ID3v2_io, whatever the backend
+    long long bytes_written;	// same, temporary files included
+    long long bytes_moved;	// audio moved or copied to make room for a tag
+    long long syscalls;		// made on file descriptors, see io_from_fd()
+    long long phase_ns[ID3_PHASES];	// time spent in each ID3_PHASE_*
+} ID3v2_stats;
+
+// Where a tag is read from and written to. pread may be NULL for streams
+// that can only be read forward, write, truncate and size are only needed
+// to modify the tag. Callbacks return -1 on error. See io_move() and
+// io_shift() for move and shift.
+typedef struct
+{
+    void *handle;
+    long long position;		// stream position when there is no pread
+    int (*read)(void *handle, char *buffer, int size);
+    int (*pread)(void *handle, char *buffer, int size, long long offset);
+    int (*write)(void *handle, const char *buffer, int size, long long offset);
+    int (*truncate)(void *handle, long long size);
+    long long (*size)(void *handle);
+    // Optional, return -1 to fall back to copying through a buffer
+    int (*move)(void *handle, long long from, long long to, long long length);
+    int (*shift)(void *handle, long long offset, long long distance);
+    // Optional, writes all the buffers from offset on, returns 0 or -1
+    int (*writev)(void *handle, const ID3v2_iovec *iov, int count, long long offset);
+    int block_size;		// shift() only works in whole blocks, 0 if unknown
+} ID3v2_io;
+
+// Decoded tags kept on disk between runs, see open_tag_cache(). Its
+// fields are private to cache.c.
+typedef struct _ID3v2_tag_cache ID3v2_tag_cache;
+
+// A rendered tag as a list of buffers, see render_tag_iovec()
+typedef struct
+{
+    ID3v2_iovec *iov;		// headers and small frames are copied, big payloads are referenced
+    int count;
+    long long size;		// of the whole tag
+} ID3v2_rendered_tag;
+
+// In memory file for io_from_memory(), data grows with realloc() when written past capacity
+typedef struct
+{
+    char *data;
+    long long size;
+    long long capacity;
+    long long position;		// next byte read()
+} ID3v2_memory_file;
+
 // Constructor functions
 ID3v2_header *new_header();
 ID3v2_tag *new_tag();
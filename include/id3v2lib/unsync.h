@@ -0,0 +1,17 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#ifndef id3v2lib_unsync_h
+#define id3v2lib_unsync_h
+
+int decode_unsynchronisation(char *dest, const char *src, int length);
+int encode_unsynchronisation(char *dest, const char *src, int length);
+int get_unsynchronised_size(const char *src, int length);
+
+#endif
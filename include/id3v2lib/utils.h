@@ -10,23 +10,23 @@
 #ifndef id3v2lib_utils_h
 #define id3v2lib_utils_h
 
-// this piece of code makes this header usable under MSVC
-// without downloading msinttypes
-#ifndef _MSC_VER
-  #include <inttypes.h>
-#else
-  typedef unsigned short uint16_t;
-#endif
-
 #include "types.h"
 
+void set_error_reporting(int enabled);
+void report_error(const char *message);
 unsigned int btoi(const char *bytes, int size, int offset);
 char *itob(int integer);
 int syncint_encode(int value);
 int syncint_decode(int value);
 void add_to_list(ID3v2_frame_list *list, ID3v2_frame *frame);
 ID3v2_frame *get_from_list(ID3v2_frame_list *list, char *frame_id);
+ID3v2_frame *get_nth_from_list(ID3v2_frame_list *list, char *frame_id, int n);
+int count_in_list(ID3v2_frame_list *list, char *frame_id);
+ID3v2_frame *remove_from_list(ID3v2_frame_list *list, char *frame_id);
 void free_tag(ID3v2_tag *tag);
+void free_tag_frame(ID3v2_tag *tag, ID3v2_frame *frame);
+int is_mapped(ID3v2_tag *tag, const char *data);
+void unmap_tag(ID3v2_tag *tag);
 char *get_mime_type_from_filename(const char *filename);
 
 // String functions
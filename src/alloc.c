@@ -0,0 +1,86 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "stats.h"
+
+// All NULL for the C library
+static ID3v2_allocator allocator;
+
+// Not thread safe, set it before the library allocates anything: memory
+// must go back to the allocator it came from. NULL restores malloc().
+void set_allocator(const ID3v2_allocator *hooks)
+{
+    if (hooks && hooks->malloc && hooks->realloc && hooks->free) {
+        allocator = *hooks;
+    } else {
+        memset(&allocator, 0, sizeof(allocator));
+    }
+}
+
+void get_allocator(ID3v2_allocator *hooks)
+{
+    *hooks = allocator;
+}
+
+void *mem_alloc(size_t size)
+{
+    count_allocation((long long) size);
+
+    if (allocator.malloc) return allocator.malloc(size, allocator.user_data);
+    return malloc(size);
+}
+
+void *mem_calloc(size_t count, size_t size)
+{
+    void *pointer;
+
+    if (!allocator.malloc) {
+        count_allocation((long long) (count * size));
+        return calloc(count, size);
+    }
+
+    if (size && count > (size_t) -1 / size) return NULL;
+    pointer = mem_alloc(count * size);
+    if (pointer) memset(pointer, 0, count * size);
+
+    return pointer;
+}
+
+void *mem_realloc(void *pointer, size_t size)
+{
+    count_allocation((long long) size);
+
+    if (allocator.realloc) return allocator.realloc(pointer, size, allocator.user_data);
+    return realloc(pointer, size);
+}
+
+void mem_free(void *pointer)
+{
+    if (!pointer) return;
+
+    count_free();
+    if (allocator.free) {
+        allocator.free(pointer, allocator.user_data);
+    } else {
+        free(pointer);
+    }
+}
+
+char *mem_strdup(const char *string)
+{
+    size_t size = strlen(string) + 1;
+    char *copy = mem_alloc(size);
+
+    if (copy) memcpy(copy, string, size);
+    return copy;
+}
@@ -0,0 +1,125 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "arena.h"
+
+#define ARENA_DEFAULT_SIZE (64 * 1024)
+#define ARENA_ALIGN(size) (((size) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+#define ARENA_BLOCK_DATA(block) ((char *)(block) + ARENA_ALIGN(sizeof(ID3v2_arena_block)))
+
+static ID3v2_arena_block *new_arena_block(int size)
+{
+    ID3v2_arena_block *block = mem_alloc(ARENA_ALIGN(sizeof(ID3v2_arena_block)) + size);
+    if (!block) return NULL;
+
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+
+    return block;
+}
+
+ID3v2_arena *new_arena(int size)
+{
+    ID3v2_arena *arena = mem_calloc(1, sizeof(ID3v2_arena));
+    if (!arena) return NULL;
+
+    if (size <= 0) size = ARENA_DEFAULT_SIZE;
+
+    arena->blocks = new_arena_block(size);
+    if (!arena->blocks) {
+        mem_free(arena);
+        return NULL;
+    }
+    arena->size = size;
+
+    return arena;
+}
+
+void *arena_alloc(ID3v2_arena *arena, int size)
+{
+    ID3v2_arena_block *block = arena->blocks;
+    int aligned_size = (int) ARENA_ALIGN(size);
+    void *pointer;
+
+    if (block->size - block->used < aligned_size) {
+        // Grow geometrically so a big tag only adds a few blocks
+        int block_size = block->size * 2;
+        if (block_size < aligned_size) block_size = aligned_size;
+
+        block = new_arena_block(block_size);
+        if (!block) return NULL;
+
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->size += block_size;
+    }
+
+    pointer = ARENA_BLOCK_DATA(block) + block->used;
+    block->used += aligned_size;
+
+    return pointer;
+}
+
+int arena_owns(ID3v2_arena *arena, const void *pointer)
+{
+    ID3v2_arena_block *block;
+
+    if (!arena) return 0;
+
+    for (block = arena->blocks; block; block = block->next) {
+        const char *data = ARENA_BLOCK_DATA(block);
+        if ((const char *) pointer >= data && (const char *) pointer < data + block->size) return 1;
+    }
+
+    return 0;
+}
+
+// Release everything allocated from the arena at once. If the arena had to
+// grow, its blocks are merged into one so that the next load of a similar
+// tag is served without calling malloc.
+void arena_reset(ID3v2_arena *arena)
+{
+    ID3v2_arena_block *block;
+
+    if (!arena) return;
+
+    if (arena->blocks->next) {
+        ID3v2_arena_block *merged = new_arena_block(arena->size);
+
+        if (merged) {
+            while ((block = arena->blocks)) {
+                arena->blocks = block->next;
+                mem_free(block);
+            }
+            arena->blocks = merged;
+        }
+    }
+
+    for (block = arena->blocks; block; block = block->next) {
+        block->used = 0;
+    }
+}
+
+void free_arena(ID3v2_arena *arena)
+{
+    ID3v2_arena_block *block;
+
+    if (!arena) return;
+
+    while ((block = arena->blocks)) {
+        arena->blocks = block->next;
+        mem_free(block);
+    }
+    mem_free(arena);
+}
@@ -0,0 +1,592 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#define _DEFAULT_SOURCE		// for dirent d_type
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "id3v2lib.h"
+#include "batch.h"
+#include "cache.h"
+
+// Files still to be scanned by a worker, [begin, end) in the file list.
+// The owner takes files from the front, other workers steal from the back.
+typedef struct
+{
+    pthread_mutex_t lock;
+    int begin;
+    int end;
+} work_queue;
+
+// What edit_files() does to each file
+typedef struct
+{
+    ID3v2_frame_edit *edits;
+    int count;
+    ID3v2_edit_options *options;
+    ID3v2_edit_result *results;
+} edit_job;
+
+typedef struct batch_worker
+{
+    int id;
+    int count;			// number of workers
+    work_queue *queues;
+    char **file_names;
+    void (*process)(struct batch_worker *worker, int index);
+    ID3v2_scan_options *scan;	// set by scan_files()
+    edit_job *edit;		// set by edit_files()
+    ID3v2_arena *arena;
+    ID3v2_scan_stats scan_stats;
+    ID3v2_edit_stats edit_stats;
+} batch_worker;
+
+static double get_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int take_work(work_queue *queue)
+{
+    int index = -1;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->begin < queue->end) index = queue->begin++;
+    pthread_mutex_unlock(&queue->lock);
+
+    return index;
+}
+
+// Move half of the files left in another worker's queue to ours
+static int steal_work(batch_worker *worker)
+{
+    for (int i = 1; i < worker->count; i++) {
+        work_queue *victim = &worker->queues[(worker->id + i) % worker->count];
+        int begin, end;
+
+        pthread_mutex_lock(&victim->lock);
+        end = victim->end;
+        begin = end - (victim->end - victim->begin + 1) / 2;
+        if (begin < end) victim->end = begin;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (begin < end) {
+            work_queue *own = &worker->queues[worker->id];
+            pthread_mutex_lock(&own->lock);
+            own->begin = begin;
+            own->end = end;
+            pthread_mutex_unlock(&own->lock);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Read the tag of file_name straight into the worker's arena. Returns 0 or
+// the errno value.
+static int read_file_tag(batch_worker *worker, const char *file_name, ID3v2_tag **tag)
+{
+    char header_buffer[ID3_HEADER + ID3_EXTENDED_HEADER_SIZE];
+    ID3v2_header tag_header;
+    ID3v1_tag id3v1;
+    ID3v2_io io;
+    long long base = 0;
+    char *buffer;
+    int error = 0;
+    int size;
+    int fd;
+
+    fd = open(file_name, O_RDONLY);
+    count_syscalls(1);
+    if (fd < 0) {
+        error = errno;
+    } else {
+        size = (int) pread(fd, header_buffer, sizeof(header_buffer), 0);
+        count_syscalls(1);
+        count_read(size);
+        if (size >= 0 && !parse_tag_header(header_buffer, size, &tag_header)) {
+            // Or a tag appended to the file, see set_tag_append()
+            io_from_fd(&io, fd);
+            base = find_appended_tag_with_io(&io);
+            if (base > 0) {
+                size = (int) pread(fd, header_buffer, sizeof(header_buffer), base);
+                count_syscalls(1);
+                count_read(size);
+            }
+        }
+
+        if (size < 0) {
+            error = errno;
+        } else if (base >= 0 && parse_tag_header(header_buffer, size, &tag_header)) {
+            size = tag_header.tag_size + ID3_HEADER;
+            buffer = arena_alloc(worker->arena, size);
+            if (!buffer) {
+                error = ENOMEM;
+            } else if ((size = (int) pread(fd, buffer, size, base)) < 0) {
+                error = errno;
+            } else {
+                count_syscalls(1);
+                count_read(size);
+                worker->scan_stats.bytes += size;
+                *tag = load_tag_with_buffer_in_arena(buffer, size, worker->arena);
+            }
+        }
+
+        if (worker->scan->id3v1 && !error) {
+            io_from_fd(&io, fd);
+            if (read_id3v1_tag_with_io(&io, &id3v1) == 1) {
+                if (!*tag) *tag = new_tag();
+                (*tag)->fallback = get_id3v1_frames(&id3v1);
+            }
+        }
+        count_syscalls(1);
+        close(fd);
+    }
+
+    return error;
+}
+
+// Read the tag straight into the worker's arena, which is reused for every
+// file, or from the cache for files that did not change
+static void scan_file(batch_worker *worker, int index)
+{
+    const char *file_name = worker->file_names[index];
+    ID3v2_tag *tag = NULL;
+    int error = 0;
+    int cached;
+
+    worker->scan_stats.files++;
+
+    if (worker->scan->cache && !worker->scan->id3v1) {
+        cached = read_cached_tag(worker->scan->cache, file_name, &tag);
+        if (cached < 0) error = errno ? errno : EIO;
+        if (cached > 0) worker->scan_stats.cached++;
+    } else {
+        error = read_file_tag(worker, file_name, &tag);
+    }
+
+    if (error) worker->scan_stats.errors++;
+    if (tag) worker->scan_stats.tags++;
+
+    if (worker->scan->callback) {
+        worker->scan->callback(file_name, tag, error, worker->scan->user_data);
+    }
+
+    if (tag) free_tag(tag);
+    arena_reset(worker->arena);
+}
+
+// Apply one edit, returns 1 if the tag changed
+static int apply_edit(ID3v2_tag *tag, ID3v2_frame_edit *edit)
+{
+    ID3v2_frame *frame;
+    char *data;
+    int size;
+    int changed = 0;
+
+    if (!edit->text) {
+        while ((frame = remove_from_list(tag->frames, edit->frame_id))) {
+            free_tag_frame(tag, frame);
+            changed = 1;
+        }
+        return changed;
+    }
+
+    // Encoded as tag_set_text_frame() does
+    data = new_text_frame_payload(edit->frame_id, edit->text, (int) strlen(edit->text), edit->encoding, &size);
+    if (!data) return -1;
+
+    frame = get_from_list(tag->frames, edit->frame_id);
+    if (frame && load_frame_data_in_arena(frame, tag->arena) && frame->size == size && memcmp(frame->data, data, size) == 0) {
+        // already there, the file does not need to be written for this one
+        mem_free(data);
+        return 0;
+    }
+
+    if (!frame) {
+        frame = new_frame();
+        memcpy(frame->frame_id, edit->frame_id, ID3_FRAME_ID);
+        add_to_list(tag->frames, frame);
+    } else if (frame->data && !arena_owns(tag->arena, frame->data) && !is_mapped(tag, frame->data)) {
+        mem_free(frame->data);
+    }
+
+    frame->data = data;
+    frame->source = NULL;
+    frame->size = size;
+    memset(frame->flags, 0, ID3_FRAME_FLAGS);
+
+    return 1;
+}
+
+// Load the tag into the worker's arena, apply the edits and write it back,
+// in place whenever it still fits
+static void edit_file(batch_worker *worker, int index)
+{
+    const char *file_name = worker->file_names[index];
+    edit_job *job = worker->edit;
+    ID3v2_edit_result outcome = { ID3_WRITE_FAILED, 0 };
+    ID3v2_header tag_header;
+    ID3v2_tag *tag = NULL;
+    ID3v2_io io;
+    int changed = 0;
+    int has_tag;
+    int fd;
+
+    worker->edit_stats.files++;
+
+    fd = open(file_name, job->options->atomic ? O_RDONLY : O_RDWR);
+    count_syscalls(1);
+    if (fd < 0) {
+        outcome.error = errno;
+    } else {
+        // A tag that cannot be loaded must not be replaced by a new one
+        io_from_fd(&io, fd);
+        has_tag = probe_tag_header(fd, &tag_header);
+        if (has_tag == 0 && find_appended_tag_with_io(&io) > 0) has_tag = 1;	// rewritten where it is
+        if (has_tag == 1) {
+            tag = load_tag_in_arena_with_io(&io, worker->arena);
+        } else if (has_tag == 0) {
+            tag = new_tag();
+        }
+
+        for (int i = 0; tag && i < job->count && changed >= 0; i++) {
+            int result = apply_edit(tag, &job->edits[i]);
+            changed = result < 0 ? -1 : changed | result;
+        }
+
+        if (!tag) {
+            outcome.error = has_tag < 0 ? errno : EINVAL;
+        } else if (changed < 0) {
+            outcome.error = ENOMEM;
+        } else if (!changed) {
+            outcome.result = ID3_WRITE_UNCHANGED;
+        } else {
+            errno = 0;
+            outcome.result = job->options->atomic ? set_tag_atomic(file_name, tag) :
+                             job->options->append ? set_tag_append_with_io(&io, tag) : set_tag_with_io(&io, tag);
+            if (outcome.result == ID3_WRITE_FAILED) outcome.error = errno ? errno : EIO;
+        }
+
+        count_syscalls(1);
+        close(fd);
+    }
+
+    switch (outcome.result) {
+        case ID3_WRITE_IN_PLACE:
+            worker->edit_stats.in_place++;
+            break;
+        case ID3_WRITE_REWRITE:
+            worker->edit_stats.rewritten++;
+            break;
+        case ID3_WRITE_UNCHANGED:
+            worker->edit_stats.unchanged++;
+            break;
+        default:
+            worker->edit_stats.errors++;
+            break;
+    }
+    if (outcome.result > 0) worker->edit_stats.bytes += get_tag_total_size(tag->tag_header);
+
+    if (job->results) job->results[index] = outcome;
+
+    if (tag) free_tag(tag);
+    arena_reset(worker->arena);
+}
+
+static void *batch_worker_main(void *argument)
+{
+    batch_worker *worker = argument;
+    int index;
+
+    do {
+        while ((index = take_work(&worker->queues[worker->id])) >= 0) {
+            worker->process(worker, index);
+        }
+    } while (steal_work(worker));
+
+    return NULL;
+}
+
+static int get_thread_count(int threads)
+{
+    if (threads > 0) return threads;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > 0) return (int) cpus;
+#endif
+
+    return 1;
+}
+
+// Run process on every file from a pool of threads. The workers, with the
+// stats they gathered, are left in *workers for the caller to sum up and
+// free with free_workers(). Returns 0, or -1 if no worker could be started.
+static int run_workers(char **file_names, int count, int *threads, batch_worker *base, batch_worker **workers)
+{
+    work_queue *queues;
+    pthread_t *ids;
+    int *running;
+    int result = -1;
+
+    if (*threads > count && count > 0) *threads = count;
+
+    *workers = mem_calloc(*threads, sizeof(batch_worker));
+    queues = mem_calloc(*threads, sizeof(work_queue));
+    running = mem_calloc(*threads, sizeof(int));
+    ids = mem_calloc(*threads, sizeof(pthread_t));
+    if (!*workers || !queues || !running || !ids) {
+        mem_free(*workers);
+        mem_free(queues);
+        mem_free(running);
+        mem_free(ids);
+        *workers = NULL;
+        return -1;
+    }
+
+    // Every worker starts with an even share of the files
+    for (int i = 0; i < *threads; i++) {
+        pthread_mutex_init(&queues[i].lock, NULL);
+        queues[i].begin = (int) ((long long) count * i / *threads);
+        queues[i].end = (int) ((long long) count * (i + 1) / *threads);
+
+        (*workers)[i] = *base;
+        (*workers)[i].id = i;
+        (*workers)[i].count = *threads;
+        (*workers)[i].queues = queues;
+        (*workers)[i].file_names = file_names;
+        (*workers)[i].arena = new_arena(0);
+    }
+
+    // The files of a worker that could not be started get stolen by the others
+    for (int i = 0; i < *threads; i++) {
+        if ((*workers)[i].arena && pthread_create(&ids[i], NULL, batch_worker_main, &(*workers)[i]) == 0) {
+            running[i] = 1;
+            result = 0;
+        }
+    }
+
+    for (int i = 0; i < *threads; i++) {
+        if (running[i]) pthread_join(ids[i], NULL);
+    }
+
+    mem_free(running);
+    mem_free(ids);
+
+    return result;
+}
+
+static void free_workers(batch_worker *workers, int threads)
+{
+    if (!workers) return;
+
+    for (int i = 0; i < threads; i++) {
+        free_arena(workers[i].arena);
+        pthread_mutex_destroy(&workers[i].queues[i].lock);
+    }
+
+    mem_free(workers[0].queues);
+    mem_free(workers);
+}
+
+// Load the tag of every file from a pool of threads and hand them to the
+// callback. Returns 0 on success, -1 if the workers could not be started.
+int scan_files(char **file_names, int count, ID3v2_scan_options *options, ID3v2_scan_stats *stats)
+{
+    batch_worker base = { 0 };
+    batch_worker *workers;
+    int threads = get_thread_count(options->threads);
+    double start = get_time();
+    int result;
+
+    base.process = scan_file;
+    base.scan = options;
+    result = run_workers(file_names, count, &threads, &base, &workers);
+    if (!workers) return -1;
+
+    if (stats) {
+        memset(stats, 0, sizeof(ID3v2_scan_stats));
+        for (int i = 0; i < threads; i++) {
+            stats->files += workers[i].scan_stats.files;
+            stats->tags += workers[i].scan_stats.tags;
+            stats->errors += workers[i].scan_stats.errors;
+            stats->cached += workers[i].scan_stats.cached;
+            stats->bytes += workers[i].scan_stats.bytes;
+        }
+        stats->seconds = get_time() - start;
+    }
+
+    free_workers(workers, threads);
+
+    return result;
+}
+
+static int is_valid_edit(ID3v2_frame_edit *edit)
+{
+    if (!edit->frame_id || strlen(edit->frame_id) != ID3_FRAME_ID) return 0;
+    if (!edit->text) return 1;
+
+    return (edit->frame_id[0] == 'T' && memcmp(edit->frame_id, "TXXX", ID3_FRAME_ID) != 0) ||
+           memcmp(edit->frame_id, COMMENT_FRAME_ID, ID3_FRAME_ID) == 0;
+}
+
+// Apply the same edits to every file from a pool of threads. They are written
+// with set_tag(), which overwrites a tag that still fits in place, with
+// set_tag_atomic() when options->atomic is set or set_tag_append() when
+// options->append is. results, if not NULL, gets the outcome of each
+// file. Returns 0 on success, -1 if the edits are not supported or the
+// workers could not be started.
+int edit_files(char **file_names, int count, ID3v2_frame_edit *edits, int edit_count,
+               ID3v2_edit_options *options, ID3v2_edit_result *results, ID3v2_edit_stats *stats)
+{
+    ID3v2_edit_options default_options = { 0, 0, 0 };
+    edit_job job = { edits, edit_count, options ? options : &default_options, results };
+    batch_worker base = { 0 };
+    batch_worker *workers;
+    int threads = get_thread_count(job.options->threads);
+    double start = get_time();
+    int result;
+
+    for (int i = 0; i < edit_count; i++) {
+        if (!is_valid_edit(&edits[i])) {
+            report_error("Unsupported frame edit");
+            return -1;
+        }
+    }
+
+    base.process = edit_file;
+    base.edit = &job;
+    result = run_workers(file_names, count, &threads, &base, &workers);
+    if (!workers) return -1;
+
+    if (stats) {
+        memset(stats, 0, sizeof(ID3v2_edit_stats));
+        for (int i = 0; i < threads; i++) {
+            stats->files += workers[i].edit_stats.files;
+            stats->in_place += workers[i].edit_stats.in_place;
+            stats->rewritten += workers[i].edit_stats.rewritten;
+            stats->unchanged += workers[i].edit_stats.unchanged;
+            stats->errors += workers[i].edit_stats.errors;
+            stats->bytes += workers[i].edit_stats.bytes;
+        }
+        stats->seconds = get_time() - start;
+    }
+
+    free_workers(workers, threads);
+
+    return result;
+}
+
+typedef struct
+{
+    char **file_names;
+    int count;
+    int capacity;
+} file_list;
+
+static int add_file(file_list *list, const char *file_name)
+{
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 1024;
+        char **file_names = mem_realloc(list->file_names, capacity * sizeof(char *));
+        if (!file_names) return 0;
+        list->file_names = file_names;
+        list->capacity = capacity;
+    }
+
+    list->file_names[list->count] = mem_strdup(file_name);
+    if (!list->file_names[list->count]) return 0;
+    list->count++;
+
+    return 1;
+}
+
+// Collect the regular files under path, symbolic links are not followed
+static int collect_files(const char *path, file_list *list)
+{
+    struct dirent *entry;
+    struct stat st;
+    char *child;
+    DIR *dir;
+    int result = 1;
+
+    dir = opendir(path);
+    if (!dir) return 0;
+
+    while (result && (entry = readdir(dir))) {
+        int is_dir, is_file;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        child = mem_alloc(strlen(path) + strlen(entry->d_name) + 2);
+        if (!child) {
+            result = 0;
+            break;
+        }
+        sprintf(child, "%s/%s", path, entry->d_name);
+
+#ifdef DT_DIR
+        if (entry->d_type != DT_UNKNOWN) {
+            is_dir = entry->d_type == DT_DIR;
+            is_file = entry->d_type == DT_REG;
+        } else
+#endif
+        if (lstat(child, &st) == 0) {
+            is_dir = S_ISDIR(st.st_mode);
+            is_file = S_ISREG(st.st_mode);
+        } else {
+            is_dir = is_file = 0;
+        }
+
+        if (is_dir) {
+            collect_files(child, list);
+        } else if (is_file) {
+            result = add_file(list, child);
+        }
+
+        mem_free(child);
+    }
+
+    closedir(dir);
+
+    return result;
+}
+
+int scan_directory(const char *path, ID3v2_scan_options *options, ID3v2_scan_stats *stats)
+{
+    file_list list = { NULL, 0, 0 };
+    int result;
+
+    if (!collect_files(path, &list)) {
+        report_error("Error reading directory");
+        result = -1;
+    } else {
+        result = scan_files(list.file_names, list.count, options, stats);
+    }
+
+    for (int i = 0; i < list.count; i++) {
+        mem_free(list.file_names[i]);
+    }
+    mem_free(list.file_names);
+
+    return result;
+}
@@ -0,0 +1,758 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "id3v2lib.h"
+#include "cache.h"
+
+// The cache file is a header, a hash table of slots keyed by device and
+// inode, and the entries the slots point to. It is written in the byte order
+// of the machine, a file from another one has the wrong format and is ignored.
+#define CACHE_MAGIC "ID3C"
+#define CACHE_FORMAT 1
+
+// Tables are filled up to 3/4 at most, so a search always ends on an empty slot
+#define CACHE_MIN_CAPACITY 64
+#define CACHE_MAX_CAPACITY (1u << 31)
+
+#define SLOT_EMPTY 0
+#define SLOT_USED 1
+#define SLOT_REMOVED 2		// only in memory, hides the slot of the file
+
+// An entry is the tag header and the number of frames, then every frame as
+// its ID, flags, version and size followed by its payload
+#define ENTRY_HEADER 24
+#define ENTRY_FRAME 12
+
+#define CACHE_WRITE_BUFFER (1024 * 1024)
+
+typedef struct
+{
+    char magic[4];
+    uint32_t format;
+    uint32_t filter;		// hash of the frame IDs the entries were made with
+    uint32_t capacity;		// slots, a power of two
+    uint64_t count;		// slots in use
+    uint64_t data_size;		// bytes of entries after the slots
+} cache_file_header;
+
+typedef struct
+{
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;		// the entry is only used while size and mtime_ns match the file
+    int64_t mtime_ns;
+    uint64_t offset;		// of the entry, from the end of the slots
+    int32_t length;		// of the entry, 0 if the file has no tag
+    uint32_t state;		// SLOT_*
+} cache_slot;
+
+struct _ID3v2_tag_cache
+{
+    char *file_name;
+    char **frame_ids;		// NULL when every frame is kept
+    int frame_count;
+    uint32_t filter;
+    pthread_rwlock_t lock;
+
+    // The cache file as it was opened, never modified
+    char *mapping;
+    size_t mapping_size;
+    const cache_slot *slots;
+    uint32_t capacity;
+    const char *data;
+    uint64_t data_size;
+
+    // Tags stored or removed since, they take precedence over the file
+    cache_slot *entries;
+    char **entry_data;
+    uint32_t entry_capacity;
+    uint32_t entry_count;
+};
+
+// Writes the cache file through a buffer
+typedef struct
+{
+    ID3v2_io *io;
+    char *buffer;
+    int used;
+    long long offset;		// of the buffer in the file
+    int failed;
+} cache_writer;
+
+static long long get_mtime_ns(const struct stat *st)
+{
+#ifdef __APPLE__
+    return st->st_mtimespec.tv_sec * 1000000000LL + st->st_mtimespec.tv_nsec;
+#else
+    return st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+#endif
+}
+
+static uint32_t hash_file(uint64_t dev, uint64_t ino)
+{
+    uint64_t hash = (ino ^ (dev << 40 | dev >> 24)) * 0x9E3779B97F4A7C15ULL;
+    return (uint32_t) (hash >> 32);
+}
+
+// FNV-1a of the frame IDs, a file made with other ones cannot be used
+static uint32_t hash_frame_ids(char **frame_ids, int count)
+{
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < ID3_FRAME_ID; j++) {
+            hash = (hash ^ (unsigned char) frame_ids[i][j]) * 16777619u;
+        }
+    }
+
+    return hash;
+}
+
+// Index of the slot of dev and ino, or of the empty slot where they would
+// go. Returns capacity if there is neither, which only a damaged file can do.
+static uint32_t find_slot(const cache_slot *slots, uint32_t capacity, uint64_t dev, uint64_t ino)
+{
+    uint32_t i = hash_file(dev, ino) & (capacity - 1);
+
+    for (uint32_t n = 0; n < capacity; n++) {
+        if (slots[i].state == SLOT_EMPTY || (slots[i].dev == dev && slots[i].ino == ino)) return i;
+        i = (i + 1) & (capacity - 1);
+    }
+
+    return capacity;
+}
+
+static int is_valid_slot(ID3v2_tag_cache *cache, const cache_slot *slot)
+{
+    return slot->length >= 0 && slot->offset <= cache->data_size &&
+           (uint64_t) slot->length <= cache->data_size - slot->offset;
+}
+
+static void put_int(char *dest, int32_t value)
+{
+    memcpy(dest, &value, sizeof(value));
+}
+
+static int32_t get_int(const char *src)
+{
+    int32_t value;
+
+    memcpy(&value, src, sizeof(value));
+    return value;
+}
+
+// The tag as an entry, from mem_alloc(). *length is set to its size.
+static char *encode_entry(ID3v2_tag *tag, int *length)
+{
+    ID3v2_header *tag_header = tag->tag_header;
+    int count = tag->frames ? tag->frames->count : 0;
+    long long size = ENTRY_HEADER;
+    char *entry, *dest;
+
+    for (int i = 0; i < count; i++) size += ENTRY_FRAME + tag->frames->frames[i]->size;
+    if (size > INT_MAX) return NULL;
+
+    entry = mem_alloc(size);
+    if (!entry) return NULL;
+
+    entry[0] = tag_header->major_version;
+    entry[1] = tag_header->orig_major_version;
+    entry[2] = tag_header->minor_version;
+    entry[3] = tag_header->flags;
+    put_int(entry + 4, tag_header->tag_size);
+    put_int(entry + 8, tag_header->extended_header_size);
+    put_int(entry + 12, tag_header->unsynchronised);
+    put_int(entry + 16, tag_header->has_footer);
+    put_int(entry + 20, count);
+
+    dest = entry + ENTRY_HEADER;
+    for (int i = 0; i < count; i++) {
+        ID3v2_frame *frame = tag->frames->frames[i];
+
+        memcpy(dest, frame->frame_id, ID3_FRAME_ID);
+        memcpy(dest + 4, frame->flags, ID3_FRAME_FLAGS);
+        dest[6] = (char) frame->version;
+        dest[7] = 0;
+        put_int(dest + 8, frame->size);
+        if (frame->size) {
+            count_copy(frame->size);
+            memcpy(dest + ENTRY_FRAME, frame->data, frame->size);
+        }
+        dest += ENTRY_FRAME + frame->size;
+    }
+
+    *length = (int) size;
+    return entry;
+}
+
+// The tag an entry was made from, as load_tag() gives it. A damaged entry
+// loses the frames from the first one that does not fit.
+static ID3v2_tag *decode_entry(const char *entry, int length)
+{
+    ID3v2_tag *tag;
+    ID3v2_header *tag_header;
+    int offset = ENTRY_HEADER;
+    int count;
+
+    if (length < ENTRY_HEADER) return NULL;
+
+    tag = new_tag();
+    tag_header = tag->tag_header;
+    memcpy(tag_header->tag, "ID3", ID3_HEADER_TAG);
+    tag_header->major_version = entry[0];
+    tag_header->orig_major_version = entry[1];
+    tag_header->minor_version = entry[2];
+    tag_header->flags = entry[3];
+    tag_header->tag_size = get_int(entry + 4);
+    tag_header->extended_header_size = get_int(entry + 8);
+    tag_header->unsynchronised = get_int(entry + 12);
+    tag_header->has_footer = get_int(entry + 16);
+    count = get_int(entry + 20);
+
+    for (int i = 0; i < count && length - offset >= ENTRY_FRAME; i++) {
+        int size = get_int(entry + offset + 8);
+        ID3v2_frame *frame;
+
+        if (size < 0 || size > length - offset - ENTRY_FRAME) break;
+
+        frame = new_frame();
+        frame->data = mem_alloc(size ? size : 1);
+        if (!frame->data) {
+            mem_free(frame);
+            break;
+        }
+        memcpy(frame->frame_id, entry + offset, ID3_FRAME_ID);
+        memcpy(frame->flags, entry + offset + 4, ID3_FRAME_FLAGS);
+        frame->version = entry[offset + 6];
+        frame->size = size;
+        count_copy(size);
+        memcpy(frame->data, entry + offset + ENTRY_FRAME, size);
+        add_to_list(tag->frames, frame);
+
+        offset += ENTRY_FRAME + size;
+    }
+
+    return tag;
+}
+
+static int grow_entries(ID3v2_tag_cache *cache)
+{
+    uint32_t capacity = cache->entry_capacity ? cache->entry_capacity * 2 : CACHE_MIN_CAPACITY;
+    cache_slot *entries;
+    char **entry_data;
+
+    if (cache->entry_capacity >= CACHE_MAX_CAPACITY) return 0;
+
+    entries = mem_calloc(capacity, sizeof(cache_slot));
+    entry_data = mem_calloc(capacity, sizeof(char *));
+    if (!entries || !entry_data) {
+        mem_free(entries);
+        mem_free(entry_data);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < cache->entry_capacity; i++) {
+        uint32_t j;
+
+        if (cache->entries[i].state == SLOT_EMPTY) continue;
+        j = find_slot(entries, capacity, cache->entries[i].dev, cache->entries[i].ino);
+        entries[j] = cache->entries[i];
+        entry_data[j] = cache->entry_data[i];
+    }
+
+    mem_free(cache->entries);
+    mem_free(cache->entry_data);
+    cache->entries = entries;
+    cache->entry_data = entry_data;
+    cache->entry_capacity = capacity;
+
+    return 1;
+}
+
+// Store the entry of the file st describes, replacing the one it had. The
+// cache takes data over. Returns 1, or 0 if out of memory.
+static int put_entry(ID3v2_tag_cache *cache, const struct stat *st, uint32_t state, char *data, int length)
+{
+    cache_slot *slot;
+    uint32_t i;
+
+    if ((uint64_t) (cache->entry_count + 1) * 4 > (uint64_t) cache->entry_capacity * 3 && !grow_entries(cache)) {
+        return 0;
+    }
+
+    i = find_slot(cache->entries, cache->entry_capacity, st->st_dev, st->st_ino);
+    slot = &cache->entries[i];
+    if (slot->state == SLOT_EMPTY) cache->entry_count++;
+    mem_free(cache->entry_data[i]);
+
+    slot->dev = st->st_dev;
+    slot->ino = st->st_ino;
+    slot->size = st->st_size;
+    slot->mtime_ns = get_mtime_ns(st);
+    slot->offset = 0;
+    slot->length = length;
+    slot->state = state;
+    cache->entry_data[i] = data;
+
+    return 1;
+}
+
+// The entry of the file st describes, NULL if there is none or the file
+// changed since it was made. *data is set to its bytes.
+static const cache_slot *find_entry(ID3v2_tag_cache *cache, const struct stat *st, const char **data)
+{
+    const cache_slot *slot = NULL;
+    uint32_t i;
+
+    if (cache->entry_capacity) {
+        i = find_slot(cache->entries, cache->entry_capacity, st->st_dev, st->st_ino);
+        if (cache->entries[i].state != SLOT_EMPTY) {
+            slot = &cache->entries[i];
+            *data = cache->entry_data[i];
+        }
+    }
+
+    if (!slot && cache->capacity) {
+        i = find_slot(cache->slots, cache->capacity, st->st_dev, st->st_ino);
+        if (i < cache->capacity && cache->slots[i].state == SLOT_USED && is_valid_slot(cache, &cache->slots[i])) {
+            slot = &cache->slots[i];
+            *data = cache->data + slot->offset;
+        }
+    }
+
+    if (!slot || slot->state != SLOT_USED) return NULL;
+    if (slot->size != (int64_t) st->st_size || slot->mtime_ns != get_mtime_ns(st)) return NULL;
+
+    return slot;
+}
+
+// Map the cache file if there is a usable one, the cache is empty otherwise
+static void map_cache_file(ID3v2_tag_cache *cache)
+{
+    const cache_file_header *header;
+    struct stat st;
+    uint64_t size, slots_size;
+    char *mapping;
+    int fd;
+
+    count_syscalls(1);
+    fd = open(cache->file_name, O_RDONLY);
+    if (fd < 0) return;
+
+    count_syscalls(3);	// fstat(), mmap() and close()
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(cache_file_header)) {
+        close(fd);
+        return;
+    }
+    mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return;
+
+    header = (const cache_file_header *) mapping;
+    size = (uint64_t) st.st_size - sizeof(cache_file_header);
+    slots_size = (uint64_t) header->capacity * sizeof(cache_slot);
+    if (memcmp(header->magic, CACHE_MAGIC, 4) != 0 || header->format != CACHE_FORMAT ||
+        header->filter != cache->filter || header->capacity == 0 ||
+        (header->capacity & (header->capacity - 1)) != 0 ||
+        slots_size > size || header->data_size != size - slots_size) {
+        count_syscalls(1);
+        munmap(mapping, st.st_size);
+        return;
+    }
+
+    cache->mapping = mapping;
+    cache->mapping_size = st.st_size;
+    cache->slots = (const cache_slot *) (mapping + sizeof(cache_file_header));
+    cache->capacity = header->capacity;
+    cache->data = mapping + sizeof(cache_file_header) + slots_size;
+    cache->data_size = header->data_size;
+}
+
+static void unmap_cache_file(ID3v2_tag_cache *cache)
+{
+    if (cache->mapping) {
+        count_syscalls(1);
+        munmap(cache->mapping, cache->mapping_size);
+    }
+
+    cache->mapping = NULL;
+    cache->mapping_size = 0;
+    cache->slots = NULL;
+    cache->capacity = 0;
+    cache->data = NULL;
+    cache->data_size = 0;
+}
+
+static void free_entries(ID3v2_tag_cache *cache)
+{
+    for (uint32_t i = 0; i < cache->entry_capacity; i++) {
+        mem_free(cache->entry_data[i]);
+    }
+    mem_free(cache->entries);
+    mem_free(cache->entry_data);
+
+    cache->entries = NULL;
+    cache->entry_data = NULL;
+    cache->entry_capacity = 0;
+    cache->entry_count = 0;
+}
+
+// Open the cache kept in file_name, or an empty one if there is no such file
+// yet or it cannot be used (damaged, from another machine or made with other
+// frame IDs). Only the count frames in frame_ids are kept, every frame if
+// count is 0. Returns NULL if out of memory.
+ID3v2_tag_cache *open_tag_cache(const char *file_name, char **frame_ids, int count)
+{
+    ID3v2_tag_cache *cache = mem_calloc(1, sizeof(ID3v2_tag_cache));
+
+    if (!cache) return NULL;
+    pthread_rwlock_init(&cache->lock, NULL);
+
+    cache->file_name = mem_strdup(file_name);
+    if (count > 0) cache->frame_ids = mem_calloc(count, sizeof(char *));
+    if (!cache->file_name || (count > 0 && !cache->frame_ids)) {
+        close_tag_cache(cache);
+        return NULL;
+    }
+
+    for (int i = 0; i < count; i++) {
+        cache->frame_ids[i] = mem_strdup(frame_ids[i]);
+        if (!cache->frame_ids[i]) {
+            close_tag_cache(cache);
+            return NULL;
+        }
+        cache->frame_count++;
+    }
+
+    cache->filter = hash_frame_ids(cache->frame_ids, cache->frame_count);
+    map_cache_file(cache);
+
+    return cache;
+}
+
+// Free the cache, what was not saved with save_tag_cache() is lost
+void close_tag_cache(ID3v2_tag_cache *cache)
+{
+    if (!cache) return;
+
+    free_entries(cache);
+    unmap_cache_file(cache);
+    for (int i = 0; i < cache->frame_count; i++) {
+        mem_free(cache->frame_ids[i]);
+    }
+    mem_free(cache->frame_ids);
+    mem_free(cache->file_name);
+    pthread_rwlock_destroy(&cache->lock);
+    mem_free(cache);
+}
+
+static void flush_writer(cache_writer *writer)
+{
+    if (writer->used && !writer->failed &&
+        io_write_at(writer->io, writer->buffer, writer->used, writer->offset) != writer->used) {
+        writer->failed = 1;
+    }
+
+    writer->offset += writer->used;
+    writer->used = 0;
+}
+
+static void write_bytes(cache_writer *writer, const void *bytes, long long size)
+{
+    const char *src = bytes;
+
+    while (size > 0) {
+        int chunk = size < CACHE_WRITE_BUFFER - writer->used ? (int) size : CACHE_WRITE_BUFFER - writer->used;
+
+        count_copy(chunk);
+        memcpy(writer->buffer + writer->used, src, chunk);
+        writer->used += chunk;
+        src += chunk;
+        size -= chunk;
+        if (writer->used == CACHE_WRITE_BUFFER) flush_writer(writer);
+    }
+}
+
+// Write the table of capacity slots and the entries they point to (sources),
+// which are laid out in slot order. Returns 0 or -1.
+static int write_cache_file(ID3v2_io *io, uint32_t filter, cache_slot *slots, const char **sources,
+                            uint32_t capacity, uint64_t count)
+{
+    cache_writer writer = { io, NULL, 0, 0, 0 };
+    cache_file_header header;
+    uint64_t data_size = 0;
+
+    for (uint32_t i = 0; i < capacity; i++) {
+        if (slots[i].state != SLOT_USED) continue;
+        slots[i].offset = data_size;
+        data_size += slots[i].length;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, 4);
+    header.format = CACHE_FORMAT;
+    header.filter = filter;
+    header.capacity = capacity;
+    header.count = count;
+    header.data_size = data_size;
+
+    writer.buffer = mem_alloc(CACHE_WRITE_BUFFER);
+    if (!writer.buffer) return -1;
+
+    write_bytes(&writer, &header, sizeof(header));
+    write_bytes(&writer, slots, (long long) capacity * sizeof(cache_slot));
+    for (uint32_t i = 0; i < capacity; i++) {
+        if (slots[i].state == SLOT_USED) write_bytes(&writer, sources[i], slots[i].length);
+    }
+    flush_writer(&writer);
+
+    mem_free(writer.buffer);
+
+    return writer.failed ? -1 : 0;
+}
+
+// Whether a slot of the file goes into the saved one: it is valid and was
+// neither replaced nor removed since
+static int is_kept_slot(ID3v2_tag_cache *cache, const cache_slot *slot)
+{
+    if (slot->state != SLOT_USED || !is_valid_slot(cache, slot)) return 0;
+    if (!cache->entry_capacity) return 1;
+
+    return cache->entries[find_slot(cache->entries, cache->entry_capacity, slot->dev, slot->ino)].state == SLOT_EMPTY;
+}
+
+static void add_kept_slot(cache_slot *slots, const char **sources, uint32_t capacity,
+                          const cache_slot *slot, const char *source)
+{
+    uint32_t i = find_slot(slots, capacity, slot->dev, slot->ino);
+
+    slots[i] = *slot;
+    sources[i] = source;
+}
+
+// Write the cache to its file: the entries of the file it was opened from
+// that are still there and the ones stored since. The new file is renamed
+// over the old one once it is on disk, and then used in place of it.
+// Lookups wait while it is written. Returns 0, or -1 on error.
+int save_tag_cache(ID3v2_tag_cache *cache)
+{
+    uint32_t capacity = CACHE_MIN_CAPACITY;
+    uint64_t count = 0;
+    cache_slot *slots;
+    const char **sources;
+    char *temp_name;
+    ID3v2_io io;
+    int result = 0;
+    int written;
+    int fd;
+
+    pthread_rwlock_wrlock(&cache->lock);
+
+    for (uint32_t i = 0; i < cache->entry_capacity; i++) {
+        if (cache->entries[i].state == SLOT_USED) count++;
+    }
+    for (uint32_t i = 0; i < cache->capacity; i++) {
+        if (is_kept_slot(cache, &cache->slots[i])) count++;
+    }
+    while ((uint64_t) capacity * 3 / 4 <= count && capacity < CACHE_MAX_CAPACITY) capacity *= 2;
+
+    slots = mem_calloc(capacity, sizeof(cache_slot));
+    sources = mem_calloc(capacity, sizeof(char *));
+    temp_name = mem_alloc(strlen(cache->file_name) + sizeof(".XXXXXX"));
+    if (!slots || !sources || !temp_name || (uint64_t) capacity * 3 / 4 <= count) {
+        report_error("Error saving cache");
+        mem_free(slots);
+        mem_free(sources);
+        mem_free(temp_name);
+        pthread_rwlock_unlock(&cache->lock);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < cache->entry_capacity; i++) {
+        if (cache->entries[i].state == SLOT_USED) {
+            add_kept_slot(slots, sources, capacity, &cache->entries[i], cache->entry_data[i]);
+        }
+    }
+    for (uint32_t i = 0; i < cache->capacity; i++) {
+        if (is_kept_slot(cache, &cache->slots[i])) {
+            add_kept_slot(slots, sources, capacity, &cache->slots[i], cache->data + cache->slots[i].offset);
+        }
+    }
+
+    // Next to the old file, rename() only works within a filesystem
+    sprintf(temp_name, "%s.XXXXXX", cache->file_name);
+    count_syscalls(1);
+    fd = mkstemp(temp_name);
+    if (fd < 0) {
+        report_error("Error creating temp file");
+        result = -1;
+    } else {
+        io_from_fd(&io, fd);
+        written = write_cache_file(&io, cache->filter, slots, sources, capacity, count) == 0 && fsync(fd) == 0;
+        count_syscalls(3);	// fsync(), close() and rename()
+
+        if (close(fd) != 0 || !written || rename(temp_name, cache->file_name) != 0) {
+            report_error("Error writing cache");
+            unlink(temp_name);
+            result = -1;
+        }
+    }
+
+    mem_free(slots);
+    mem_free(sources);
+    mem_free(temp_name);
+
+    // The entries are all in the new file now, it replaces them
+    if (result == 0) {
+        free_entries(cache);
+        unmap_cache_file(cache);
+        map_cache_file(cache);
+    }
+
+    pthread_rwlock_unlock(&cache->lock);
+
+    return result;
+}
+
+// Read the tag of file_name and store it. The entry is keyed by the file
+// that was read, which may have been replaced since it was looked up.
+static int read_and_store(ID3v2_tag_cache *cache, const char *file_name, ID3v2_tag **tag)
+{
+    struct stat st;
+    ID3v2_io io;
+    char *entry = NULL;
+    int length = 0;
+    int error;
+    int fd;
+
+    count_syscalls(1);
+    fd = open(file_name, O_RDONLY);
+    if (fd < 0) return -1;
+
+    count_syscalls(1);
+    if (fstat(fd, &st) != 0) {
+        error = errno;
+        count_syscalls(1);
+        close(fd);
+        errno = error;
+        return -1;
+    }
+
+    io_from_fd(&io, fd);
+    errno = 0;
+    if (cache->frame_ids) {
+        *tag = load_tag_frames_with_io(&io, cache->frame_ids, cache->frame_count);
+    } else {
+        *tag = load_tag_with_io(&io);
+    }
+    error = errno;
+
+    count_syscalls(1);
+    close(fd);
+
+    // A file that could not be read is not taken for one without a tag
+    if (!*tag && error) {
+        errno = error;
+        return -1;
+    }
+
+    if (*tag) entry = encode_entry(*tag, &length);
+    if (!*tag || entry) {
+        pthread_rwlock_wrlock(&cache->lock);
+        if (!put_entry(cache, &st, SLOT_USED, entry, length)) mem_free(entry);
+        pthread_rwlock_unlock(&cache->lock);
+    }
+
+    return 0;
+}
+
+// Set *tag to the tag of file_name, NULL if it has none. Files that did not
+// change since they were cached are answered without being opened, the
+// others are read and their tag stored. Returns 1 if the tag came from the
+// cache, 0 if the file was read and -1 (errno set) if it could not be.
+int read_cached_tag(ID3v2_tag_cache *cache, const char *file_name, ID3v2_tag **tag)
+{
+    const cache_slot *slot;
+    const char *data;
+    struct stat st;
+    int found;
+
+    *tag = NULL;
+
+    count_syscalls(1);
+    if (stat(file_name, &st) != 0) return -1;
+
+    pthread_rwlock_rdlock(&cache->lock);
+    slot = find_entry(cache, &st, &data);
+    if (slot && slot->length > 0) *tag = decode_entry(data, slot->length);
+    found = slot && (slot->length == 0 || *tag);
+    pthread_rwlock_unlock(&cache->lock);
+
+    return found ? 1 : read_and_store(cache, file_name, tag);
+}
+
+// Like load_tag(), through the cache. Only the frames the cache keeps are
+// loaded. Free the tag with free_tag().
+ID3v2_tag *load_cached_tag(ID3v2_tag_cache *cache, const char *file_name)
+{
+    ID3v2_tag *tag;
+
+    if (read_cached_tag(cache, file_name, &tag) < 0) {
+        report_error("Error opening file");
+        return NULL;
+    }
+
+    return tag;
+}
+
+// Forget the tag of file_name, for files modified without their size or
+// mtime changing. Returns 0, or -1 if the file cannot be found.
+int invalidate_cached_tag(ID3v2_tag_cache *cache, const char *file_name)
+{
+    struct stat st;
+    int result;
+
+    count_syscalls(1);
+    if (stat(file_name, &st) != 0) return -1;
+
+    pthread_rwlock_wrlock(&cache->lock);
+    result = put_entry(cache, &st, SLOT_REMOVED, NULL, 0) ? 0 : -1;
+    pthread_rwlock_unlock(&cache->lock);
+
+    return result;
+}
+
+// Forget every tag, the cache file is emptied by the next save_tag_cache()
+void clear_tag_cache(ID3v2_tag_cache *cache)
+{
+    pthread_rwlock_wrlock(&cache->lock);
+    free_entries(cache);
+    unmap_cache_file(cache);
+    pthread_rwlock_unlock(&cache->lock);
+}
+
+// Store the tag of every file that is not cached yet or changed since, from
+// a pool of threads (0 for one per online CPU). Returns what scan_files() does.
+int warm_tag_cache(ID3v2_tag_cache *cache, char **file_names, int count, int threads, ID3v2_scan_stats *stats)
+{
+    ID3v2_scan_options options = { threads, NULL, NULL, 0, cache };
+
+    return scan_files(file_names, count, &options, stats);
+}
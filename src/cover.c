@@ -0,0 +1,378 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+#include "id3v2lib.h"
+#include "cover.h"
+
+#define COVER_BLOCK (64 * 1024)	// the picture is handed to the sink in chunks of this size
+
+// Where the album cover frame is
+typedef struct
+{
+    int version;
+    int unsynchronised;		// the frame offsets are not file offsets, see send_unsynchronised_cover()
+    long long base;		// of the tag, not 0 when it is appended to the file
+    long long end;		// of the tag
+    long long offset;		// of the frame payload
+    int size;
+    char flags[ID3_FRAME_FLAGS];
+    int encoded;		// compressed or the like, see send_encoded_cover()
+    char head[ID3_HEADER];	// the tag header, already read from the file
+} cover_frame;
+
+// Where send_picture() sends the picture
+typedef struct
+{
+    ID3v2_picture_sink sink;
+    void *user_data;
+    int fd;
+    ID3v2_picture_info *info;
+    int result;
+} cover_output;
+
+// Fill info from the start of an APIC frame. Returns the offset of the
+// picture in data, or -1 if the fields before it do not end in the size bytes.
+static int parse_picture_fields(const char *data, int size, int version, ID3v2_picture_info *info)
+{
+    const char *end;
+    int pos = 1;	// the encoding
+    int length;
+
+    if (version == ID3v22) {
+        // three character image format
+        if (size < pos + 3) return -1;
+        memcpy(info->mime_type, "image/", 6);
+        for (int i = 0; i < 3; i++) info->mime_type[6 + i] = (char) tolower((unsigned char) data[pos + i]);
+        info->mime_type[9] = '\0';
+        pos += 3;
+    } else {
+        end = memchr(data + pos, '\0', size - pos);
+        if (!end) return -1;
+        length = (int) (end - (data + pos));
+        if (length > (int) sizeof(info->mime_type) - 1) length = sizeof(info->mime_type) - 1;
+        memcpy(info->mime_type, data + pos, length);
+        info->mime_type[length] = '\0';
+        pos = (int) (end - data) + 1;
+    }
+
+    if (pos >= size) return -1;
+    info->picture_type = data[pos++];
+
+    // skip the description
+    if (data[0] == ID3_TEXT_ENCODING_UTF16_WITH_BOM || data[0] == ID3_TEXT_ENCODING_UTF16BE_WITHOUT_BOM) {
+        while (pos + 1 < size && (data[pos] || data[pos + 1])) pos += 2;
+        if (pos + 1 >= size) return -1;
+        pos += 2;
+    } else {
+        end = memchr(data + pos, '\0', size - pos);
+        if (!end) return -1;
+        pos = (int) (end - data) + 1;
+    }
+
+    info->picture_size = size - pos;
+    return pos;
+}
+
+// Walk the frame headers up to the first APIC frame, nothing else is read.
+// Returns 1 when there is one, 0 when there is none and -1 on error.
+static int find_cover_frame(ID3v2_io *io, cover_frame *cover)
+{
+    char head[ID3_FRAME];
+    ID3v2_header tag_header;
+    ID3v2_frame frame;
+    long long offset, end;
+    int frame_header_size;
+
+    cover->base = 0;
+    if (io_read_at(io, cover->head, ID3_HEADER, 0) != ID3_HEADER ||
+        !parse_tag_header(cover->head, ID3_HEADER, &tag_header)) {
+        cover->base = find_appended_tag_with_io(io);
+        if (cover->base < 0 || io_read_at(io, cover->head, ID3_HEADER, cover->base) != ID3_HEADER) return 0;
+        if (!parse_tag_header(cover->head, ID3_HEADER, &tag_header)) return 0;
+    }
+
+    cover->version = get_tag_orig_version(&tag_header);
+    cover->unsynchronised = needs_tag_decoding(&tag_header);
+    cover->end = cover->base + ID3_HEADER + tag_header.tag_size;
+    if (cover->version == NO_COMPATIBLE_TAG) return 0;
+    if (cover->unsynchronised) return 1;
+
+    offset = cover->base + ID3_HEADER;
+    end = cover->end;
+    frame_header_size = (cover->version == ID3v22) ? ID3_FRAME_v22 : ID3_FRAME;
+
+    if (tag_header.flags & ID3_HEADER_FLAGS_HAS_EXTENDED_HEADER) {
+        if (io_read_at(io, head, ID3_EXTENDED_HEADER_SIZE, offset) != ID3_EXTENDED_HEADER_SIZE) return -1;
+        offset += ID3_EXTENDED_HEADER_SIZE + parse_extended_header_size(head, tag_header.orig_major_version);
+    }
+
+    while (offset + frame_header_size <= end) {
+        if (io_read_at(io, head, frame_header_size, offset) != frame_header_size) return -1;
+
+        // padding, or a truncated or corrupt frame
+        if (!parse_frame_header(head, 0, cover->version, &frame)) return 0;
+        if (frame.size < 0 || frame.size > end - offset - frame_header_size) return 0;
+
+        offset += frame_header_size;
+        if (memcmp(frame.frame_id, ALBUM_COVER_FRAME_ID, ID3_FRAME_ID) == 0) {
+            cover->offset = offset;
+            cover->size = frame.size;
+            memcpy(cover->flags, frame.flags, ID3_FRAME_FLAGS);
+            cover->encoded = is_frame_encoded(&frame);
+            return 1;
+        }
+        offset += frame.size;
+    }
+
+    return 0;
+}
+
+// The picture goes to the sink, or to the descriptor when there is no sink,
+// or nowhere when the descriptor is -1 too
+static int send_picture(const char *bytes, int size, cover_output *output)
+{
+    if (output->sink) return output->sink(bytes, size, output->user_data) == 0 ? 0 : -1;
+
+#ifndef _WIN32
+    while (output->fd >= 0 && size > 0) {
+        ssize_t result = write(output->fd, bytes, size);
+        if (result < 0 && errno == EINTR) continue;
+        if (result <= 0) return -1;
+        bytes += result;
+        size -= (int) result;
+    }
+#endif
+
+    return 0;
+}
+
+static int on_cover_frame(ID3v2_frame *frame, void *user_data)
+{
+    cover_output *output = user_data;
+    int pos = parse_picture_fields(frame->data, frame->size, frame->version, output->info);
+
+    if (pos < 0) {
+        report_error("Error reading album cover");
+        output->result = -1;
+    } else {
+        output->info->offset = -1;
+        output->result = send_picture(frame->data + pos, output->info->picture_size, output) == 0 ? 1 : -1;
+    }
+
+    return 1;	// no need to look any further
+}
+
+// An unsynchronised tag has to be decoded before the picture can be found.
+// The tag goes through a parser that only keeps the album cover frame, fed
+// from buffer when there is one, otherwise from io after the header.
+static int send_unsynchronised_cover(ID3v2_io *io, const char *buffer, int length, cover_frame *cover,
+                                     cover_output *output)
+{
+    char *frame_ids[] = { ALBUM_COVER_FRAME_ID };
+    ID3v2_parser *parser = new_parser(on_cover_frame, output);
+    char *block = buffer ? NULL : mem_alloc(COVER_BLOCK);
+    long long offset = cover->base + ID3_HEADER;
+    int status, wanted, got;
+
+    output->result = -1;
+    if (!parser || (!buffer && !block)) {
+        free_parser(parser);
+        return -1;
+    }
+
+    output->result = 0;
+    parser_select_frames(parser, frame_ids, 1);
+
+    if (buffer) {
+        parser_feed(parser, buffer + cover->base, length - (int) cover->base);
+    } else {
+        status = parser_feed(parser, cover->head, ID3_HEADER);
+        while (status == ID3_PARSE_MORE) {
+            wanted = parser_needed(parser) < COVER_BLOCK ? parser_needed(parser) : COVER_BLOCK;
+            got = io_read_at(io, block, wanted, offset);
+            if (got <= 0) break;
+            offset += got;
+            status = parser_feed(parser, block, got);
+        }
+    }
+
+    mem_free(block);
+    free_parser(parser);
+    return output->result;
+}
+
+// A compressed cover frame (or one with other format flags) is read and
+// decoded in memory, from buffer when there is one, otherwise from io
+static int send_encoded_cover(ID3v2_io *io, const char *buffer, cover_frame *cover, cover_output *output)
+{
+    ID3v2_frame frame;
+    char *stored = NULL;
+
+    memset(&frame, 0, sizeof(ID3v2_frame));
+    memcpy(frame.frame_id, ALBUM_COVER_FRAME_ID, ID3_FRAME_ID);
+    memcpy(frame.flags, cover->flags, ID3_FRAME_FLAGS);
+    frame.version = cover->version;
+    frame.size = cover->size;
+
+    if (buffer) {
+        frame.source = (char *) buffer + cover->offset;
+    } else {
+        stored = mem_alloc(cover->size ? cover->size : 1);
+        if (!stored || io_read_at(io, stored, cover->size, cover->offset) != cover->size) {
+            mem_free(stored);
+            return -1;
+        }
+        frame.source = stored;
+    }
+
+    output->result = -1;
+    if (load_frame_data(&frame)) on_cover_frame(&frame, output);
+
+    mem_free(frame.data);
+    mem_free(stored);
+    return output->result;
+}
+
+static int send_album_cover(ID3v2_io *io, ID3v2_picture_sink sink, void *user_data, int fd, ID3v2_picture_info *info)
+{
+    ID3v2_picture_info local;
+    cover_output output = { sink, user_data, fd, info ? info : &local, 0 };
+    cover_frame cover;
+    char *block;
+    long long done;
+    int chunk, pos, result;
+
+    result = find_cover_frame(io, &cover);
+    if (result <= 0) return result;
+    if (cover.unsynchronised) return send_unsynchronised_cover(io, NULL, 0, &cover, &output);
+    if (cover.encoded) return send_encoded_cover(io, NULL, &cover, &output);
+
+    // The fields before the picture and its first bytes
+    chunk = cover.size < COVER_BLOCK ? cover.size : COVER_BLOCK;
+    block = mem_alloc(chunk ? chunk : 1);
+    if (!block) return -1;
+
+    if (io_read_at(io, block, chunk, cover.offset) != chunk ||
+        (pos = parse_picture_fields(block, chunk, cover.version, output.info)) < 0) {
+        report_error("Error reading album cover");
+        mem_free(block);
+        return -1;
+    }
+    output.info->picture_size = cover.size - pos;
+    output.info->offset = cover.offset + pos;
+
+    if (send_picture(block + pos, chunk - pos, &output) != 0) {
+        mem_free(block);
+        return -1;
+    }
+
+    // Then the rest of it, straight from the file
+    done = chunk;
+#ifndef _WIN32
+    if (!sink && fd >= 0 && done < cover.size) {
+        mem_free(block);
+        return io_send(io, cover.offset + done, cover.size - done, fd) == 0 ? 1 : -1;
+    }
+#endif
+
+    while (done < cover.size && (sink || fd >= 0)) {
+        chunk = cover.size - done < COVER_BLOCK ? (int) (cover.size - done) : COVER_BLOCK;
+
+        if (io_read_at(io, block, chunk, cover.offset + done) != chunk ||
+            send_picture(block, chunk, &output) != 0) {
+            mem_free(block);
+            return -1;
+        }
+        done += chunk;
+    }
+
+    mem_free(block);
+    return 1;
+}
+
+// Locate the album cover and fill info, only the first block of the picture is read
+int find_album_cover_with_io(ID3v2_io *io, ID3v2_picture_info *info)
+{
+    return send_album_cover(io, NULL, NULL, -1, info);
+}
+
+// Hand the album cover to sink in chunks, the frame is never held in memory
+int stream_album_cover_with_io(ID3v2_io *io, ID3v2_picture_sink sink, void *user_data, ID3v2_picture_info *info)
+{
+    return send_album_cover(io, sink, user_data, -1, info);
+}
+
+// The sink gets the whole picture at once, pointing into buffer
+int stream_album_cover_with_buffer(const char *buffer, int length, ID3v2_picture_sink sink, void *user_data,
+                                   ID3v2_picture_info *info)
+{
+    ID3v2_memory_file memory = { (char *) buffer, length, length, 0 };
+    ID3v2_picture_info local;
+    cover_output output = { sink, user_data, -1, info ? info : &local, 0 };
+    cover_frame cover;
+    ID3v2_io io;
+    int pos, result;
+
+    io_from_memory(&io, &memory);
+    result = find_cover_frame(&io, &cover);
+    if (result <= 0) return result;
+
+    // The frames are only checked against the tag size, which a truncated
+    // buffer does not hold (an unsynchronised tag is decoded as a whole)
+    if ((cover.unsynchronised ? cover.end : cover.offset + cover.size) > length) {
+        report_error("Error reading album cover");
+        return -1;
+    }
+
+    if (cover.unsynchronised) return send_unsynchronised_cover(NULL, buffer, length, &cover, &output);
+    if (cover.encoded) return send_encoded_cover(NULL, buffer, &cover, &output);
+
+    pos = parse_picture_fields(buffer + cover.offset, cover.size, cover.version, output.info);
+    if (pos < 0) {
+        report_error("Error reading album cover");
+        return -1;
+    }
+    output.info->offset = cover.offset + pos;
+
+    return sink(buffer + output.info->offset, output.info->picture_size, user_data) == 0 ? 1 : -1;
+}
+
+#ifndef _WIN32
+// Write the album cover to fd, which may be a pipe or a socket. From a file
+// descriptor the picture goes through sendfile() where available.
+int extract_album_cover_with_io(ID3v2_io *io, int fd, ID3v2_picture_info *info)
+{
+    return send_album_cover(io, NULL, NULL, fd, info);
+}
+
+int extract_album_cover(const char *file_name, int fd, ID3v2_picture_info *info)
+{
+    ID3v2_io io;
+    int result;
+
+    if (io_open_file(&io, file_name, 0) != 0) {
+        report_error("Error opening file");
+        return -1;
+    }
+
+    result = extract_album_cover_with_io(&io, fd, info);
+    io_close_file(&io);
+
+    return result;
+}
+#endif
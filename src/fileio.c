@@ -0,0 +1,699 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE	// copy_file_range() and the fallocate() range flags
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/falloc.h>
+#include <sys/sendfile.h>
+#endif
+
+#include "alloc.h"
+#include "fileio.h"
+#include "stats.h"
+#include "utils.h"
+
+#define IO_MOVE_BLOCK (1024 * 1024)
+#define IO_MAX_SHIFT_BLOCK (64 * 1024)	// bigger blocks would waste too much padding
+#define IO_SEND_BLOCK (64 * 1024)
+
+#ifdef IOV_MAX
+#define IO_MAX_IOVECS IOV_MAX
+#else
+#define IO_MAX_IOVECS 1024
+#endif
+
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE
+#endif
+
+#ifndef _WIN32
+// File descriptor backend, the descriptor is stored in the handle
+
+#define IO_FD(handle) ((int) (intptr_t) (handle))
+
+static int fd_read(void *handle, char *buffer, int size)
+{
+    int done = 0;
+
+    while (done < size) {
+        ssize_t result;
+
+        count_syscalls(1);
+        result = read(IO_FD(handle), buffer + done, size - done);
+        if (result < 0 && errno == EINTR) continue;
+        if (result < 0) return -1;
+        if (result == 0) break;
+        done += (int) result;
+    }
+
+    return done;
+}
+
+static int fd_pread(void *handle, char *buffer, int size, long long offset)
+{
+    int done = 0;
+
+    while (done < size) {
+        ssize_t result;
+
+        count_syscalls(1);
+        result = pread(IO_FD(handle), buffer + done, size - done, (off_t) (offset + done));
+        if (result < 0 && errno == EINTR) continue;
+        if (result < 0) return -1;
+        if (result == 0) break;
+        done += (int) result;
+    }
+
+    return done;
+}
+
+static int fd_write(void *handle, const char *buffer, int size, long long offset)
+{
+    int done = 0;
+
+    while (done < size) {
+        ssize_t result;
+
+        count_syscalls(1);
+        result = pwrite(IO_FD(handle), buffer + done, size - done, (off_t) (offset + done));
+        if (result < 0 && errno == EINTR) continue;
+        if (result <= 0) return -1;
+        done += (int) result;
+    }
+
+    return done;
+}
+
+// One pwritev() for the whole tag in the common case
+static int fd_writev(void *handle, const ID3v2_iovec *iov, int count, long long offset)
+{
+    while (count > 0) {
+        ssize_t result;
+
+        count_syscalls(1);
+        result = pwritev(IO_FD(handle), iov, count < IO_MAX_IOVECS ? count : IO_MAX_IOVECS, (off_t) offset);
+        if (result < 0 && errno == EINTR) continue;
+        if (result <= 0) return -1;
+        offset += result;
+
+        while (count > 0 && (size_t) result >= iov->iov_len) {
+            result -= (ssize_t) iov->iov_len;
+            iov++;
+            count--;
+        }
+
+        if (count > 0 && result > 0) {
+            // finish the buffer that was cut short
+            int rest = (int) (iov->iov_len - result);
+            if (fd_write(handle, (const char *) iov->iov_base + result, rest, offset) != rest) return -1;
+            offset += rest;
+            iov++;
+            count--;
+        }
+    }
+
+    return 0;
+}
+
+// For descriptors that cannot seek
+static int fd_write_all(int fd, const char *buffer, int size)
+{
+    int done = 0;
+
+    while (done < size) {
+        ssize_t result;
+
+        count_syscalls(1);
+        result = write(fd, buffer + done, size - done);
+        if (result < 0 && errno == EINTR) continue;
+        if (result <= 0) return -1;
+        done += (int) result;
+    }
+
+    return 0;
+}
+
+static int fd_truncate(void *handle, long long size)
+{
+    count_syscalls(1);
+    return ftruncate(IO_FD(handle), (off_t) size);
+}
+
+static long long fd_size(void *handle)
+{
+    struct stat st;
+
+    count_syscalls(1);
+    if (fstat(IO_FD(handle), &st) != 0) return -1;
+    return (long long) st.st_size;
+}
+
+static int buffered_move(ID3v2_io *io, long long from, long long to, long long length);
+
+static int fd_move(void *handle, long long from, long long to, long long length)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+    long long distance = to > from ? to - from : from - to;
+    long long done = 0;
+    ID3v2_io io;
+
+    // The kernel refuses overlapping ranges of the same file, so chunks are at
+    // most the distance. Short distances are left to the buffered copy, one
+    // syscall per few KB would be slower than copying.
+    if (distance < IO_MOVE_BLOCK) return 1;
+
+    while (done < length) {
+        long long chunk = length - done < distance ? length - done : distance;
+        // Moving forward copies from the end so nothing is overwritten before it is read
+        long long offset = to > from ? length - done - chunk : done;
+        loff_t in = (loff_t) (from + offset);
+        loff_t out = (loff_t) (to + offset);
+        loff_t end = in + chunk;
+
+        while (in < end) {
+            ssize_t result;
+
+            count_syscalls(1);
+            result = copy_file_range(IO_FD(handle), &in, IO_FD(handle), &out, (size_t) (end - in), 0);
+            if (result < 0 && errno == EINTR) continue;
+            if (result <= 0) break;
+        }
+
+        if (in < end) {
+            if (done == 0 && in == from + offset) return 1;	// nothing moved, fall back
+
+            // Finish with the buffered copy. The moved bytes may have overwritten
+            // the start of the source, so the move cannot be started over.
+            io_from_fd(&io, IO_FD(handle));
+            if (buffered_move(&io, in, out, end - in) != 0) return -1;
+            done += chunk;
+            if (to > from) return buffered_move(&io, from, to, length - done);
+            return buffered_move(&io, from + done, to + done, length - done);
+        }
+
+        done += chunk;
+    }
+
+    return 0;
+#else
+    (void) handle; (void) from; (void) to; (void) length;
+    return 1;
+#endif
+}
+
+static int fd_shift(void *handle, long long offset, long long distance)
+{
+#if defined(__linux__) && defined(FALLOC_FL_INSERT_RANGE)
+    int result;
+
+    // Both only work on whole filesystem blocks and fail without changing
+    // anything otherwise (or where the filesystem does not support them)
+    count_syscalls(1);
+    if (distance > 0) {
+        result = fallocate(IO_FD(handle), FALLOC_FL_INSERT_RANGE, (off_t) offset, (off_t) distance);
+    } else {
+        result = fallocate(IO_FD(handle), FALLOC_FL_COLLAPSE_RANGE, (off_t) (offset + distance), (off_t) -distance);
+    }
+    return result == 0 ? 0 : 1;
+#else
+    (void) handle; (void) offset; (void) distance;
+    return 1;
+#endif
+}
+
+void io_from_fd(ID3v2_io *io, int fd)
+{
+    struct stat st;
+
+    memset(io, 0, sizeof(ID3v2_io));
+    io->handle = (void *) (intptr_t) fd;
+    io->read = fd_read;
+    io->pread = fd_pread;
+    io->write = fd_write;
+    io->truncate = fd_truncate;
+    io->size = fd_size;
+    io->move = fd_move;
+    io->shift = fd_shift;
+    io->writev = fd_writev;
+    count_syscalls(1);
+    if (fstat(fd, &st) == 0 && st.st_blksize <= IO_MAX_SHIFT_BLOCK) io->block_size = (int) st.st_blksize;
+}
+#endif
+
+// stdio backend
+
+static int stdio_seek(FILE *file, long long offset)
+{
+#ifdef _WIN32
+    return _fseeki64(file, offset, SEEK_SET);
+#else
+    return fseeko(file, (off_t) offset, SEEK_SET);
+#endif
+}
+
+static int stdio_read(void *handle, char *buffer, int size)
+{
+    size_t result = fread(buffer, 1, size, handle);
+    return (result == 0 && ferror((FILE *) handle)) ? -1 : (int) result;
+}
+
+static int stdio_pread(void *handle, char *buffer, int size, long long offset)
+{
+    if (stdio_seek(handle, offset) != 0) return -1;
+    return stdio_read(handle, buffer, size);
+}
+
+static int stdio_write(void *handle, const char *buffer, int size, long long offset)
+{
+    if (stdio_seek(handle, offset) != 0) return -1;
+    return fwrite(buffer, 1, size, handle) == (size_t) size ? size : -1;
+}
+
+static int stdio_truncate(void *handle, long long size)
+{
+    if (fflush(handle) != 0) return -1;
+#ifdef _WIN32
+    return _chsize_s(_fileno(handle), size) == 0 ? 0 : -1;
+#else
+    return ftruncate(fileno(handle), (off_t) size);
+#endif
+}
+
+static long long stdio_size(void *handle)
+{
+    FILE *file = handle;
+
+#ifdef _WIN32
+    if (_fseeki64(file, 0, SEEK_END) != 0) return -1;
+    return _ftelli64(file);
+#else
+    if (fseeko(file, 0, SEEK_END) != 0) return -1;
+    return (long long) ftello(file);
+#endif
+}
+
+void io_from_stdio(ID3v2_io *io, FILE *file)
+{
+    memset(io, 0, sizeof(ID3v2_io));
+    io->handle = file;
+    io->read = stdio_read;
+    io->pread = stdio_pread;
+    io->write = stdio_write;
+    io->truncate = stdio_truncate;
+    io->size = stdio_size;
+}
+
+// Memory backend
+
+static int memory_pread(void *handle, char *buffer, int size, long long offset)
+{
+    ID3v2_memory_file *memory = handle;
+
+    if (offset < 0) return -1;
+    if (offset >= memory->size) return 0;
+    if (size > memory->size - offset) size = (int) (memory->size - offset);
+
+    memcpy(buffer, memory->data + offset, size);
+    return size;
+}
+
+static int memory_read(void *handle, char *buffer, int size)
+{
+    ID3v2_memory_file *memory = handle;
+    int result = memory_pread(handle, buffer, size, memory->position);
+
+    if (result > 0) memory->position += result;
+    return result;
+}
+
+static int memory_reserve(ID3v2_memory_file *memory, long long size)
+{
+    long long capacity = memory->capacity ? memory->capacity : 4096;
+    char *data;
+
+    if (size <= memory->capacity) return 0;
+
+    while (capacity < size) capacity *= 2;
+    data = realloc(memory->data, (size_t) capacity);
+    if (!data) return -1;
+
+    memory->data = data;
+    memory->capacity = capacity;
+    return 0;
+}
+
+static int memory_write(void *handle, const char *buffer, int size, long long offset)
+{
+    ID3v2_memory_file *memory = handle;
+
+    if (offset < 0 || memory_reserve(memory, offset + size) != 0) return -1;
+
+    if (offset > memory->size) {
+        // writing past the end leaves a hole of zeros, like a file
+        memset(memory->data + memory->size, 0, (size_t) (offset - memory->size));
+    }
+    memcpy(memory->data + offset, buffer, size);
+    if (offset + size > memory->size) memory->size = offset + size;
+
+    return size;
+}
+
+static int memory_truncate(void *handle, long long size)
+{
+    ID3v2_memory_file *memory = handle;
+
+    if (size < 0 || memory_reserve(memory, size) != 0) return -1;
+
+    if (size > memory->size) memset(memory->data + memory->size, 0, (size_t) (size - memory->size));
+    memory->size = size;
+    if (memory->position > size) memory->position = size;
+
+    return 0;
+}
+
+static int memory_move(void *handle, long long from, long long to, long long length)
+{
+    ID3v2_memory_file *memory = handle;
+
+    if (from < 0 || to < 0 || from + length > memory->size) return 1;
+    if (memory_truncate(handle, to + length > memory->size ? to + length : memory->size) != 0) return -1;
+
+    memmove(memory->data + to, memory->data + from, (size_t) length);
+    return 0;
+}
+
+static long long memory_size(void *handle)
+{
+    return ((ID3v2_memory_file *) handle)->size;
+}
+
+void io_from_memory(ID3v2_io *io, ID3v2_memory_file *memory)
+{
+    memset(io, 0, sizeof(ID3v2_io));
+    io->handle = memory;
+    io->read = memory_read;
+    io->pread = memory_pread;
+    io->write = memory_write;
+    io->truncate = memory_truncate;
+    io->size = memory_size;
+    io->move = memory_move;
+}
+
+// Backend used by the functions taking a file name: a descriptor where there
+// is one, stdio otherwise. Returns 0 or -1 if the file could not be opened.
+int io_open_file(ID3v2_io *io, const char *file_name, int writable)
+{
+#ifdef _WIN32
+    FILE *file = fopen(file_name, writable ? "r+b" : "rb");
+    if (!file) return -1;
+    io_from_stdio(io, file);
+#else
+    int fd;
+
+    count_syscalls(1);
+    fd = open(file_name, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) return -1;
+    io_from_fd(io, fd);
+#endif
+    return 0;
+}
+
+void io_close_file(ID3v2_io *io)
+{
+#ifdef _WIN32
+    fclose(io->handle);
+#else
+    count_syscalls(1);
+    close(IO_FD(io->handle));
+#endif
+    io->handle = NULL;
+}
+
+// Read size bytes at offset, returns the number of bytes read (short at the
+// end of the file) or -1. Without pread the stream is read forward to offset.
+int io_read_at(ID3v2_io *io, char *buffer, int size, long long offset)
+{
+    int result;
+
+    if (io->pread) {
+        result = io->pread(io->handle, buffer, size, offset);
+        count_read(result);
+        return result;
+    }
+    if (!io->read || offset < io->position) return -1;
+
+    while (io->position < offset) {
+        char skip[4096];
+        int chunk = offset - io->position < (long long) sizeof(skip) ? (int) (offset - io->position) : (int) sizeof(skip);
+
+        result = io->read(io->handle, skip, chunk);
+        if (result <= 0) return result;
+        count_read(result);
+        io->position += result;
+    }
+
+    result = io->read(io->handle, buffer, size);
+    if (result > 0) io->position += result;
+    count_read(result);
+
+    return result;
+}
+
+int io_write_at(ID3v2_io *io, const char *buffer, int size, long long offset)
+{
+    if (!io->write || io->write(io->handle, buffer, size, offset) != size) return -1;
+
+    count_written(size);
+    return size;
+}
+
+// Write the buffers one after the other from offset. Returns 0 or -1.
+int io_writev(ID3v2_io *io, const ID3v2_iovec *iov, int count, long long offset)
+{
+    if (io->writev) {
+        if (io->writev(io->handle, iov, count, offset) != 0) return -1;
+
+        for (int i = 0; i < count; i++) count_written((long long) iov[i].iov_len);
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (io_write_at(io, iov[i].iov_base, (int) iov[i].iov_len, offset) != (int) iov[i].iov_len) return -1;
+        offset += (long long) iov[i].iov_len;
+    }
+
+    return 0;
+}
+
+long long io_size(ID3v2_io *io)
+{
+    return io->size ? io->size(io->handle) : -1;
+}
+
+int io_truncate(ID3v2_io *io, long long size)
+{
+    return io->truncate ? io->truncate(io->handle, size) : -1;
+}
+
+// Copy through one buffer. The writes land on IO_MOVE_BLOCK boundaries of
+// the destination after the first one.
+static int buffered_move(ID3v2_io *io, long long from, long long to, long long length)
+{
+    char *block;
+    long long done = 0;
+
+    if (from == to || length <= 0) return 0;
+
+    block = mem_alloc(IO_MOVE_BLOCK);
+    if (!block) return -1;
+
+    while (done < length) {
+        long long offset;
+        int chunk;
+
+        if (to > from) {
+            // Moving forward copies from the end so nothing is overwritten before it is read
+            long long end = length - done;
+            chunk = (int) ((to + end) % IO_MOVE_BLOCK);
+            if (chunk == 0) chunk = IO_MOVE_BLOCK;
+            if (chunk > end) chunk = (int) end;
+            offset = end - chunk;
+        } else {
+            chunk = IO_MOVE_BLOCK - (int) ((to + done) % IO_MOVE_BLOCK);
+            if (chunk > length - done) chunk = (int) (length - done);
+            offset = done;
+        }
+
+        if (io_read_at(io, block, chunk, from + offset) != chunk ||
+            io_write_at(io, block, chunk, to + offset) != chunk) {
+            mem_free(block);
+            return -1;
+        }
+        done += chunk;
+    }
+
+    mem_free(block);
+    return 0;
+}
+
+// Move length bytes from offset from to offset to, the ranges may overlap.
+// Returns 0 or -1 if a read or write failed.
+int io_move(ID3v2_io *io, long long from, long long to, long long length)
+{
+    if (from == to || length <= 0) return 0;
+
+    count_moved(length);
+    if (io->move) {
+        int result = io->move(io->handle, from, to, length);
+        if (result <= 0) return result;
+    }
+
+    return buffered_move(io, from, to, length);
+}
+
+// Shift everything from offset to the end of the file by distance bytes. A
+// positive distance makes room in front of offset (its content is undefined),
+// a negative one drops the distance bytes before offset and shortens the file.
+// Where the backend can, whole blocks are inserted or removed without copying
+// the data after them, see io->block_size. Returns 0 or -1.
+int io_shift(ID3v2_io *io, long long offset, long long distance)
+{
+    long long size, start;
+    int result = 1;
+
+    if (distance == 0) return 0;
+
+    size = io_size(io);
+    if (size < 0 || offset > size || offset + distance < 0) return -1;
+
+    start = start_phase();
+
+    if (io->shift && offset < size) result = io->shift(io->handle, offset, distance);
+
+    if (result > 0) {
+        result = io_move(io, offset, offset + distance, size - offset) != 0 ? -1 : 0;
+        if (result == 0 && distance < 0) result = io_truncate(io, size + distance);
+    }
+    end_phase(ID3_PHASE_SHIFT, start);
+
+    return result;
+}
+
+// Copy length bytes from src at src_offset to dest at dest_offset, which are
+// different files. Returns 0 or -1.
+int io_copy(ID3v2_io *dest, long long dest_offset, ID3v2_io *src, long long src_offset, long long length)
+{
+    char *block;
+    long long done = 0;
+    long long start = start_phase();
+    int status = 0;
+
+    count_moved(length);
+#ifdef HAVE_COPY_FILE_RANGE
+    if (src->pread == fd_pread && dest->write == fd_write) {
+        // Stays in the kernel, and filesystems that can share extents do not copy at all
+        loff_t in = (loff_t) src_offset;
+        loff_t out = (loff_t) dest_offset;
+
+        while (done < length) {
+            ssize_t result;
+
+            count_syscalls(1);
+            result = copy_file_range(IO_FD(src->handle), &in, IO_FD(dest->handle), &out, (size_t) (length - done), 0);
+            if (result < 0 && errno == EINTR) continue;
+            if (result <= 0) break;
+            done += result;
+        }
+        // Whatever the kernel would not copy (e.g. across filesystems) goes through a buffer
+    }
+#endif
+
+    if (done < length) {
+        block = mem_alloc(IO_MOVE_BLOCK);
+        if (!block) status = -1;
+
+        while (status == 0 && done < length) {
+            int chunk = length - done < IO_MOVE_BLOCK ? (int) (length - done) : IO_MOVE_BLOCK;
+
+            if (io_read_at(src, block, chunk, src_offset + done) != chunk ||
+                io_write_at(dest, block, chunk, dest_offset + done) != chunk) {
+                status = -1;
+            }
+            done += chunk;
+        }
+
+        mem_free(block);
+    }
+    end_phase(ID3_PHASE_SHIFT, start);
+
+    return status;
+}
+
+#ifndef _WIN32
+// Write length bytes of src from offset to the descriptor fd, which may be a
+// pipe or a socket. Returns 0 or -1.
+int io_send(ID3v2_io *src, long long offset, long long length, int fd)
+{
+    char *block;
+    long long done = 0;
+
+#ifdef __linux__
+    if (src->pread == fd_pread) {
+        // Straight from the page cache
+        off_t in = (off_t) offset;
+
+        while (done < length) {
+            ssize_t result;
+
+            count_syscalls(1);
+            result = sendfile(fd, IO_FD(src->handle), &in, (size_t) (length - done));
+            if (result < 0 && errno == EINTR) continue;
+            if (result <= 0) break;
+            done += result;
+        }
+        if (done == length) return 0;
+    }
+#endif
+
+    block = mem_alloc(IO_SEND_BLOCK);
+    if (!block) return -1;
+
+    while (done < length) {
+        int chunk = length - done < IO_SEND_BLOCK ? (int) (length - done) : IO_SEND_BLOCK;
+
+        if (io_read_at(src, block, chunk, offset + done) != chunk ||
+            fd_write_all(fd, block, chunk) != 0) {
+            mem_free(block);
+            return -1;
+        }
+        done += chunk;
+    }
+
+    mem_free(block);
+    return 0;
+}
+#endif
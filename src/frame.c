@@ -12,13 +12,21 @@
 #include <string.h>
 #include <stdlib.h>
 
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "alloc.h"
+#include "arena.h"
 #include "frame.h"
+#include "stats.h"
+#include "unsync.h"
 #include "utils.h"
 #include "constants.h"
 
 
-static ID3v2_frame *parse_frame2(char *bytes, int offset, int version);
-static ID3v2_frame *parse_frame3(char *bytes, int offset, int version);
+static int parse_frame_header2(char *bytes, int offset, int version, ID3v2_frame *frame);
+static int parse_frame_header3(char *bytes, int offset, int version, ID3v2_frame *frame);
 static int convert_v22_frame_id(char *dest, const char *src, int length);
 
 static inline int is_valid_frame_id_char(char c) {
@@ -27,16 +35,49 @@ static inline int is_valid_frame_id_char(char c) {
     return 0;
 }
 
-ID3v2_frame *parse_frame(char *bytes, int offset, int version) {
+ID3v2_frame *parse_frame(char *bytes, int offset, int version)
+{
+    ID3v2_frame *frame = parse_frame_in_place(bytes, offset, version);
+    if (!frame) return NULL;
+
+    // Load frame data
+    char *data = mem_alloc(frame->size);
+    count_copy(frame->size);
+    memcpy(data, frame->data, frame->size);
+    frame->data = data;
+
+    return frame;
+}
+
+// Same as parse_frame() but frame->data points into bytes instead of a copy of them
+ID3v2_frame *parse_frame_in_place(char *bytes, int offset, int version)
+{
+    ID3v2_frame *frame = new_frame();
+
+    if (!parse_frame_header(bytes, offset, version, frame)) {
+        mem_free(frame);
+        return NULL;
+    }
+
+    return frame;
+}
+
+// Fill a caller provided frame from the frame header at offset, frame->data
+// points into bytes. Returns 0 if there is no valid frame at offset.
+int parse_frame_header(char *bytes, int offset, int version, ID3v2_frame *frame)
+{
+    // Callers copy the whole header into their frames
+    frame->source = NULL;
+
     if (version == ID3v22) {
-        return parse_frame2(bytes, offset, version);
+        return parse_frame_header2(bytes, offset, version, frame);
     } else {
-        return parse_frame3(bytes, offset, version);
+        return parse_frame_header3(bytes, offset, version, frame);
     }
 }
 
 // Parse an ID3v22 frame with a three-character ID and length
-static ID3v2_frame *parse_frame2(char *bytes, int offset, int version)
+static int parse_frame_header2(char *bytes, int offset, int version, ID3v2_frame *frame)
 {
     // Validate that this looks like a real frame.  The spec says
     // "The frame ID [is] made out of the characters capital A-Z and 0-9"
@@ -44,31 +85,26 @@ static ID3v2_frame *parse_frame2(char *bytes, int offset, int version)
     const char *f = bytes + offset;
     if (!is_valid_frame_id_char(f[0]) || !is_valid_frame_id_char(f[1]) ||
         !is_valid_frame_id_char(f[2])) {
-        return NULL;
+        return 0;
     }
 
-    ID3v2_frame *frame = new_frame();
-
     // Parse frame header
     if (!convert_v22_frame_id(frame->frame_id, bytes + offset, ID3_FRAME_ID_v22)) {
-        free(frame);
-        return NULL;
+        return 0;
     }
 
     frame->size = btoi(bytes, ID3_FRAME_SIZE_v22, offset + ID3_FRAME_ID_v22);
 
     memset(frame->flags, 0, ID3_FRAME_FLAGS);
 
-    // Load frame data
-    frame->data = malloc(frame->size);
-    memcpy(frame->data, bytes + (offset += ID3_FRAME_v22), frame->size);
+    frame->data = bytes + offset + ID3_FRAME_v22;
 
     frame->version = version;
 
-    return frame;
+    return 1;
 }
 
-ID3v2_frame *parse_frame3(char *bytes, int offset, int version)
+static int parse_frame_header3(char *bytes, int offset, int version, ID3v2_frame *frame)
 {
     // Validate that this looks like a real frame.  The spec says
     // "The frame ID [is] made out of the characters capital A-Z and 0-9"
@@ -76,11 +112,9 @@ ID3v2_frame *parse_frame3(char *bytes, int offset, int version)
     const char *f = bytes + offset;
     if (!is_valid_frame_id_char(f[0]) || !is_valid_frame_id_char(f[1]) ||
         !is_valid_frame_id_char(f[2]) || !is_valid_frame_id_char(f[3])) {
-        return NULL;
+        return 0;
     }
 
-    ID3v2_frame *frame = new_frame();
-
     // Parse frame header
     memcpy(frame->frame_id, bytes + offset, ID3_FRAME_ID);
 
@@ -91,13 +125,302 @@ ID3v2_frame *parse_frame3(char *bytes, int offset, int version)
 
     memcpy(frame->flags, bytes + (offset += ID3_FRAME_SIZE), 2);
 
-    // Load frame data
-    frame->data = malloc(frame->size);
-    memcpy(frame->data, bytes + (offset += ID3_FRAME_FLAGS), frame->size);
+    frame->data = bytes + offset + ID3_FRAME_FLAGS;
 
     frame->version = version;
 
-    return frame;
+    return 1;
+}
+
+static int get_format_flags(int version)
+{
+    if (version == ID3v23) {
+        return ID3_FRAME_FLAG_V23_COMPRESSION | ID3_FRAME_FLAG_V23_ENCRYPTION | ID3_FRAME_FLAG_V23_GROUPING;
+    } else if (version == ID3v24) {
+        return ID3_FRAME_FLAG_V24_GROUPING | ID3_FRAME_FLAG_V24_COMPRESSION | ID3_FRAME_FLAG_V24_ENCRYPTION |
+               ID3_FRAME_FLAG_V24_UNSYNCHRONISATION | ID3_FRAME_FLAG_V24_DATA_LENGTH;
+    }
+
+    return 0;
+}
+
+// 1 if the payload is not stored as is (compressed, unsynchronised, ...)
+int is_frame_encoded(ID3v2_frame *frame)
+{
+    return (frame->flags[1] & get_format_flags(frame->version)) != 0;
+}
+
+// Decoded payloads of a tag loaded in an arena go to the arena as well, so
+// that arena_reset() releases them with the rest of the tag
+static char *alloc_payload(ID3v2_arena *arena, int size)
+{
+    if (arena) return arena_alloc(arena, size ? size : 1);
+    return mem_alloc(size ? size : 1);
+}
+
+static void free_payload(ID3v2_arena *arena, char *payload)
+{
+    if (!arena_owns(arena, payload)) mem_free(payload);
+}
+
+// Inflate the size bytes at src into a new buffer of exactly length bytes
+static char *inflate_payload(const char *src, int size, int length, ID3v2_arena *arena)
+{
+#ifdef HAVE_ZLIB
+    z_stream stream;
+    char *dest;
+    int result;
+
+    // zlib never gets much better than 1:1000, anything above is corrupt
+    if (length < 0 || length / 1024 > size) return NULL;
+
+    dest = alloc_payload(arena, length);
+    if (!dest) return NULL;
+
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit(&stream) != Z_OK) {
+        free_payload(arena, dest);
+        return NULL;
+    }
+    stream.next_in = (Bytef *) src;
+    stream.avail_in = (uInt) size;
+    stream.next_out = (Bytef *) dest;
+    stream.avail_out = (uInt) length;
+    result = inflate(&stream, Z_FINISH);
+    inflateEnd(&stream);
+
+    if (result != Z_STREAM_END || stream.total_out != (uLong) length) {
+        free_payload(arena, dest);
+        return NULL;
+    }
+
+    return dest;
+#else
+    (void) arena;
+    return NULL;
+#endif
+}
+
+// Reverse what the format flags say was done to the stored payload. Returns
+// a new buffer holding the frame content and sets *size, or NULL if it cannot
+// be decoded: encrypted, corrupt, or compressed without zlib.
+static char *decode_frame(ID3v2_frame *frame, const char *stored, int *size, ID3v2_arena *arena)
+{
+    int flags = (unsigned char) frame->flags[1];
+    int v24 = frame->version == ID3v24;
+    int compressed = flags & (v24 ? ID3_FRAME_FLAG_V24_COMPRESSION : ID3_FRAME_FLAG_V23_COMPRESSION);
+    int length = -1;
+    int pos = 0;
+    int body_size;
+    char *body = NULL;
+    char *decoded;
+
+    if (flags & (v24 ? ID3_FRAME_FLAG_V24_ENCRYPTION : ID3_FRAME_FLAG_V23_ENCRYPTION)) return NULL;
+
+    // The bytes added after the frame header, in the order of the flags
+    if (v24) {
+        if (flags & ID3_FRAME_FLAG_V24_GROUPING) pos++;
+        if (flags & ID3_FRAME_FLAG_V24_DATA_LENGTH) {
+            if (pos + ID3_FRAME_DATA_LENGTH > frame->size) return NULL;
+            length = syncint_decode(btoi(stored, ID3_FRAME_DATA_LENGTH, pos));
+            pos += ID3_FRAME_DATA_LENGTH;
+        }
+    } else {
+        if (compressed) {
+            if (pos + ID3_FRAME_DATA_LENGTH > frame->size) return NULL;
+            length = btoi(stored, ID3_FRAME_DATA_LENGTH, pos);
+            pos += ID3_FRAME_DATA_LENGTH;
+        }
+        if (flags & ID3_FRAME_FLAG_V23_GROUPING) pos++;
+    }
+    if (pos > frame->size) return NULL;
+
+    stored += pos;
+    body_size = frame->size - pos;
+
+    if (v24 && (flags & ID3_FRAME_FLAG_V24_UNSYNCHRONISATION)) {
+        // Only kept when it is the frame content
+        body = compressed ? mem_alloc(body_size ? body_size : 1) : alloc_payload(arena, body_size);
+        if (!body) return NULL;
+        body_size = decode_unsynchronisation(body, stored, body_size);
+        stored = body;
+    }
+
+    if (compressed) {
+        decoded = inflate_payload(stored, body_size, length, arena);
+        *size = length;
+        mem_free(body);
+    } else if (body) {
+        decoded = body;
+        *size = body_size;
+    } else {
+        decoded = alloc_payload(arena, body_size);
+        count_copy(body_size);
+        if (decoded) memcpy(decoded, stored, body_size);
+        *size = body_size;
+    }
+
+    return decoded;
+}
+
+// Copy the payload of a frame loaded lazily out of the tag, returns frame->data.
+// Encoded frames are decoded on the way and lose their format flags, their
+// stored payload is kept lazily (or in data) until then.
+char *load_frame_data(ID3v2_frame *frame)
+{
+    return load_frame_data_in_arena(frame, NULL);
+}
+
+// The content of a frame without loading it: its payload, or a decoded copy
+// set in *decoded for the caller to free if it is encoded. Sets *size and
+// returns NULL if there is none or it cannot be decoded.
+const char *peek_frame_data(ID3v2_frame *frame, int *size, char **decoded)
+{
+    const char *stored = frame->data ? frame->data : frame->source;
+
+    *decoded = NULL;
+    *size = frame->size;
+    if (!stored || !is_frame_encoded(frame)) return stored;
+
+    *decoded = decode_frame(frame, stored, size, NULL);
+    return *decoded;
+}
+
+// The same for a frame of a tag loaded in arena, the payload is taken from it
+char *load_frame_data_in_arena(ID3v2_frame *frame, ID3v2_arena *arena)
+{
+    char *decoded;
+    int size;
+
+    if (!is_frame_encoded(frame)) {
+        if (frame->data || !frame->source) return frame->data;
+
+        frame->data = alloc_payload(arena, frame->size);
+        count_copy(frame->size);
+        if (frame->data) memcpy(frame->data, frame->source, frame->size);
+
+        return frame->data;
+    }
+
+    if (!frame->data && !frame->source) return NULL;
+
+    decoded = decode_frame(frame, frame->data ? frame->data : frame->source, &size, arena);
+    if (!decoded) {
+        report_error("Error decoding frame");
+        return NULL;
+    }
+
+    // The stored payload of an encoded frame is only ever in data as a copy
+    // of its own, loaders leave the others in source
+    free_payload(arena, frame->data);
+    frame->data = decoded;
+    frame->size = size;
+    frame->flags[1] = 0;
+
+    return frame->data;
+}
+
+// Fill converted with the ID3v2.3 layout set_tag() writes for a frame read
+// from an ID3v2.4 tag, leaving frame as it is. Compressed frames stay
+// compressed, any other format flag is reversed. Returns the new payload of
+// converted, for the caller to free, or NULL if it shares the one of frame.
+// Encrypted frames, and those that cannot be decoded, keep their layout.
+char *get_v23_frame(ID3v2_frame *frame, ID3v2_frame *converted)
+{
+    int flags = (unsigned char) frame->flags[1];
+    int compressed = ID3_FRAME_FLAG_V24_COMPRESSION | ID3_FRAME_FLAG_V24_DATA_LENGTH;
+    const char *stored = frame->data ? frame->data : frame->source;
+    char *payload;
+    int pos, length, size;
+
+    *converted = *frame;
+    if (frame->version != ID3v24 || (flags & ID3_FRAME_FLAG_V24_ENCRYPTION)) return NULL;
+
+    if ((flags & compressed) == compressed) {
+        // [group] [data length] zlib stream, the stream may be unsynchronised,
+        // becomes [decompressed size] zlib stream
+        pos = (flags & ID3_FRAME_FLAG_V24_GROUPING) ? 1 : 0;
+        if (!stored || pos + ID3_FRAME_DATA_LENGTH > frame->size) return NULL;
+
+        length = syncint_decode(btoi(stored, ID3_FRAME_DATA_LENGTH, pos));
+        pos += ID3_FRAME_DATA_LENGTH;
+        payload = mem_alloc(ID3_FRAME_DATA_LENGTH + frame->size - pos);
+        if (!payload) return NULL;
+
+        payload[0] = (char) (length >> 24);
+        payload[1] = (char) (length >> 16);
+        payload[2] = (char) (length >> 8);
+        payload[3] = (char) length;
+        if (flags & ID3_FRAME_FLAG_V24_UNSYNCHRONISATION) {
+            size = decode_unsynchronisation(payload + ID3_FRAME_DATA_LENGTH, stored + pos, frame->size - pos);
+        } else {
+            size = frame->size - pos;
+            count_copy(size);
+            memcpy(payload + ID3_FRAME_DATA_LENGTH, stored + pos, size);
+        }
+
+        converted->size = ID3_FRAME_DATA_LENGTH + size;
+        converted->flags[1] = ID3_FRAME_FLAG_V23_COMPRESSION;
+    } else if (is_frame_encoded(frame)) {
+        if (!stored) return NULL;
+        payload = decode_frame(frame, stored, &size, NULL);
+        if (!payload) {
+            report_error("Error decoding frame");
+            return NULL;
+        }
+
+        converted->size = size;
+        converted->flags[1] = 0;
+    } else {
+        payload = NULL;
+    }
+
+    if (payload) converted->data = payload;
+
+    // The status flags are one bit further left in ID3v2.3
+    converted->flags[0] = (char) (((unsigned char) frame->flags[0] << 1) & 0xE0);
+    converted->version = ID3v23;
+
+    return payload;
+}
+
+// Give the frame itself the layout of get_v23_frame()
+void convert_frame_to_v23(ID3v2_frame *frame)
+{
+    ID3v2_frame converted;
+
+    // The stored payload of an encoded frame is only ever in data as a copy
+    // of its own, see load_frame_data()
+    if (get_v23_frame(frame, &converted)) mem_free(frame->data);
+    *frame = converted;
+}
+
+// The ID3v2.3 compressed form of size bytes at data: the size in 4 bytes,
+// then the zlib stream. Returns NULL if it could not be compressed.
+char *compress_frame_payload(const char *data, int size, int *compressed_size)
+{
+#ifdef HAVE_ZLIB
+    uLongf length = compressBound((uLong) size);
+    char *dest = mem_alloc(ID3_FRAME_DATA_LENGTH + length);
+
+    if (!dest) return NULL;
+
+    if (compress2((Bytef *) dest + ID3_FRAME_DATA_LENGTH, &length, (const Bytef *) data, (uLong) size,
+                  Z_DEFAULT_COMPRESSION) != Z_OK) {
+        mem_free(dest);
+        return NULL;
+    }
+
+    dest[0] = (char) (size >> 24);
+    dest[1] = (char) (size >> 16);
+    dest[2] = (char) (size >> 8);
+    dest[3] = (char) size;
+    *compressed_size = ID3_FRAME_DATA_LENGTH + (int) length;
+
+    return dest;
+#else
+    return NULL;
+#endif
 }
 
 static inline int bytes_per_char_for_encoding(int encoding) {
@@ -109,10 +432,10 @@ static inline int bytes_per_char_for_encoding(int encoding) {
     }
 }
 
-ID3v2_frame_text_content *parse_text_frame_content(ID3v2_frame *frame)
+static ID3v2_frame_text_content *parse_text_content(ID3v2_frame *frame)
 {
     ID3v2_frame_text_content *content;
-    if (!frame) return NULL;
+    if (!frame || !load_frame_data(frame)) return NULL;
 
     if (frame->size < ID3_FRAME_ENCODING + 1) return NULL;	// Need at least 1 byte for encoding
 
@@ -156,17 +479,18 @@ ID3v2_frame_text_content *parse_text_frame_content(ID3v2_frame *frame)
 
     if (last_char) content->size += bytes_per_char;		// We'll need another terminating NUL char
 
-    content->data = calloc(1, content->size);
+    content->data = mem_calloc(1, content->size);
 
+    count_copy(text_size);
     memcpy(content->data, text, text_size);
 
     return content;
 }
 
-ID3v2_frame_comment_content *parse_comment_frame_content(ID3v2_frame *frame)
+static ID3v2_frame_comment_content *parse_comment_content(ID3v2_frame *frame)
 {
     ID3v2_frame_comment_content *content;
-    if (!frame) return NULL;
+    if (!frame || !load_frame_data(frame)) return NULL;
 
     content = new_comment_content(frame->size);
 
@@ -174,6 +498,7 @@ ID3v2_frame_comment_content *parse_comment_frame_content(ID3v2_frame *frame)
     content->text->size = frame->size - ID3_FRAME_ENCODING - ID3_FRAME_LANGUAGE - ID3_FRAME_SHORT_DESCRIPTION;
     memcpy(content->language, frame->data + ID3_FRAME_ENCODING, ID3_FRAME_LANGUAGE);
     content->short_description = "\0"; // Ignore short description
+    count_copy(content->text->size);
     memcpy(content->text->data, frame->data + ID3_FRAME_ENCODING + ID3_FRAME_LANGUAGE + 1, content->text->size);
 
     return content;
@@ -182,7 +507,7 @@ ID3v2_frame_comment_content *parse_comment_frame_content(ID3v2_frame *frame)
 // This is for ID3v22
 static char *parse_image_format(char *data, int *len)
 {
-    char *mime_type = strdup("image/xxx");
+    char *mime_type = mem_strdup("image/xxx");
     mime_type[6] = tolower(data[0]);
     mime_type[7] = tolower(data[1]);
     mime_type[8] = tolower(data[2]);
@@ -195,15 +520,15 @@ static char *parse_image_format(char *data, int *len)
 // [ID3v23+] Includes terminating NUL char in returned length
 static char *parse_mime_type(char *data, int *len)
 {
-    char *mime_type = strdup(data);
+    char *mime_type = mem_strdup(data);
     *len = (int)strlen(mime_type) + 1;
 
     return mime_type;
 }
 
-ID3v2_frame_apic_content *parse_apic_frame_content(ID3v2_frame *frame)
+static ID3v2_frame_apic_content *parse_apic_content(ID3v2_frame *frame)
 {
-    if (!frame) return NULL;
+    if (!frame || !load_frame_data(frame)) return NULL;
 
     ID3v2_frame_apic_content *content = new_apic_content();
 
@@ -232,12 +557,41 @@ ID3v2_frame_apic_content *parse_apic_frame_content(ID3v2_frame *frame)
     }
 
     content->picture_size = frame->size - pos;
-    content->data = malloc(content->picture_size);
+    content->data = mem_alloc(content->picture_size);
+    count_copy(content->picture_size);
     memcpy(content->data, frame->data + pos, content->picture_size);
 
     return content;
 }
 
+// The content parsers, timed as ID3_PHASE_CONTENT
+ID3v2_frame_text_content *parse_text_frame_content(ID3v2_frame *frame)
+{
+    long long start = start_phase();
+    ID3v2_frame_text_content *content = parse_text_content(frame);
+
+    end_phase(ID3_PHASE_CONTENT, start);
+    return content;
+}
+
+ID3v2_frame_comment_content *parse_comment_frame_content(ID3v2_frame *frame)
+{
+    long long start = start_phase();
+    ID3v2_frame_comment_content *content = parse_comment_content(frame);
+
+    end_phase(ID3_PHASE_CONTENT, start);
+    return content;
+}
+
+ID3v2_frame_apic_content *parse_apic_frame_content(ID3v2_frame *frame)
+{
+    long long start = start_phase();
+    ID3v2_frame_apic_content *content = parse_apic_content(frame);
+
+    end_phase(ID3_PHASE_CONTENT, start);
+    return content;
+}
+
 static int convert_v22_frame_id(char *dest, const char *src, int length) {
     struct translate23_s {
         char *frame2;
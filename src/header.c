@@ -11,7 +11,14 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "alloc.h"
+#include "fileio.h"
 #include "header.h"
+#include "stats.h"
 #include "utils.h"
 
 
@@ -22,27 +29,117 @@ static inline int has_id3v2tag(const char *raw_header)
 
 ID3v2_header *get_tag_header(const char *file_name)
 {
-    char buffer[ID3_HEADER];
+    char buffer[ID3_HEADER + ID3_EXTENDED_HEADER_SIZE];
+    int length;
     FILE *file = fopen(file_name, "rb");
     if (!file) {
-        perror("Error opening file");
+        report_error("Error opening file");
         return NULL;
     }
 
-    fread(buffer, ID3_HEADER, 1, file);
+    length = (int) fread(buffer, 1, sizeof(buffer), file);
     fclose(file);
-    return get_tag_header_with_buffer(buffer, ID3_HEADER);
+    return get_tag_header_with_buffer(buffer, length);
+}
+
+#ifndef _WIN32
+// Fill tag_header from a single pread on an open file, without allocating or
+// going through stdio. Returns 1 if the file starts with a tag, 0 if it does
+// not and -1 if it could not be read (errno is set).
+int probe_tag_header(int fd, ID3v2_header *tag_header)
+{
+    char buffer[ID3_HEADER + ID3_EXTENDED_HEADER_SIZE];
+    ssize_t length;
+
+    count_syscalls(1);
+    length = pread(fd, buffer, sizeof(buffer), 0);
+
+    if (length < 0) return -1;
+
+    return parse_tag_header(buffer, (int) length, tag_header);
+}
+#endif
+
+// A footer is a copy of the header with "3DI" in place of "ID3", it ends an
+// ID3v2.4 tag appended to the file
+static int parse_footer(const char *footer, int *tag_size)
+{
+    if (memcmp(footer, "3DI", ID3_HEADER_TAG) != 0 || footer[3] != 4) return 0;
+    if (!(footer[5] & ID3_HEADER_FLAGS_HAS_FOOTER)) return 0;
+
+    for (int i = 6; i < ID3_FOOTER; i++) {
+        if (footer[i] & 0x80) return 0;	// not a syncsafe integer
+    }
+
+    *tag_size = syncint_decode(btoi(footer, ID3_HEADER_SIZE, 6));
+    return 1;
+}
+
+// Look for a tag appended to a file of size bytes, given its last length
+// bytes. Its footer either ends the file or comes right before an ID3v1 tag.
+// Returns the offset of the tag header in the file, -1 if there is none.
+long long find_appended_tag(const char *tail, int length, long long size)
+{
+    int tag_size;
+    int pos = length - ID3_FOOTER;
+    long long offset;
+
+    if (pos >= 0 && !parse_footer(tail + pos, &tag_size)) {
+        pos = length - ID3V1_TAG_SIZE - ID3_FOOTER;
+        if (pos < 0 || memcmp(tail + length - ID3V1_TAG_SIZE, "TAG", 3) != 0 ||
+            !parse_footer(tail + pos, &tag_size)) {
+            return -1;
+        }
+    }
+    if (pos < 0) return -1;
+
+    offset = size - length + pos - tag_size - ID3_HEADER;
+    return offset >= 0 ? offset : -1;
+}
+
+// The same, reading the end of the file with a single pread. Streams that
+// can only be read forward never have one.
+long long find_appended_tag_with_io(ID3v2_io *io)
+{
+    char tail[ID3V1_TAG_SIZE + ID3_FOOTER];
+    long long start = start_phase();
+    long long size;
+    long long offset = -1;
+    int length;
+
+    if (io->pread && (size = io_size(io)) >= ID3_HEADER + ID3_FOOTER) {
+        length = size < (long long) sizeof(tail) ? (int) size : (int) sizeof(tail);
+        if (io_read_at(io, tail, length, size - length) == length) offset = find_appended_tag(tail, length, size);
+    }
+    end_phase(ID3_PHASE_HEADER, start);
+
+    return offset;
+}
+
+// Bytes the tag takes up in the file: header, frames, padding and footer
+int get_tag_total_size(ID3v2_header *tag_header)
+{
+    return ID3_HEADER + tag_header->tag_size + (tag_header->has_footer ? ID3_FOOTER : 0);
 }
 
 ID3v2_header *get_tag_header_with_buffer(const char *buffer, int length)
 {
-    int position = 0;
-    ID3v2_header *tag_header;
+    ID3v2_header *tag_header = new_header();
+
+    if (!parse_tag_header(buffer, length, tag_header)) {
+        mem_free(tag_header);
+        return NULL;
+    }
+
+    return tag_header;
+}
 
-    if (length < ID3_HEADER) return NULL;
-    if (!has_id3v2tag(buffer)) return NULL;
+static int parse_header(const char *buffer, int length, ID3v2_header *tag_header)
+{
+    int position = 0;
 
-    tag_header = new_header();
+    if (length < ID3_HEADER) return 0;
+    if (!has_id3v2tag(buffer)) return 0;
 
     memcpy(tag_header->tag, buffer, ID3_HEADER_TAG);
     tag_header->orig_major_version = buffer[position += ID3_HEADER_TAG];
@@ -53,20 +150,48 @@ ID3v2_header *get_tag_header_with_buffer(const char *buffer, int length)
     tag_header->minor_version = buffer[position += ID3_HEADER_VERSION];
     tag_header->flags = buffer[position += ID3_HEADER_REVISION];
     tag_header->tag_size = syncint_decode(btoi(buffer, ID3_HEADER_SIZE, position += ID3_HEADER_FLAGS));
+    tag_header->unsynchronised = (tag_header->flags & ID3_HEADER_FLAGS_HAS_UNSYNCHRONISATION) ? 1 : 0;
+    tag_header->has_footer = (tag_header->orig_major_version == 4 && (tag_header->flags & ID3_HEADER_FLAGS_HAS_FOOTER)) ? 1 : 0;
 
-    if (tag_header->flags & ID3_HEADER_FLAGS_HAS_UNSYNCHRONISATION) {
-        tag_header->unsynchronised = 1;
-    }
-
-    if (tag_header->flags & ID3_HEADER_FLAGS_HAS_EXTENDED_HEADER) {
+    if ((tag_header->flags & ID3_HEADER_FLAGS_HAS_EXTENDED_HEADER) &&
+        length >= ID3_HEADER + ID3_EXTENDED_HEADER_SIZE) {
         // an extended header exists, so we retrieve the actual size of it and save it into the struct
-        tag_header->extended_header_size = syncint_decode(btoi(buffer, ID3_EXTENDED_HEADER_SIZE, position += ID3_HEADER_SIZE));
+        tag_header->extended_header_size = parse_extended_header_size(buffer + (position += ID3_HEADER_SIZE),
+                                                                      tag_header->orig_major_version);
     } else {
         // no extended header existing
         tag_header->extended_header_size = 0;
     }
 
-    return tag_header;
+    // An extended header that runs past the tag is not a tag we can parse
+    if (tag_header->extended_header_size &&
+        tag_header->extended_header_size > tag_header->tag_size - ID3_EXTENDED_HEADER_SIZE) {
+        return 0;
+    }
+
+    return 1;
+}
+
+// Fill a caller provided header, returns 0 if buffer does not start with a
+// tag or its extended header does not fit in it
+int parse_tag_header(const char *buffer, int length, ID3v2_header *tag_header)
+{
+    long long start = start_phase();
+    int found = parse_header(buffer, length, tag_header);
+
+    end_phase(ID3_PHASE_HEADER, start);
+    return found;
+}
+
+// Bytes of the extended header that follow its four size bytes. ID3v2.4
+// counts the size bytes in and makes the size syncsafe, ID3v2.3 does neither.
+int parse_extended_header_size(const char *bytes, int orig_major_version)
+{
+    int size = btoi(bytes, ID3_EXTENDED_HEADER_SIZE, 0);
+
+    if (orig_major_version == 4) size = syncint_decode(size) - ID3_EXTENDED_HEADER_SIZE;
+
+    return size > 0 ? size : 0;
 }
 
 int get_tag_version(ID3v2_header *tag_header)
@@ -81,6 +206,14 @@ int get_tag_version(ID3v2_header *tag_header)
     }
 }
 
+// 1 if the frames have to be decoded as a whole before they can be parsed.
+// ID3v2.4 unsynchronises every frame on its own (flagged in its header) and
+// counts the unsynchronised bytes in the frame sizes, so it never is.
+int needs_tag_decoding(ID3v2_header *tag_header)
+{
+    return tag_header->unsynchronised && get_tag_orig_version(tag_header) != ID3v24;
+}
+
 int get_tag_orig_version(ID3v2_header *tag_header)
 {
     switch (tag_header->orig_major_version) {
@@ -0,0 +1,179 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "fileio.h"
+#include "id3v1.h"
+#include "utils.h"
+
+// Where the fields are in the 128 bytes
+#define ID3V1_TITLE 3
+#define ID3V1_ARTIST 33
+#define ID3V1_ALBUM 63
+#define ID3V1_YEAR 93
+#define ID3V1_COMMENT 97
+#define ID3V1_TRACK 126		// ID3v1.1, when the byte before it is 0
+#define ID3V1_GENRE 127
+#define ID3V1_FIELD 30
+#define ID3V1_YEAR_SIZE 4
+
+// The ID3v1 genres and the Winamp extensions to them
+static const char *genres[] = {
+    "Blues", "Classic Rock", "Country", "Dance", "Disco", "Funk", "Grunge", "Hip-Hop",
+    "Jazz", "Metal", "New Age", "Oldies", "Other", "Pop", "R&B", "Rap",
+    "Reggae", "Rock", "Techno", "Industrial", "Alternative", "Ska", "Death Metal", "Pranks",
+    "Soundtrack", "Euro-Techno", "Ambient", "Trip-Hop", "Vocal", "Jazz+Funk", "Fusion", "Trance",
+    "Classical", "Instrumental", "Acid", "House", "Game", "Sound Clip", "Gospel", "Noise",
+    "AlternRock", "Bass", "Soul", "Punk", "Space", "Meditative", "Instrumental Pop", "Instrumental Rock",
+    "Ethnic", "Gothic", "Darkwave", "Techno-Industrial", "Electronic", "Pop-Folk", "Eurodance", "Dream",
+    "Southern Rock", "Comedy", "Cult", "Gangsta", "Top 40", "Christian Rap", "Pop/Funk", "Jungle",
+    "Native American", "Cabaret", "New Wave", "Psychadelic", "Rave", "Showtunes", "Trailer", "Lo-Fi",
+    "Tribal", "Acid Punk", "Acid Jazz", "Polka", "Retro", "Musical", "Rock & Roll", "Hard Rock",
+    "Folk", "Folk-Rock", "National Folk", "Swing", "Fast Fusion", "Bebob", "Latin", "Revival",
+    "Celtic", "Bluegrass", "Avantgarde", "Gothic Rock", "Progressive Rock", "Psychedelic Rock", "Symphonic Rock", "Slow Rock",
+    "Big Band", "Chorus", "Easy Listening", "Acoustic", "Humour", "Speech", "Chanson", "Opera",
+    "Chamber Music", "Sonata", "Symphony", "Booty Bass", "Primus", "Porn Groove", "Satire", "Slow Jam",
+    "Club", "Tango", "Samba", "Folklore", "Ballad", "Power Ballad", "Rhythmic Soul", "Freestyle",
+    "Duet", "Punk Rock", "Drum Solo", "A capella", "Euro-House", "Dance Hall", "Goa", "Drum & Bass",
+    "Club-House", "Hardcore", "Terror", "Indie", "BritPop", "Afro-Punk", "Polsk Punk", "Beat",
+    "Christian Gangsta Rap", "Heavy Metal", "Black Metal", "Crossover", "Contemporary Christian", "Christian Rock", "Merengue", "Salsa",
+    "Thrash Metal", "Anime", "JPop", "Synthpop"
+};
+
+// Copy a fixed size field up to its first zero byte, without the spaces padding it out
+static void copy_field(char *dest, const char *src, int size)
+{
+    const char *end = memchr(src, '\0', size);
+    int length = end ? (int) (end - src) : size;
+
+    while (length > 0 && src[length - 1] == ' ') length--;
+    memcpy(dest, src, length);
+    dest[length] = '\0';
+}
+
+// Fill tag from the last ID3V1_TAG_SIZE bytes of a file. Returns 1, or 0 if
+// they are not an ID3v1 tag.
+int parse_id3v1_tag(const char *bytes, ID3v1_tag *tag)
+{
+    if (memcmp(bytes, "TAG", 3) != 0) return 0;
+
+    copy_field(tag->title, bytes + ID3V1_TITLE, ID3V1_FIELD);
+    copy_field(tag->artist, bytes + ID3V1_ARTIST, ID3V1_FIELD);
+    copy_field(tag->album, bytes + ID3V1_ALBUM, ID3V1_FIELD);
+    copy_field(tag->year, bytes + ID3V1_YEAR, ID3V1_YEAR_SIZE);
+
+    // ID3v1.1 takes the last two bytes of the comment for a zero and the track number
+    if (bytes[ID3V1_TRACK - 1] == '\0' && bytes[ID3V1_TRACK] != '\0') {
+        copy_field(tag->comment, bytes + ID3V1_COMMENT, ID3V1_FIELD - 2);
+        tag->track = (unsigned char) bytes[ID3V1_TRACK];
+    } else {
+        copy_field(tag->comment, bytes + ID3V1_COMMENT, ID3V1_FIELD);
+        tag->track = 0;
+    }
+    tag->genre = (unsigned char) bytes[ID3V1_GENRE];
+
+    return 1;
+}
+
+// Read the ID3v1 tag with a single read of the last ID3V1_TAG_SIZE bytes.
+// Returns 1 if there is one, 0 if there is none and -1 on error.
+int read_id3v1_tag_with_io(ID3v2_io *io, ID3v1_tag *tag)
+{
+    char bytes[ID3V1_TAG_SIZE];
+    long long size = io_size(io);
+
+    if (size < 0) return -1;
+    if (size < ID3V1_TAG_SIZE) return 0;
+    if (io_read_at(io, bytes, ID3V1_TAG_SIZE, size - ID3V1_TAG_SIZE) != ID3V1_TAG_SIZE) return -1;
+
+    return parse_id3v1_tag(bytes, tag);
+}
+
+int read_id3v1_tag(const char *file_name, ID3v1_tag *tag)
+{
+    ID3v2_io io;
+    int result;
+
+    if (io_open_file(&io, file_name, 0) != 0) {
+        report_error("Error opening file");
+        return -1;
+    }
+
+    result = read_id3v1_tag_with_io(&io, tag);
+    io_close_file(&io);
+
+    return result;
+}
+
+// Name of an ID3v1 genre, NULL if it is not a known one
+const char *get_id3v1_genre_name(int genre)
+{
+    if (genre < 0 || genre >= (int) (sizeof(genres) / sizeof(genres[0]))) return NULL;
+
+    return genres[genre];
+}
+
+// A frame holding prefix_size bytes of prefix followed by text, which is Latin-1
+static void add_frame(ID3v2_frame_list *list, char *frame_id, const char *prefix, int prefix_size, const char *text)
+{
+    int length = (int) strlen(text);
+    ID3v2_frame *frame;
+
+    if (!length) return;
+
+    frame = new_frame();
+    if (!frame) return;
+    frame->data = mem_alloc(prefix_size + length);
+    if (!frame->data) {
+        mem_free(frame);
+        return;
+    }
+
+    memcpy(frame->frame_id, frame_id, ID3_FRAME_ID);
+    frame->version = ID3v23;
+    frame->size = prefix_size + length;
+    memcpy(frame->data, prefix, prefix_size);
+    memcpy(frame->data + prefix_size, text, length);
+
+    add_to_list(list, frame);
+}
+
+// The fields of tag as ID3v2 frames laid out as tag_set_text_frame() does
+// with Latin-1, empty fields are left out
+ID3v2_frame_list *get_id3v1_frames(ID3v1_tag *tag)
+{
+    ID3v2_frame_list *list = new_frame_list();
+    const char *genre = get_id3v1_genre_name(tag->genre);
+    char number[8];
+
+    if (!list) return NULL;
+
+    add_frame(list, TITLE_FRAME_ID, "\0", 1, tag->title);
+    add_frame(list, ARTIST_FRAME_ID, "\0", 1, tag->artist);
+    add_frame(list, ALBUM_FRAME_ID, "\0", 1, tag->album);
+    add_frame(list, YEAR_FRAME_ID, "\0", 1, tag->year);
+    add_frame(list, COMMENT_FRAME_ID, "\0eng\0", 5, tag->comment);
+    if (tag->track) {
+        snprintf(number, sizeof(number), "%d", tag->track);
+        add_frame(list, TRACK_FRAME_ID, "\0", 1, number);
+    }
+    if (genre) {
+        add_frame(list, GENRE_FRAME_ID, "\0", 1, genre);
+    } else if (tag->genre != 255) {
+        // ID3v2.3 refers to ID3v1 genres the same way
+        snprintf(number, sizeof(number), "(%d)", tag->genre);
+        add_frame(list, GENRE_FRAME_ID, "\0", 1, number);
+    }
+
+    return list;
+}
@@ -7,96 +7,252 @@
  * file that was distributed with this source code.
  */
 
+#define _XOPEN_SOURCE 700	// for realpath()
+
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "id3v2lib.h"
 
 
-ID3v2_tag *load_tag(const char *file_name)
+// Reverse the unsynchronisation of a whole tag (header included) into dest,
+// which may be src. The bytes freed up at the end become padding.
+static void decode_tag(char *dest, const char *src, ID3v2_header *tag_header)
 {
-    char *buffer;
-    FILE *file;
-    int header_size;
-    ID3v2_tag *tag;
+    int size = tag_header->tag_size + ID3_HEADER;
+    int decoded = decode_unsynchronisation(dest, src, size);
 
-    // get header size
-    ID3v2_header *tag_header = get_tag_header(file_name);
-    if (!tag_header) return NULL;
+    count_copy(decoded);
+    memset(dest + decoded, 0, size - decoded);
+}
 
-    header_size = tag_header->tag_size + ID3_HEADER;
-    free(tag_header);
+// Number of bytes between the end of the tag header and the first frame
+static int get_extended_header_skip(ID3v2_header *tag_header)
+{
+    if (!tag_header->extended_header_size) return 0;
 
-    // allocate buffer and fetch header
-    file = fopen(file_name, "rb");
-    if (!file) {
-        perror("Error opening file");
-        return NULL;
-    }
+    // don't forget to skip the extended header size bytes too
+    return tag_header->extended_header_size + ID3_EXTENDED_HEADER_SIZE;
+}
 
-    buffer = malloc(header_size + ID3_HEADER);
-    if (!buffer) {
-        perror("Could not allocate buffer");
-        fclose(file);
-        return NULL;
-    }
+// Bytes of frames and padding after the extended header, parse_tag_header()
+// has made sure the extended header fits in the tag
+static int get_frames_size(ID3v2_header *tag_header)
+{
+    return tag_header->tag_size - get_extended_header_skip(tag_header);
+}
 
-    //fseek(file, 10, SEEK_SET);
-    fread(buffer, header_size + ID3_HEADER, 1, file);
-    fclose(file);
+// Frame IDs a selective load is looking for
+typedef struct
+{
+    char **frame_ids;
+    int count;
+    char *found;	// one flag per requested ID
+    int missing;	// requested IDs not found yet, -1 if the whole tag has to be walked
+} frame_filter;
+
+// Only one text frame (other than TXXX) with a given ID may be in a tag, so
+// once it is found there is no need to look for it any further
+static int is_unique_frame_id(const char *frame_id)
+{
+    return frame_id[0] == 'T' && memcmp(frame_id, "TXXX", ID3_FRAME_ID) != 0;
+}
 
-    //parse free and return
-    tag = load_tag_with_buffer(buffer, header_size);
-    free(buffer);
+static int init_frame_filter(frame_filter *filter, char **frame_ids, int count)
+{
+    filter->frame_ids = frame_ids;
+    filter->count = count;
+    filter->missing = count;
+    filter->found = mem_calloc(count ? count : 1, 1);
+    if (!filter->found) return 0;
+
+    for (int i = 0; i < count; i++) {
+        if (!is_unique_frame_id(frame_ids[i])) filter->missing = -1;
+    }
 
-    return tag;
+    return 1;
 }
 
-static void reverse_unsynchronisation(char *dest, const char *src, int length)
+static int frame_filter_wants(frame_filter *filter, ID3v2_frame *frame)
 {
-    while (length--) {
-        if ((*dest++ = *src++) == (char)0xFF) {
-            if (!length) return;
-            if (*src == 0x00) {
-                src++;
-                length--;
+    if (!filter) return 1;
+
+    for (int i = 0; i < filter->count; i++) {
+        if (memcmp(filter->frame_ids[i], frame->frame_id, ID3_FRAME_ID) == 0) {
+            if (!filter->found[i]) {
+                filter->found[i] = 1;
+                if (filter->missing > 0) filter->missing--;
             }
+            return 1;
         }
     }
+
+    return 0;
 }
 
-ID3v2_tag *load_tag_with_buffer(const char *orig_buffer, int length)
+static inline int frame_filter_done(frame_filter *filter)
 {
-    // Declaration
+    return filter && filter->missing == 0;
+}
+
+// How parse_frames() fills in the frame data
+#define PARSE_COPY 0		// data is a copy of the payload
+#define PARSE_IN_PLACE 1	// data points into tag->raw, encoded frames are left lazy
+#define PARSE_LAZY 2		// only source is set, see load_frame_data()
+
+// Walk the frames stored in the size bytes at bytes (usually tag->raw),
+// keeping only the ones the filter wants if there is one
+static void parse_frames(ID3v2_tag *tag, char *bytes, int size, int mode, frame_filter *filter)
+{
+    ID3v2_frame header;
     ID3v2_frame *frame;
     int offset = 0;
+    int version = get_tag_orig_version(tag->tag_header);
+    int frameHeaderSize = (version == ID3v22) ? ID3_FRAME_v22 : ID3_FRAME;
+    long long start = start_phase();
+
+    while (offset + frameHeaderSize <= size && !frame_filter_done(filter)) {
+
+        if (!parse_frame_header(bytes, offset, version, &header)) break;
+
+        if (header.size < 0 || header.size > size - offset - frameHeaderSize) {
+            // truncated or corrupt frame
+            break;
+        }
+
+        if (!frame_filter_wants(filter, &header)) {
+            offset += header.size + frameHeaderSize;
+            continue;
+        }
+
+        if (tag->arena) {
+            frame = arena_alloc(tag->arena, sizeof(ID3v2_frame));
+        } else {
+            frame = new_frame();
+        }
+        *frame = header;
+
+        if (mode == PARSE_COPY) {
+            frame->data = mem_alloc(frame->size);
+            if (!frame->data) {
+                if (!tag->arena) mem_free(frame);
+                break;
+            }
+            count_copy(frame->size);
+            memcpy(frame->data, header.data, frame->size);
+        } else if (mode == PARSE_LAZY || is_frame_encoded(frame)) {
+            // Encoded frames are only decoded when their content is asked for,
+            // into memory of their own
+            frame->source = header.data;
+            frame->data = NULL;
+        }
+
+        add_to_list(tag->frames, frame);
+
+        offset += frame->size + frameHeaderSize;
+    }
+
+    end_phase(ID3_PHASE_FRAMES, start);
+}
+
+// Read size bytes at offset in the tag (base in the file) into dest. The head
+// bytes already read from the start of the tag are copied rather than read
+// again, so streams that can only be read forward work too. Returns 0 or -1
+// if the file is too short.
+static int read_tag_bytes(ID3v2_io *io, const char *head, int head_size, char *dest, int size, int offset,
+                          long long base)
+{
+    int copied = 0;
+
+    if (offset < head_size) {
+        copied = head_size - offset < size ? head_size - offset : size;
+        count_copy(copied);
+        memcpy(dest, head + offset, copied);
+    }
+    if (copied == size) return 0;
+
+    return io_read_at(io, dest + copied, size - copied, base + offset + copied) == size - copied ? 0 : -1;
+}
+
+// Reads the header and returns its size, 0 if there is no supported tag. The
+// tag at the start of the file is looked for first, then one appended to the
+// end, *base is set to the offset of the one found.
+static int read_tag_header(ID3v2_io *io, char *head, int head_size, ID3v2_header *tag_header, long long *base)
+{
+    int length = io_read_at(io, head, head_size, 0);
+
+    *base = 0;
+    if (length < 0) return 0;
+    if (!parse_tag_header(head, length, tag_header)) {
+        *base = find_appended_tag_with_io(io);
+        if (*base < 0) return 0;
+        length = io_read_at(io, head, head_size, *base);
+        if (length < 0 || !parse_tag_header(head, length, tag_header) || !tag_header->has_footer) return 0;
+    }
+    if (get_tag_orig_version(tag_header) == NO_COMPATIBLE_TAG) return 0;
+
+    return length;
+}
+
+// Skip buffer ahead to a tag appended to it when it does not start with one
+static void find_tag_in_buffer(const char **buffer, int *length)
+{
+    long long offset;
+
+    if (*length >= ID3_HEADER && memcmp(*buffer, "ID3", ID3_HEADER_TAG) == 0) return;
+
+    offset = find_appended_tag(*buffer, *length, *length);
+    if (offset > 0) {
+        *buffer += offset;
+        *length -= (int) offset;
+    }
+}
+
+static ID3v2_tag *load_buffer(const char *orig_buffer, int length, int mode)
+{
+    // Declaration
     ID3v2_tag *tag;
     ID3v2_header *tag_header;
     char *buffer_copy = NULL;
     const char *bytes;
+    int frames_size;
 
     // Initialization
+    find_tag_in_buffer(&orig_buffer, &length);
     tag_header = get_tag_header_with_buffer(orig_buffer, length);
 
     if (!tag_header) return NULL;	// no valid header found
 
     if (get_tag_orig_version(tag_header) == NO_COMPATIBLE_TAG) {
         // no supported id3 tag found
-        free(tag_header);
+        mem_free(tag_header);
         return NULL;
     }
 
     if (length < tag_header->tag_size + ID3_HEADER) {
-        // Not enough bytes provided to parse completely. TODO: how to communicate to the user the lack of bytes?
-        free(tag_header);
+        // Not enough bytes provided to parse completely, see new_parser()
+        // to parse a tag while its bytes are still arriving
+        mem_free(tag_header);
         return NULL;
     }
 
-    if (tag_header->unsynchronised) {
-        buffer_copy = malloc(length);
-        if (!buffer_copy) return NULL;
-        reverse_unsynchronisation(buffer_copy, orig_buffer, length);
+    if (needs_tag_decoding(tag_header)) {
+        buffer_copy = mem_alloc(tag_header->tag_size + ID3_HEADER);
+        if (!buffer_copy) {
+            mem_free(tag_header);
+            return NULL;
+        }
+        decode_tag(buffer_copy, orig_buffer, tag_header);
         bytes = buffer_copy;
     } else {
         bytes = orig_buffer;
@@ -105,438 +261,1357 @@ ID3v2_tag *load_tag_with_buffer(const char *orig_buffer, int length)
     tag = new_tag();
 
     // Associations
-    if (tag->tag_header) free(tag->tag_header);	// free() the tag_header created in new_tag()
+    if (tag->tag_header) mem_free(tag->tag_header);	// free() the tag_header created in new_tag()
     tag->tag_header = tag_header;
 
     // move the bytes pointer to the correct position
     bytes += ID3_HEADER; // skip header
-    if (tag_header->extended_header_size) {
-        // an extended header exists, so we skip it too
-        bytes += tag_header->extended_header_size + ID3_EXTENDED_HEADER_SIZE; // don't forget to skip the extended header size bytes too
+    bytes += get_extended_header_skip(tag_header);
+    frames_size = get_frames_size(tag_header);
+
+    tag->raw = mem_alloc(frames_size);
+    if (!tag->raw && frames_size > 0) {
+        report_error("Could not allocate buffer");
+        if (buffer_copy) mem_free(buffer_copy);
+        free_tag(tag);
+        return NULL;
     }
+    count_copy(frames_size);
+    memcpy(tag->raw, bytes, frames_size);
+    // we use frames_size here to prevent copying too much if the user provides more bytes than needed to this function
 
-    tag->raw = malloc(tag->tag_header->tag_size);
-    memcpy(tag->raw, bytes, tag_header->tag_size);
-    // we use tag_size here to prevent copying too much if the user provides more bytes than needed to this function
+    parse_frames(tag, tag->raw, frames_size, mode, NULL);
 
-    int version = get_tag_orig_version(tag_header);
-    int frameHeaderSize = (version == ID3v22) ? ID3_FRAME_v22 : ID3_FRAME;
+    if (buffer_copy) mem_free(buffer_copy);
 
-    while (offset < tag_header->tag_size) {
+    return tag;
+}
 
-        frame = parse_frame(tag->raw, offset, version);
-        if (frame == NULL) break;
+ID3v2_tag *load_tag_with_buffer(const char *buffer, int length)
+{
+    return load_buffer(buffer, length, PARSE_COPY);
+}
 
-        add_to_list(tag->frames, frame);
+// Only the frame headers are parsed, the payload of a frame is copied out of
+// the tag the first time a getter or parse_*_frame_content() asks for it
+ID3v2_tag *load_tag_with_buffer_lazy(const char *buffer, int length)
+{
+    return load_buffer(buffer, length, PARSE_LAZY);
+}
 
-        offset += frame->size + frameHeaderSize;
+// The frames are read straight into tag->raw, only the unsynchronised ones
+// go through a buffer holding the whole tag to be decoded
+static ID3v2_tag *load_io(ID3v2_io *io, int mode)
+{
+    char head[ID3_HEADER + ID3_EXTENDED_HEADER_SIZE];
+    ID3v2_header tag_header;
+    ID3v2_tag *tag;
+    char *bytes;
+    long long base;
+    int head_size, skip, frames_size;
+
+    head_size = read_tag_header(io, head, sizeof(head), &tag_header, &base);
+    if (!head_size) return NULL;
+
+    skip = get_extended_header_skip(&tag_header);
+    frames_size = get_frames_size(&tag_header);
+
+    if (needs_tag_decoding(&tag_header)) {
+        bytes = mem_alloc(tag_header.tag_size + ID3_HEADER);
+        if (!bytes) return NULL;
+        if (read_tag_bytes(io, head, head_size, bytes, tag_header.tag_size + ID3_HEADER, 0, base) != 0) {
+            mem_free(bytes);
+            return NULL;
+        }
+        decode_tag(bytes, bytes, &tag_header);
+        count_copy(frames_size);
+        memmove(bytes, bytes + ID3_HEADER + skip, frames_size);
+    } else {
+        bytes = mem_alloc(frames_size);
+        if (!bytes && frames_size) return NULL;
+        if (read_tag_bytes(io, head, head_size, bytes, frames_size, ID3_HEADER + skip, base) != 0) {
+            mem_free(bytes);
+            return NULL;
+        }
     }
 
-    if (buffer_copy) free(buffer_copy);
+    tag = new_tag();
+    *tag->tag_header = tag_header;
+    tag->raw = bytes;
+    parse_frames(tag, tag->raw, frames_size, mode, NULL);
 
     return tag;
 }
 
-void remove_tag(const char *file_name)
+ID3v2_tag *load_tag_with_io(ID3v2_io *io)
 {
-    int c;
-    FILE *file;
-    FILE *temp_file;
+    return load_io(io, PARSE_COPY);
+}
+
+ID3v2_tag *load_tag_lazy_with_io(ID3v2_io *io)
+{
+    return load_io(io, PARSE_LAZY);
+}
+
+ID3v2_tag *load_tag(const char *file_name)
+{
+    ID3v2_io io;
+    ID3v2_tag *tag;
+
+    if (io_open_file(&io, file_name, 0) != 0) {
+        report_error("Error opening file");
+        return NULL;
+    }
+
+    tag = load_tag_with_io(&io);
+    io_close_file(&io);
+
+    return tag;
+}
+
+// Load only the frames whose ID is in frame_ids. Their payload is copied, the
+// others are skipped, and the walk stops early once every requested text
+// frame has been found (text frames other than TXXX appear at most once).
+ID3v2_tag *load_tag_frames_with_buffer(const char *orig_buffer, int length, char **frame_ids, int count)
+{
+    ID3v2_header tag_header;
+    ID3v2_tag *tag;
+    frame_filter filter;
+    char *buffer_copy = NULL;
+    const char *bytes;
+
+    find_tag_in_buffer(&orig_buffer, &length);
+    bytes = orig_buffer;
+    if (!parse_tag_header(orig_buffer, length, &tag_header)) return NULL;
+    if (get_tag_orig_version(&tag_header) == NO_COMPATIBLE_TAG) return NULL;
+    if (length < tag_header.tag_size + ID3_HEADER) return NULL;
+
+    if (needs_tag_decoding(&tag_header)) {
+        buffer_copy = mem_alloc(tag_header.tag_size + ID3_HEADER);
+        if (!buffer_copy) return NULL;
+        decode_tag(buffer_copy, orig_buffer, &tag_header);
+        bytes = buffer_copy;
+    }
+
+    if (!init_frame_filter(&filter, frame_ids, count)) {
+        mem_free(buffer_copy);
+        return NULL;
+    }
+
+    tag = new_tag();
+    *tag->tag_header = tag_header;
+
+    // The frames are parsed straight from the buffer, there is no tag->raw copy
+    parse_frames(tag, (char *) bytes + ID3_HEADER + get_extended_header_skip(&tag_header),
+                 get_frames_size(&tag_header), PARSE_COPY, &filter);
+
+    mem_free(filter.found);
+    mem_free(buffer_copy);
+
+    return tag;
+}
+
+ID3v2_tag *load_tag_frames_with_io(ID3v2_io *io, char **frame_ids, int count)
+{
+    char head[ID3_HEADER + ID3_EXTENDED_HEADER_SIZE];
+    ID3v2_header tag_header;
+    ID3v2_frame header;
+    ID3v2_frame *frame;
+    ID3v2_tag *tag;
+    frame_filter filter;
+    long long base, start;
+    int head_size, offset, end, version, frameHeaderSize;
+
+    head_size = read_tag_header(io, head, sizeof(head), &tag_header, &base);
+    if (!head_size) return NULL;
+
+    end = tag_header.tag_size + ID3_HEADER;
+
+    if (needs_tag_decoding(&tag_header)) {
+        // Frame boundaries are only known once the whole tag is decoded
+        char *tag_buffer = mem_alloc(end);
+        if (!tag_buffer) return NULL;
+        if (read_tag_bytes(io, head, head_size, tag_buffer, end, 0, base) != 0) {
+            mem_free(tag_buffer);
+            return NULL;
+        }
+        tag = load_tag_frames_with_buffer(tag_buffer, end, frame_ids, count);
+        mem_free(tag_buffer);
+        return tag;
+    }
+
+    if (!init_frame_filter(&filter, frame_ids, count)) return NULL;
+
+    tag = new_tag();
+    *tag->tag_header = tag_header;
+
+    version = get_tag_orig_version(&tag_header);
+    frameHeaderSize = (version == ID3v22) ? ID3_FRAME_v22 : ID3_FRAME;
+    offset = ID3_HEADER + get_extended_header_skip(&tag_header);
+
+    // Read frame headers one by one and skip over the payloads we don't want
+    start = start_phase();
+    while (offset + frameHeaderSize <= end && !frame_filter_done(&filter)) {
+        char frame_header[ID3_FRAME];
+
+        if (read_tag_bytes(io, head, head_size, frame_header, frameHeaderSize, offset, base) != 0) break;
+        if (!parse_frame_header(frame_header, 0, version, &header)) break;
+        if (header.size < 0 || header.size > end - offset - frameHeaderSize) break;
+
+        if (frame_filter_wants(&filter, &header)) {
+            frame = new_frame();
+            *frame = header;
+            frame->data = mem_alloc(frame->size);
+            if (!frame->data ||
+                read_tag_bytes(io, head, head_size, frame->data, frame->size, offset + frameHeaderSize, base) != 0) {
+                mem_free(frame->data);
+                mem_free(frame);
+                break;
+            }
+            add_to_list(tag->frames, frame);
+        }
+
+        offset += frameHeaderSize + header.size;
+    }
+    end_phase(ID3_PHASE_FRAMES, start);
+
+    mem_free(filter.found);
+
+    return tag;
+}
+
+ID3v2_tag *load_tag_frames(const char *file_name, char **frame_ids, int count)
+{
+    ID3v2_io io;
+    ID3v2_tag *tag;
+
+    if (io_open_file(&io, file_name, 0) != 0) {
+        report_error("Error opening file");
+        return NULL;
+    }
+
+    tag = load_tag_frames_with_io(&io, frame_ids, count);
+    io_close_file(&io);
+
+    return tag;
+}
+
+// buffer belongs to the arena and is decoded in place, frames point into it
+static ID3v2_tag *load_arena_buffer(char *buffer, int length, ID3v2_arena *arena)
+{
+    ID3v2_header tag_header;
+    ID3v2_tag *tag;
+
+    if (!parse_tag_header(buffer, length, &tag_header)) return NULL;
+    if (get_tag_orig_version(&tag_header) == NO_COMPATIBLE_TAG) return NULL;
+    if (length < tag_header.tag_size + ID3_HEADER) return NULL;
+
+    if (needs_tag_decoding(&tag_header)) {
+        // Decoding never makes the data longer, so it can be done in place
+        decode_tag(buffer, buffer, &tag_header);
+    }
+
+    tag = arena_alloc(arena, sizeof(ID3v2_tag));
+    if (!tag) return NULL;
+    memset(tag, 0, sizeof(ID3v2_tag));
+    tag->arena = arena;
+
+    tag->tag_header = arena_alloc(arena, sizeof(ID3v2_header));
+    if (!tag->tag_header) return NULL;
+    *tag->tag_header = tag_header;
+
+    tag->frames = arena_alloc(arena, sizeof(ID3v2_frame_list));
+    if (!tag->frames) return NULL;
+    memset(tag->frames, 0, sizeof(ID3v2_frame_list));
+    tag->frames->arena = arena;
+
+    tag->raw = buffer + ID3_HEADER + get_extended_header_skip(&tag_header);
+    parse_frames(tag, tag->raw, get_frames_size(&tag_header), PARSE_IN_PLACE, NULL);
+
+    return tag;
+}
+
+ID3v2_tag *load_tag_with_buffer_in_arena(const char *buffer, int length, ID3v2_arena *arena)
+{
+    ID3v2_header tag_header;
+    char *copy;
+
+    find_tag_in_buffer(&buffer, &length);
+    if (!parse_tag_header(buffer, length, &tag_header)) return NULL;
+    if (length < tag_header.tag_size + ID3_HEADER) return NULL;
+
+    if (arena_owns(arena, buffer)) {
+        // Already in the arena (e.g. read straight into it), use it in place
+        return load_arena_buffer((char *) buffer, length, arena);
+    }
+
+    copy = arena_alloc(arena, tag_header.tag_size + ID3_HEADER);
+    if (!copy) return NULL;
+    count_copy(tag_header.tag_size + ID3_HEADER);
+    memcpy(copy, buffer, tag_header.tag_size + ID3_HEADER);
+
+    return load_arena_buffer(copy, tag_header.tag_size + ID3_HEADER, arena);
+}
+
+ID3v2_tag *load_tag_in_arena_with_io(ID3v2_io *io, ID3v2_arena *arena)
+{
+    char head[ID3_HEADER + ID3_EXTENDED_HEADER_SIZE];
+    ID3v2_header tag_header;
+    char *buffer;
+    long long base;
+    int head_size, size;
+
+    head_size = read_tag_header(io, head, sizeof(head), &tag_header, &base);
+    if (!head_size) return NULL;
+
+    size = tag_header.tag_size + ID3_HEADER;
+    buffer = arena_alloc(arena, size);
+    if (!buffer) {
+        report_error("Could not allocate buffer");
+        return NULL;
+    }
+
+    if (read_tag_bytes(io, head, head_size, buffer, size, 0, base) != 0) return NULL;
+
+    return load_arena_buffer(buffer, size, arena);
+}
+
+ID3v2_tag *load_tag_in_arena(const char *file_name, ID3v2_arena *arena)
+{
+    ID3v2_io io;
+    ID3v2_tag *tag;
+
+    if (io_open_file(&io, file_name, 0) != 0) {
+        report_error("Error opening file");
+        return NULL;
+    }
+
+    tag = load_tag_in_arena_with_io(&io, arena);
+    io_close_file(&io);
+
+    return tag;
+}
+
+// Load the ID3v2 tag, at the start of the file or appended to it, and the
+// ID3v1 tag at the end. The getters return the ID3v2 frames first and fall
+// back to the ID3v1 fields, so the title, artist and album come from
+// whichever tag has them. Returns NULL if there is neither.
+ID3v2_tag *load_any_tag_with_io(ID3v2_io *io)
+{
+    ID3v2_tag *tag = load_io(io, PARSE_COPY);
+    ID3v1_tag id3v1;
+
+    if (read_id3v1_tag_with_io(io, &id3v1) == 1) {
+        if (!tag) tag = new_tag();
+        tag->fallback = get_id3v1_frames(&id3v1);
+    }
+
+    return tag;
+}
+
+ID3v2_tag *load_any_tag(const char *file_name)
+{
+    ID3v2_io io;
+    ID3v2_tag *tag;
+
+    if (io_open_file(&io, file_name, 0) != 0) {
+        report_error("Error opening file");
+        return NULL;
+    }
+
+    tag = load_any_tag_with_io(&io);
+    io_close_file(&io);
+
+    return tag;
+}
+
+#ifndef _WIN32
+// fd stays open, the mapping does not need it
+static ID3v2_tag *map_tag(int fd, int mode)
+{
+    char buffer[ID3_HEADER + ID3_EXTENDED_HEADER_SIZE];
     ID3v2_header *tag_header;
+    ID3v2_tag *tag;
+    ID3v2_io io;
+    struct stat st;
+    char *mapping;
+    int mapping_size;
+    int frames_size;
+    long long base;
+    int skew;
+
+    io_from_fd(&io, fd);
+    tag_header = new_header();
+    if (!read_tag_header(&io, buffer, sizeof(buffer), tag_header, &base)) {
+        mem_free(tag_header);
+        return NULL;
+    }
+
+    // mmap() offsets have to be page aligned, an appended tag rarely is
+    skew = (int) (base % sysconf(_SC_PAGESIZE));
+    mapping_size = skew + tag_header->tag_size + ID3_HEADER;
+    count_syscalls(1);
+    if (fstat(fd, &st) != 0 || st.st_size < base - skew + mapping_size) {
+        mem_free(tag_header);
+        return NULL;
+    }
+
+    // Map only the tag. The mapping is private and writable so callers may
+    // still modify frame data, pages are copied only if they do.
+    count_syscalls(1);
+    mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, (off_t) (base - skew));
+    if (mapping == MAP_FAILED) {
+        report_error("Error mapping file");
+        mem_free(tag_header);
+        return NULL;
+    }
+
+    if (needs_tag_decoding(tag_header)) {
+        // The frames have to be decoded into a copy anyway
+        mem_free(tag_header);
+        tag = load_buffer(mapping + skew, mapping_size - skew, mode == PARSE_LAZY ? PARSE_LAZY : PARSE_COPY);
+        count_syscalls(1);
+        munmap(mapping, mapping_size);
+        return tag;
+    }
+
+    tag = new_tag();
+    mem_free(tag->tag_header);
+    tag->tag_header = tag_header;
+    tag->mapping = mapping;
+    tag->mapping_size = mapping_size;
+    tag->raw = mapping + skew + ID3_HEADER + get_extended_header_skip(tag_header);
+
+    frames_size = get_frames_size(tag_header);
+    parse_frames(tag, tag->raw, frames_size, mode, NULL);
+
+    return tag;
+}
+
+ID3v2_tag *load_tag_mmap_with_fd(int fd)
+{
+    return map_tag(fd, PARSE_IN_PLACE);
+}
+
+ID3v2_tag *load_tag_lazy_with_fd(int fd)
+{
+    return map_tag(fd, PARSE_LAZY);
+}
+#endif
+
+static ID3v2_tag *map_file(const char *file_name, int mode)
+{
+#ifdef _WIN32
+    // No mmap, the frames are simply loaded up front
+    (void) mode;
+    return load_tag(file_name);
+#else
+    ID3v2_tag *tag;
+    int fd = open(file_name, O_RDONLY);
 
-    file = fopen(file_name, "r+b");
-    temp_file = tmpfile();
+    count_syscalls(1);
+    if (fd < 0) {
+        report_error("Error opening file");
+        return NULL;
+    }
+
+    tag = map_tag(fd, mode);
+    count_syscalls(1);
+    close(fd);
+
+    return tag;
+#endif
+}
+
+ID3v2_tag *load_tag_mmap(const char *file_name)
+{
+    return map_file(file_name, PARSE_IN_PLACE);
+}
+
+// Maps the tag and only parses the frame headers, so the pages holding the
+// payload of frames nobody asks for (typically the pictures) are never read
+ID3v2_tag *load_tag_lazy(const char *file_name)
+{
+    return map_file(file_name, PARSE_LAZY);
+}
+
+// Give every frame that still points into the mapping its own copy of the
+// data and drop the mapping, the file under it is about to change.
+static void detach_tag_mapping(ID3v2_tag *tag)
+{
+    if (!tag->mapping) return;
+
+    for (int i = 0; i < tag->frames->count; i++) {
+        ID3v2_frame *frame = tag->frames->frames[i];
+        if (!frame->data && frame->source) {
+            // As stored, encoded frames are not decoded just to be written back
+            frame->data = mem_alloc(frame->size);
+            count_copy(frame->size);
+            memcpy(frame->data, frame->source, frame->size);
+        } else if (is_mapped(tag, frame->data)) {
+            char *data = mem_alloc(frame->size);
+            count_copy(frame->size);
+            memcpy(data, frame->data, frame->size);
+            frame->data = data;
+        }
+    }
+
+    unmap_tag(tag);
+}
+
+// How many bytes the tag currently in the file takes up (padding and footer
+// included), 0 if there is none. *base is set to where it starts, which is
+// not 0 for a tag appended to the file.
+static int read_tag_size(ID3v2_io *io, long long *base)
+{
+    char head[ID3_HEADER + ID3_EXTENDED_HEADER_SIZE];
+    ID3v2_header tag_header;
+    int length = io_read_at(io, head, sizeof(head), 0);
+
+    *base = 0;
+    if (length > 0 && parse_tag_header(head, length, &tag_header)) {
+        return get_tag_total_size(&tag_header);
+    }
+
+    *base = find_appended_tag_with_io(io);
+    if (*base > 0 && io_read_at(io, head, ID3_HEADER, *base) == ID3_HEADER &&
+        parse_tag_header(head, ID3_HEADER, &tag_header) && tag_header.has_footer) {
+        return get_tag_total_size(&tag_header);
+    }
+
+    *base = 0;
+    return 0;
+}
+
+// Returns 1 if a tag was removed, 0 if there was none and -1 on error
+int remove_tag_with_io(ID3v2_io *io)
+{
+    char head[ID3_HEADER + ID3_EXTENDED_HEADER_SIZE];
+    ID3v2_header tag_header;
+    long long file_size, tag_size, base;
+    int length;
+
+    length = io_read_at(io, head, sizeof(head), 0);
+    if (length < 0) return -1;
+
+    if (parse_tag_header(head, length, &tag_header)) {
+        tag_size = get_tag_total_size(&tag_header);
+        base = 0;
+    } else {
+        // An appended tag, what follows it (an ID3v1 tag) moves back over it
+        tag_size = read_tag_size(io, &base);
+        if (!tag_size) return 0;
+    }
 
-    tag_header = get_tag_header(file_name);
-    if (!tag_header) return;
+    file_size = io_size(io);
+    if (file_size < 0) return -1;
 
-    fseek(file, tag_header->tag_size + ID3_HEADER, SEEK_SET);
-    while ((c = getc(file)) != EOF) {
-        putc(c, temp_file);
+    if (base + tag_size > file_size) tag_size = file_size - base;
+
+    // Move what follows the tag over it, the file shrinks by the tag size
+    if (io_shift(io, base + tag_size, -tag_size) != 0) {
+        report_error("Error removing tag");
+        return -1;
     }
 
-    // Write temp file data back to original file
-    fseek(temp_file, 0, SEEK_SET);
-    fseek(file, 0, SEEK_SET);
-    while ((c = getc(temp_file)) != EOF) {
-        putc(c, file);
+    return 1;
+}
+
+void remove_tag(const char *file_name)
+{
+    ID3v2_io io;
+
+    if (io_open_file(&io, file_name, 1) != 0) {
+        report_error("Error opening file");
+        return;
     }
+
+    remove_tag_with_io(&io);
+    io_close_file(&io);
 }
 
 void write_header(ID3v2_header *tag_header, FILE *file)
 {
+    int tag_size = syncint_encode(tag_header->tag_size);
+    char size[4] = { (char) (tag_size >> 24), (char) (tag_size >> 16), (char) (tag_size >> 8), (char) tag_size };
+
     fwrite("ID3", 3, 1, file);
     fwrite(&tag_header->major_version, 1, 1, file);
     fwrite(&tag_header->minor_version, 1, 1, file);
     fwrite(&tag_header->flags, 1, 1, file);
-    fwrite(itob(syncint_encode(tag_header->tag_size)), 4, 1, file);
+    fwrite(size, 4, 1, file);
 }
 
 void write_frame(ID3v2_frame *frame, FILE *file)
 {
+    char size[4] = { (char) (frame->size >> 24), (char) (frame->size >> 16), (char) (frame->size >> 8), (char) frame->size };
+
     fwrite(frame->frame_id, 1, 4, file);
-    fwrite(itob(frame->size), 1, 4, file);
+    fwrite(size, 1, 4, file);
     fwrite(frame->flags, 1, 2, file);
-    fwrite(frame->data, 1, frame->size, file);
+    fwrite(frame->data ? frame->data : frame->source, 1, frame->size, file);
 }
 
 int get_tag_size(ID3v2_tag *tag)
 {
     int size = 0;
-    ID3v2_frame_list *frame_list = new_frame_list();
 
     if (!tag->frames) return size;
 
-    frame_list = tag->frames->start;
-    while (frame_list) {
-        size += frame_list->frame->size + ID3_FRAME;
-        frame_list = frame_list->next;
+    for (int i = 0; i < tag->frames->count; i++) {
+        size += tag->frames->frames[i]->size + ID3_FRAME;
     }
 
     return size;
 }
 
-void set_tag(const char *file_name, ID3v2_tag *tag)
+// Write the tag with padding zero bytes after the frames, in one gathered
+// write where the io can do it. Returns 0 or -1 if a write failed.
+static int write_tag(ID3v2_tag *tag, int padding, ID3v2_io *io)
 {
-    int c;
-    FILE *file;
-    ID3v2_frame_list *frame_list;
-    int i;
-    int padding = 2048;
-    int old_size;
-    FILE *temp_file;
+    ID3v2_rendered_tag rendered;
+    int result;
+
+    if (render_tag_iovec(tag, padding, &rendered) != 0) return -1;
+
+    result = io_writev(io, rendered.iov, rendered.count, 0);
+    free_rendered_tag(&rendered);
+
+    return result;
+}
+
+// Resize the tag in the file from old_size to hold frames_size bytes of
+// frames plus what the padding policy asks for, moving the audio after it.
+// Sets padding, distance (how far the audio moved) and moved (how many bytes).
+static int resize_tag(ID3v2_io *io, int old_size, int frames_size, ID3v2_padding_policy *policy,
+                      int *padding, long long *distance, long long *moved)
+{
+    long long file_size = io_size(io);
+    long long offset;
+    int block = io->block_size;
+
+    if (file_size < 0) return ID3_WRITE_FAILED;
+    if (old_size > file_size) old_size = (int) file_size;
+
+    *padding = get_padding(policy, frames_size, block);
+    *distance = ID3_HEADER + frames_size + *padding - old_size;
+    offset = old_size;
+    if (block > 0 && *distance > 0) {
+        // Grow by whole blocks from a block boundary so the filesystem can
+        // insert them instead of copying the audio, the rest becomes padding
+        *distance += (block - *distance % block) % block;
+        offset -= offset % block;
+    } else if (block > 0 && *distance < 0) {
+        // Shrink by whole blocks for the same reason, keeping a bit more padding
+        *distance = -(-*distance / block * block);
+        offset -= offset % block;
+    }
+    *padding = old_size + (int) *distance - ID3_HEADER - frames_size;
 
-    if (!tag) return;
+    if (*distance == 0) return ID3_WRITE_IN_PLACE;
 
-    old_size = tag->tag_header->tag_size;
+    if (io_shift(io, offset, *distance) != 0) {
+        report_error("Error moving audio data");
+        return ID3_WRITE_FAILED;
+    }
+    *moved = file_size - offset;
+
+    return ID3_WRITE_REWRITE;
+}
+
+// Get the tag ready to be written: the header is set and *frames_size is
+// what the frames take once rendered. Appended tags are ID3v2.4 with a footer
+// and never unsynchronised, see render_appended_tag(). Returns 0 or -1.
+static int prepare_tag(ID3v2_tag *tag, int appended, int *frames_size)
+{
+    int v24, unsynchronised;
+
+    detach_tag_mapping(tag);
+
+    // Frames read from an ID3v2.4 tag get the ID3v2.3 layout here, once,
+    // rather than while they are sized and again while they are rendered
+    if (tag->frames) {
+        for (int i = 0; i < tag->frames->count; i++) convert_frame_to_v23(tag->frames->frames[i]);
+    }
+
+    // ID3v2.3 unless a frame holds text only ID3v2.4 can store, see render.c.
+    // Unsynchronised ID3v2.3 tags are written back unsynchronised, callers
+    // may also set tag_header->unsynchronised to ask for it.
+    v24 = appended || get_rendered_tag_version(tag) == ID3v24;
+    unsynchronised = v24 ? 0 : tag->tag_header->unsynchronised;
 
     // Set the new tag header
-    tag->tag_header = new_header();
+    memset(tag->tag_header, 0, sizeof(ID3v2_header));
     memcpy(tag->tag_header->tag, "ID3", 3);
-    tag->tag_header->major_version = '\x03';
+    tag->tag_header->major_version = v24 ? '\x04' : '\x03';
     tag->tag_header->minor_version = '\x00';
-    tag->tag_header->flags = '\x00';
-    tag->tag_header->tag_size = get_tag_size(tag) + padding;
-
-    // Create temp file and prepare to write
-    file = fopen(file_name, "r+b");
-    temp_file = tmpfile();
+    tag->tag_header->unsynchronised = unsynchronised;
 
-    // Write to file
-    write_header(tag->tag_header, temp_file);
-    frame_list = tag->frames->start;
-    while (frame_list) {
-        write_frame(frame_list->frame, temp_file);
-        frame_list = frame_list->next;
+    if (appended) {
+        tag->tag_header->flags = ID3_HEADER_FLAGS_HAS_FOOTER;
+        tag->tag_header->has_footer = 1;
+        *frames_size = get_rendered_appended_tag_size(tag) - ID3_HEADER - ID3_FOOTER;
+    } else {
+        tag->tag_header->flags = unsynchronised ? ID3_HEADER_FLAGS_HAS_UNSYNCHRONISATION : '\x00';
+        *frames_size = get_rendered_frames_size(tag);
     }
 
-    // Write padding
-    for (i = 0; i < padding; i++) {
-        putc('\x00', temp_file);
-    }
+    return 0;
+}
 
-    fseek(file, old_size + 10, SEEK_SET);
-    while ((c = getc(file)) != EOF) {
-        putc(c, temp_file);
+// Write the tag appended to the file at offset, over the old_size bytes of
+// the tag there, if any. What follows it (an ID3v1 tag) is written again
+// after the new tag and the file is cut short if it got shorter. The audio
+// in front of offset is never read or moved. Sets moved to the bytes
+// written again.
+static int write_appended_tag(ID3v2_io *io, ID3v2_tag *tag, long long offset, int old_size, long long *moved)
+{
+    char trailer[ID3V1_TAG_SIZE];
+    ID3v2_rendered_tag rendered;
+    long long file_size = io_size(io);
+    long long end;
+    int trailer_size, frames_size;
+    int written;
+
+    if (file_size < 0 || offset + old_size > file_size) return ID3_WRITE_FAILED;
+
+    trailer_size = (int) (file_size - offset - old_size);
+    if (trailer_size > ID3V1_TAG_SIZE) {
+        report_error("Unexpected data after the tag");
+        return ID3_WRITE_FAILED;
     }
+    if (io_read_at(io, trailer, trailer_size, offset + old_size) != trailer_size) return ID3_WRITE_FAILED;
+
+    if (prepare_tag(tag, 1, &frames_size) != 0) return ID3_WRITE_FAILED;
+    tag->tag_header->tag_size = frames_size;
+    if (render_appended_tag_iovec(tag, &rendered) != 0) return ID3_WRITE_FAILED;
 
-    // Write temp file data back to original file
-    fseek(temp_file, 0, SEEK_SET);
-    fseek(file, 0, SEEK_SET);
-    while ((c = getc(temp_file)) != EOF) {
-        putc(c, file);
+    end = offset + rendered.size;
+    written = io_writev(io, rendered.iov, rendered.count, offset) == 0 &&
+              (!trailer_size || io_write_at(io, trailer, trailer_size, end) == trailer_size) &&
+              (end + trailer_size >= file_size || io_truncate(io, end + trailer_size) == 0);
+    free_rendered_tag(&rendered);
+
+    if (!written) {
+        report_error("Error writing tag");
+        return ID3_WRITE_FAILED;
     }
+    *moved = trailer_size;
 
-    fclose(file);
-    fclose(temp_file);
+    return ID3_WRITE_IN_PLACE;
 }
 
-/**
- * Getter functions
- */
-ID3v2_frame *tag_get_title(ID3v2_tag *tag)
+// The frames fit in the old tag unless it is too small, or its padding is
+// over the maximum. Returns the padding left or -1 if the tag must be resized.
+static int padding_in_place(int old_size, int frames_size, ID3v2_padding_policy *policy)
 {
-    if (!tag) return NULL;
+    int padding = old_size - ID3_HEADER - frames_size;
 
-    return get_from_list(tag->frames, "TIT2");
+    if (!old_size || padding < 0 || (policy->max > 0 && padding > policy->max)) return -1;
+
+    return padding;
 }
 
-ID3v2_frame *tag_get_artist(ID3v2_tag *tag)
+int set_tag_with_io(ID3v2_io *io, ID3v2_tag *tag)
 {
-    if (!tag) return NULL;
+    ID3v2_padding_policy policy;
+    int padding;
+    int old_size;
+    int frames_size;
+    long long base;
+    long long distance = 0;
+    long long moved = 0;
+    int result = ID3_WRITE_IN_PLACE;
+
+    if (!tag) return ID3_WRITE_FAILED;
+
+    get_padding_policy(&policy);
+
+    old_size = read_tag_size(io, &base);
+    if (base > 0) {
+        // A tag appended to the file is rewritten where it is
+        result = write_appended_tag(io, tag, base, old_size, &moved);
+        count_tag_write(result, old_size, get_tag_total_size(tag->tag_header) - old_size, moved);
+        return result;
+    }
 
-    return get_from_list(tag->frames, "TPE1");
+    if (prepare_tag(tag, 0, &frames_size) != 0) {
+        count_tag_write(ID3_WRITE_FAILED, 0, 0, 0);
+        return ID3_WRITE_FAILED;
+    }
+
+    // Overwrite the old tag in place and pad out the rest if the frames fit,
+    // the audio payload is left untouched
+    padding = padding_in_place(old_size, frames_size, &policy);
+    if (padding < 0) {
+        result = resize_tag(io, old_size, frames_size, &policy, &padding, &distance, &moved);
+    }
+
+    if (result != ID3_WRITE_FAILED) {
+        tag->tag_header->tag_size = frames_size + padding;
+
+        if (write_tag(tag, padding, io) != 0) {
+            report_error("Error writing tag");
+            result = ID3_WRITE_FAILED;
+        }
+    }
+
+    count_tag_write(result, old_size, distance, moved);
+
+    return result;
 }
 
-ID3v2_frame *tag_get_album(ID3v2_tag *tag)
+int set_tag(const char *file_name, ID3v2_tag *tag)
 {
-    if (!tag) return NULL;
+    ID3v2_io io;
+    int result;
+
+    if (!tag) return ID3_WRITE_FAILED;
+
+    if (io_open_file(&io, file_name, 1) != 0) {
+        report_error("Error opening file");
+        return ID3_WRITE_FAILED;
+    }
+
+    result = set_tag_with_io(&io, tag);
+    io_close_file(&io);
 
-    return get_from_list(tag->frames, "TALB");
+    return result;
 }
 
-ID3v2_frame *tag_get_album_artist(ID3v2_tag *tag)
+// Write the tag at the end of the file, before an ID3v1 tag if there is one,
+// as an ID3v2.4 tag with a footer. Only the tag is written, however big the
+// audio in front of it, and it replaces a tag appended before. A file that
+// starts with a tag keeps it there, it is updated as set_tag_with_io() does.
+int set_tag_append_with_io(ID3v2_io *io, ID3v2_tag *tag)
 {
-    if (!tag) return NULL;
+    char tail[ID3V1_TAG_SIZE];
+    long long file_size, offset;
+    long long moved = 0;
+    int old_size;
+    int result;
+
+    if (!tag) return ID3_WRITE_FAILED;
+
+    old_size = read_tag_size(io, &offset);
+    if (old_size && offset == 0) return set_tag_with_io(io, tag);
+
+    if (!old_size) {
+        file_size = io_size(io);
+        if (file_size < 0) return ID3_WRITE_FAILED;
+        offset = file_size;
+        if (file_size >= ID3V1_TAG_SIZE &&
+            io_read_at(io, tail, ID3V1_TAG_SIZE, file_size - ID3V1_TAG_SIZE) == ID3V1_TAG_SIZE &&
+            memcmp(tail, "TAG", 3) == 0) {
+            offset -= ID3V1_TAG_SIZE;
+        }
+    }
 
-    return get_from_list(tag->frames, "TPE2");
+    result = write_appended_tag(io, tag, offset, old_size, &moved);
+    count_tag_write(result, old_size, get_tag_total_size(tag->tag_header) - old_size, moved);
+
+    return result;
 }
 
-ID3v2_frame *tag_get_genre(ID3v2_tag *tag)
+int set_tag_append(const char *file_name, ID3v2_tag *tag)
 {
-    if (!tag) return NULL;
+    ID3v2_io io;
+    int result;
+
+    if (!tag) return ID3_WRITE_FAILED;
+
+    if (io_open_file(&io, file_name, 1) != 0) {
+        report_error("Error opening file");
+        return ID3_WRITE_FAILED;
+    }
+
+    result = set_tag_append_with_io(&io, tag);
+    io_close_file(&io);
 
-    return get_from_list(tag->frames, "TCON");
+    return result;
 }
 
-ID3v2_frame *tag_get_track(ID3v2_tag *tag)
+#ifndef _WIN32
+// fsync() the directory holding path so a rename() in it is on disk too
+static void sync_directory(const char *path)
 {
-    if (!tag) return NULL;
-
-    return get_from_list(tag->frames, "TRCK");
+    const char *slash = strrchr(path, '/');
+    char *directory = slash ? strndup(path, slash - path + 1) : NULL;
+    int fd = open(directory ? directory : ".", O_RDONLY);
+
+    count_syscalls(fd >= 0 ? 3 : 1);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    free(directory);	// strndup() and realpath() use malloc() whatever the allocator
 }
 
-ID3v2_frame *tag_get_year(ID3v2_tag *tag)
+// Create a hidden file next to path, rename() only works within a
+// filesystem, with the same permissions and owner as the original. Only
+// root may give a file away, others get a file of their own as with any
+// other edit. Returns its descriptor and sets *temp_name, or returns -1.
+static int create_sibling(const char *path, struct stat *st, char **temp_name)
 {
-    if (!tag) return NULL;
+    const char *slash = strrchr(path, '/');
+    int directory_length = slash ? (int) (slash - path) + 1 : 0;
+    int fd;
+
+    *temp_name = mem_alloc(strlen(path) + sizeof(".XXXXXX") + 1);
+    if (!*temp_name) return -1;
+    sprintf(*temp_name, "%.*s.%s.XXXXXX", directory_length, path, path + directory_length);
+
+    count_syscalls(3);	// mkstemp(), fchmod() and fchown()
+    fd = mkstemp(*temp_name);
+    if (fd < 0) {
+        report_error("Error creating temp file");
+        mem_free(*temp_name);
+        return -1;
+    }
 
-    return get_from_list(tag->frames, "TYER");
+    if (fchmod(fd, st->st_mode & 07777) != 0 ||
+        (fchown(fd, st->st_uid, st->st_gid) != 0 && errno != EPERM)) {
+        report_error("Error copying file permissions");
+        close(fd);
+        unlink(*temp_name);
+        mem_free(*temp_name);
+        return -1;
+    }
+
+    return fd;
 }
 
-ID3v2_frame *tag_get_comment(ID3v2_tag *tag)
+// Rename the sibling over path once it is on disk, or remove it if it could
+// not be written. Returns 0 or -1, the original is left as it was then.
+static int replace_with_sibling(const char *path, char *temp_name, int fd, int written)
 {
-    if (!tag) return NULL;
+    written = written && fsync(fd) == 0;
+    count_syscalls(3);	// fsync(), close() and rename()
+
+    if (close(fd) != 0 || !written || rename(temp_name, path) != 0) {
+        report_error("Error writing temp file");
+        unlink(temp_name);
+        mem_free(temp_name);
+        return -1;
+    }
+
+    mem_free(temp_name);
+    sync_directory(path);
 
-    return get_from_list(tag->frames, "COMM");
+    return 0;
 }
 
-ID3v2_frame *tag_get_disc_number(ID3v2_tag *tag)
+// Write the tag and the audio after the old tag into a new file next to
+// path, and rename it over path once it is on disk. The original is never
+// modified, if anything fails it is left as it was and the new file removed.
+static int rewrite_atomically(const char *path, ID3v2_io *io, struct stat *st, ID3v2_tag *tag,
+                              int frames_size, int padding, int old_size, long long *moved)
 {
-    if (!tag) return NULL;
-
-    return get_from_list(tag->frames, "TPOS");
+    long long file_size = io_size(io);
+    char *temp_name;
+    ID3v2_io out;
+    int written;
+    int fd;
+
+    if (file_size < 0) return -1;
+    if (old_size > file_size) old_size = (int) file_size;
+
+    fd = create_sibling(path, st, &temp_name);
+    if (fd < 0) return -1;
+
+    io_from_fd(&out, fd);
+    tag->tag_header->tag_size = frames_size + padding;
+    written = write_tag(tag, padding, &out) == 0 &&
+              io_copy(&out, ID3_HEADER + frames_size + padding, io, old_size, file_size - old_size) == 0;
+    if (replace_with_sibling(path, temp_name, fd, written) != 0) return -1;
+    *moved = file_size - old_size;
+
+    return 0;
 }
 
-ID3v2_frame *tag_get_composer(ID3v2_tag *tag)
+// The same for a tag appended to the file at offset: the file is copied and
+// the tag written again at the end of the copy.
+static int rewrite_appended_atomically(const char *path, ID3v2_io *io, struct stat *st, ID3v2_tag *tag,
+                                       long long offset, int old_size, long long *moved)
 {
-    if (!tag) return NULL;
+    long long file_size = io_size(io);
+    char *temp_name;
+    ID3v2_io out;
+    int written;
+    int fd;
 
-    return get_from_list(tag->frames, "TCOM");
+    if (file_size < 0) return -1;
+
+    fd = create_sibling(path, st, &temp_name);
+    if (fd < 0) return -1;
+
+    io_from_fd(&out, fd);
+    written = io_copy(&out, 0, io, 0, file_size) == 0 &&
+              write_appended_tag(&out, tag, offset, old_size, moved) != ID3_WRITE_FAILED;
+    if (replace_with_sibling(path, temp_name, fd, written) != 0) return -1;
+    *moved = file_size - old_size;
+
+    return 0;
 }
+#endif
 
-ID3v2_frame *tag_get_album_cover(ID3v2_tag *tag)
+// Like set_tag(), but the file is replaced by a new one instead of being
+// modified, so a crash or a full disk never leaves a half written file.
+// The new file is a copy of the old one, audio included, even when the tag
+// would have fit in place.
+int set_tag_atomic(const char *file_name, ID3v2_tag *tag)
 {
-    if (!tag) return NULL;
+#ifdef _WIN32
+    // No atomic replace here, the file is modified in place
+    return set_tag(file_name, tag);
+#else
+    ID3v2_padding_policy policy;
+    ID3v2_io io;
+    struct stat st;
+    char *path;
+    int fd;
+    int padding;
+    int old_size;
+    int frames_size;
+    long long base;
+    long long moved = 0;
+    int result;
+
+    if (!tag) return ID3_WRITE_FAILED;
+
+    // Through symbolic links, they should still point to the new file
+    path = realpath(file_name, NULL);
+    fd = path ? open(path, O_RDONLY) : -1;
+    count_syscalls(fd >= 0 ? 2 : 1);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        report_error("Error opening file");
+        if (fd >= 0) close(fd);
+        free(path);
+        count_tag_write(ID3_WRITE_FAILED, 0, 0, 0);
+        return ID3_WRITE_FAILED;
+    }
+    io_from_fd(&io, fd);
+
+    get_padding_policy(&policy);
+
+    old_size = read_tag_size(&io, &base);
+    if (base > 0) {
+        result = rewrite_appended_atomically(path, &io, &st, tag, base, old_size, &moved) == 0 ?
+                 ID3_WRITE_REWRITE : ID3_WRITE_FAILED;
+        count_syscalls(1);
+        close(fd);
+        free(path);
+        count_tag_write(result, old_size, get_tag_total_size(tag->tag_header) - old_size, moved);
+        return result;
+    }
+
+    if (prepare_tag(tag, 0, &frames_size) != 0) {
+        count_syscalls(1);
+        close(fd);
+        free(path);
+        count_tag_write(ID3_WRITE_FAILED, 0, 0, 0);
+        return ID3_WRITE_FAILED;
+    }
+
+    // A tag that fits keeps the size of the old one, the audio stays where it was
+    padding = padding_in_place(old_size, frames_size, &policy);
+    if (padding < 0) padding = get_padding(&policy, frames_size, io.block_size);
 
-    return get_from_list(tag->frames, "APIC");
+    result = rewrite_atomically(path, &io, &st, tag, frames_size, padding, old_size, &moved) == 0 ?
+             ID3_WRITE_REWRITE : ID3_WRITE_FAILED;
+
+    count_syscalls(1);
+    close(fd);
+    free(path);
+    count_tag_write(result, old_size, (long long) ID3_HEADER + frames_size + padding - old_size, moved);
+
+    return result;
+#endif
 }
 
 /**
- * Setter functions
+ * Getter functions
  */
-void set_text_frame(char *data, char encoding, char *frame_id, ID3v2_frame *frame)
+ID3v2_frame *tag_get_frame(ID3v2_tag *tag, char *frame_id)
 {
-    char *frame_data;
-    // Set frame id and size
-    memcpy(frame->frame_id, frame_id, 4);
-    frame->size = 1 + (int) strlen(data);
+    return tag_get_nth_frame(tag, frame_id, 0);
+}
 
-    // Set frame data
-    // TODO: Make the encoding param relevant.
-    frame_data = malloc(frame->size);
-    frame->data = malloc(frame->size);
+ID3v2_frame *tag_get_nth_frame(ID3v2_tag *tag, char *frame_id, int n)
+{
+    ID3v2_frame *frame;
 
-    sprintf(frame_data, "%c%s", encoding, data);
-    memcpy(frame->data, frame_data, frame->size);
+    if (!tag) return NULL;
 
-    free(frame_data);
+    frame = get_nth_from_list(tag->frames, frame_id, n);
+    if (frame) {
+        load_frame_data_in_arena(frame, tag->arena);
+    } else if (n == 0 && tag->fallback) {
+        // the ID3v1 field, see load_any_tag()
+        frame = get_from_list(tag->fallback, frame_id);
+    }
+
+    return frame;
 }
 
-void set_comment_frame(char *data, char encoding, ID3v2_frame *frame)
+int tag_count_frames(ID3v2_tag *tag, char *frame_id)
 {
-    char *frame_data;
+    if (!tag) return 0;
 
-    memcpy(frame->frame_id, COMMENT_FRAME_ID, 4);
-    frame->size = 1 + 3 + 1 + (int) strlen(data); // encoding + language + description + comment
-
-    frame_data = malloc(frame->size);
-    frame->data = malloc(frame->size);
+    return count_in_list(tag->frames, frame_id);
+}
 
-    sprintf(frame_data, "%c%s%c%s", encoding, "eng", '\x00', data);
-    memcpy(frame->data, frame_data, frame->size);
+ID3v2_frame *tag_get_title(ID3v2_tag *tag)
+{
+    return tag_get_frame(tag, "TIT2");
+}
 
-    free(frame_data);
+ID3v2_frame *tag_get_artist(ID3v2_tag *tag)
+{
+    return tag_get_frame(tag, "TPE1");
 }
 
-void set_album_cover_frame(char *album_cover_bytes, char *mimetype, int picture_size, ID3v2_frame *frame)
+ID3v2_frame *tag_get_album(ID3v2_tag *tag)
 {
-    char *frame_data;
-    int offset;
+    return tag_get_frame(tag, "TALB");
+}
 
-    memcpy(frame->frame_id, ALBUM_COVER_FRAME_ID, 4);
-    frame->size = 1 + (int) strlen(mimetype) + 1 + 1 + 1 + picture_size; // encoding + mimetype + 00 + type + description + picture
+ID3v2_frame *tag_get_album_artist(ID3v2_tag *tag)
+{
+    return tag_get_frame(tag, "TPE2");
+}
 
-    frame_data = malloc(frame->size);
-    frame->data = malloc(frame->size);
+ID3v2_frame *tag_get_genre(ID3v2_tag *tag)
+{
+    return tag_get_frame(tag, "TCON");
+}
 
-    offset = 1 + (int) strlen(mimetype) + 1 + 1 + 1;
-    sprintf(frame_data, "%c%s%c%c%c", '\x00', mimetype, '\x00', FRONT_COVER, '\x00');
-    memcpy(frame->data, frame_data, offset);
-    memcpy(frame->data + offset, album_cover_bytes, picture_size);
+ID3v2_frame *tag_get_track(ID3v2_tag *tag)
+{
+    return tag_get_frame(tag, "TRCK");
+}
 
-    free(frame_data);
+ID3v2_frame *tag_get_year(ID3v2_tag *tag)
+{
+    return tag_get_frame(tag, "TYER");
 }
 
-void tag_set_title(char *title, char encoding, ID3v2_tag *tag)
+ID3v2_frame *tag_get_comment(ID3v2_tag *tag)
 {
-    ID3v2_frame *title_frame = NULL;
+    return tag_get_frame(tag, "COMM");
+}
 
-    if (!(title_frame = tag_get_title(tag))) {
-        title_frame = new_frame();
-        add_to_list(tag->frames, title_frame);
-    }
+ID3v2_frame *tag_get_disc_number(ID3v2_tag *tag)
+{
+    return tag_get_frame(tag, "TPOS");
+}
 
-    set_text_frame(title, encoding, TITLE_FRAME_ID, title_frame);
+ID3v2_frame *tag_get_composer(ID3v2_tag *tag)
+{
+    return tag_get_frame(tag, "TCOM");
 }
 
-void tag_set_artist(char *artist, char encoding, ID3v2_tag *tag)
+ID3v2_frame *tag_get_album_cover(ID3v2_tag *tag)
 {
-    ID3v2_frame *artist_frame = NULL;
+    return tag_get_frame(tag, "APIC");
+}
 
-    if (!(artist_frame = tag_get_artist(tag))) {
-        artist_frame = new_frame();
-        add_to_list(tag->frames, artist_frame);
-    }
+/**
+ * Setter functions
+ */
+// Allocates the APIC payload of frame and fills in everything but the
+// picture, returns where the picture_size bytes of the picture go
+static char *prepare_album_cover_frame(char *mimetype, int picture_size, ID3v2_frame *frame)
+{
+    int offset = 1 + (int) strlen(mimetype) + 1 + 1 + 1; // encoding + mimetype + 00 + type + description
 
-    set_text_frame(artist, encoding, ARTIST_FRAME_ID, artist_frame);
+    memcpy(frame->frame_id, ALBUM_COVER_FRAME_ID, 4);
+    frame->size = offset + picture_size;
+    frame->data = mem_alloc(frame->size);
+    if (!frame->data) return NULL;
+    frame->flags[1] = 0;	// stored as is
+
+    frame->data[0] = '\x00';
+    memcpy(frame->data + 1, mimetype, offset - 4);
+    frame->data[offset - 3] = '\x00';
+    frame->data[offset - 2] = FRONT_COVER;
+    frame->data[offset - 1] = '\x00';
+
+    return frame->data + offset;
 }
 
-void tag_set_album(char *album, char encoding, ID3v2_tag *tag)
+void set_album_cover_frame(char *album_cover_bytes, char *mimetype, int picture_size, ID3v2_frame *frame)
 {
-    ID3v2_frame *album_frame = NULL;
+    char *picture = prepare_album_cover_frame(mimetype, picture_size, frame);
 
-    if (!(album_frame = tag_get_album(tag))) {
-        album_frame = new_frame();
-        add_to_list(tag->frames, album_frame);
-    }
-
-    set_text_frame(album, encoding, ALBUM_FRAME_ID, album_frame);
+    count_copy(picture_size);
+    if (picture) memcpy(picture, album_cover_bytes, picture_size);
 }
 
-void tag_set_album_artist(char *album_artist, char encoding, ID3v2_tag *tag)
+// First frame_id frame of the tag, an empty frame with that ID is added if there is none
+static ID3v2_frame *get_or_add_frame(ID3v2_tag *tag, char *frame_id)
 {
-    ID3v2_frame *album_artist_frame = NULL;
+    ID3v2_frame *frame = get_from_list(tag->frames, frame_id);
 
-    if (!(album_artist_frame = tag_get_album_artist(tag))) {
-        album_artist_frame = new_frame();
-        add_to_list(tag->frames, album_artist_frame);
+    if (!frame) {
+        frame = new_frame();
+        memcpy(frame->frame_id, frame_id, ID3_FRAME_ID);
+        add_to_list(tag->frames, frame);
     }
 
-    set_text_frame(album_artist, encoding, ALBUM_ARTIST_FRAME_ID, album_artist_frame);
+    return frame;
 }
 
-void tag_set_genre(char *genre, char encoding, ID3v2_tag *tag)
+// Set the payload of frame to size bytes of data, the old one is freed
+// unless it is in the arena or the mapping of the tag
+static void replace_frame_data(ID3v2_tag *tag, ID3v2_frame *frame, char *data, int size)
 {
-    ID3v2_frame *genre_frame = NULL;
-
-    if (!(genre_frame = tag_get_genre(tag))) {
-        genre_frame = new_frame();
-        add_to_list(tag->frames, genre_frame);
-    }
+    if (frame->data && !arena_owns(tag->arena, frame->data) && !is_mapped(tag, frame->data)) mem_free(frame->data);
 
-    set_text_frame(genre, encoding, GENRE_FRAME_ID, genre_frame);
+    frame->data = data;
+    frame->source = NULL;
+    frame->size = size;
+    frame->flags[1] = 0;	// stored as is
 }
 
-void tag_set_track(char *track, char encoding, ID3v2_tag *tag)
+// Set the text of the first frame_id frame, one is added if there is none.
+// text is UTF-8, size bytes of it or up to its NUL if size is -1, and zero
+// bytes in it separate the values of an ID3v2.4 list. It is written in the
+// given ID3_TEXT_ENCODING_*, see new_text_frame_payload(). Returns 0 or -1.
+int tag_set_text_frame(ID3v2_tag *tag, char *frame_id, const char *text, int size, char encoding)
 {
-    ID3v2_frame *track_frame = NULL;
+    int payload_size;
+    char *payload;
+
+    if (size < 0) size = (int) strlen(text);
 
-    if (!(track_frame = tag_get_track(tag))) {
-        track_frame = new_frame();
-        add_to_list(tag->frames, track_frame);
+    payload = new_text_frame_payload(frame_id, text, size, encoding, &payload_size);
+    if (!payload) {
+        report_error("Error setting text frame");
+        return -1;
     }
 
-    set_text_frame(track, encoding, TRACK_FRAME_ID, track_frame);
+    replace_frame_data(tag, get_or_add_frame(tag, frame_id), payload, payload_size);
+    return 0;
 }
 
-void tag_set_year(char *year, char encoding, ID3v2_tag *tag)
+void tag_set_title(char *title, char encoding, ID3v2_tag *tag)
 {
-    ID3v2_frame *year_frame = NULL;
+    tag_set_text_frame(tag, TITLE_FRAME_ID, title, -1, encoding);
+}
 
-    if (!(year_frame = tag_get_year(tag))) {
-        year_frame = new_frame();
-        add_to_list(tag->frames, year_frame);
-    }
+void tag_set_artist(char *artist, char encoding, ID3v2_tag *tag)
+{
+    tag_set_text_frame(tag, ARTIST_FRAME_ID, artist, -1, encoding);
+}
 
-    set_text_frame(year, encoding, YEAR_FRAME_ID, year_frame);
+void tag_set_album(char *album, char encoding, ID3v2_tag *tag)
+{
+    tag_set_text_frame(tag, ALBUM_FRAME_ID, album, -1, encoding);
 }
 
-void tag_set_comment(char *comment, char encoding, ID3v2_tag *tag)
+void tag_set_album_artist(char *album_artist, char encoding, ID3v2_tag *tag)
 {
-    ID3v2_frame *comment_frame = NULL;
+    tag_set_text_frame(tag, ALBUM_ARTIST_FRAME_ID, album_artist, -1, encoding);
+}
 
-    if (!(comment_frame = tag_get_comment(tag))) {
-        comment_frame = new_frame();
-        add_to_list(tag->frames, comment_frame);
-    }
+void tag_set_genre(char *genre, char encoding, ID3v2_tag *tag)
+{
+    tag_set_text_frame(tag, GENRE_FRAME_ID, genre, -1, encoding);
+}
 
-    set_comment_frame(comment, encoding, comment_frame);
+void tag_set_track(char *track, char encoding, ID3v2_tag *tag)
+{
+    tag_set_text_frame(tag, TRACK_FRAME_ID, track, -1, encoding);
 }
 
-void tag_set_disc_number(char *disc_number, char encoding, ID3v2_tag *tag)
+void tag_set_year(char *year, char encoding, ID3v2_tag *tag)
 {
-    ID3v2_frame *disc_number_frame = NULL;
+    tag_set_text_frame(tag, YEAR_FRAME_ID, year, -1, encoding);
+}
 
-    if (!(disc_number_frame = tag_get_disc_number(tag))) {
-        disc_number_frame = new_frame();
-        add_to_list(tag->frames, disc_number_frame);
-    }
+void tag_set_comment(char *comment, char encoding, ID3v2_tag *tag)
+{
+    tag_set_text_frame(tag, COMMENT_FRAME_ID, comment, -1, encoding);
+}
 
-    set_text_frame(disc_number, encoding, DISC_NUMBER_FRAME_ID, disc_number_frame);
+void tag_set_disc_number(char *disc_number, char encoding, ID3v2_tag *tag)
+{
+    tag_set_text_frame(tag, DISC_NUMBER_FRAME_ID, disc_number, -1, encoding);
 }
 
 void tag_set_composer(char *composer, char encoding, ID3v2_tag *tag)
 {
-    ID3v2_frame *composer_frame = NULL;
+    tag_set_text_frame(tag, COMPOSER_FRAME_ID, composer, -1, encoding);
+}
 
-    if (!(composer_frame = tag_get_composer(tag))) {
-        composer_frame = new_frame();
-        add_to_list(tag->frames, composer_frame);
+// The picture is read straight into the frame. Returns 0 or -1 if it could not be read.
+int tag_set_album_cover_with_io(ID3v2_io *io, char *mimetype, ID3v2_tag *tag)
+{
+    ID3v2_frame *album_cover_frame;
+    long long image_size = io_size(io);
+    char *picture;
+
+    if (image_size < 0 || image_size > INT_MAX - 1024) return -1;
+
+    album_cover_frame = get_or_add_frame(tag, ALBUM_COVER_FRAME_ID);
+    picture = prepare_album_cover_frame(mimetype, (int) image_size, album_cover_frame);
+    if (!picture) return -1;
+
+    if (io_read_at(io, picture, (int) image_size, 0) != image_size) {
+        report_error("Error reading album cover");
+        return -1;
     }
 
-    set_text_frame(composer, encoding, COMPOSER_FRAME_ID, composer_frame);
+    return 0;
 }
 
 void tag_set_album_cover(const char *filename, ID3v2_tag *tag)
 {
-    FILE *album_cover = fopen(filename, "rb");
-    char *album_cover_bytes;
-    int image_size;
-    char *mimetype;
-
-    fseek(album_cover, 0, SEEK_END);
-    image_size = (int) ftell(album_cover);
-    fseek(album_cover, 0, SEEK_SET);
-
-    album_cover_bytes = malloc(image_size);
-    fread(album_cover_bytes, 1, image_size, album_cover);
-
-    fclose(album_cover);
+    ID3v2_io io;
 
-    mimetype = get_mime_type_from_filename(filename);
-    tag_set_album_cover_from_bytes(album_cover_bytes, mimetype, image_size, tag);
+    if (io_open_file(&io, filename, 0) != 0) {
+        report_error("Error opening file");
+        return;
+    }
 
-    free(album_cover_bytes);
+    tag_set_album_cover_with_io(&io, get_mime_type_from_filename(filename), tag);
+    io_close_file(&io);
 }
 
 void tag_set_album_cover_from_bytes(char *album_cover_bytes, char *mimetype, int picture_size, ID3v2_tag *tag)
 {
-    ID3v2_frame *album_cover_frame = NULL;
+    ID3v2_frame *album_cover_frame = get_or_add_frame(tag, ALBUM_COVER_FRAME_ID);
+
+    set_album_cover_frame(album_cover_bytes, mimetype, picture_size, album_cover_frame);
+}
 
-    if (!(album_cover_frame = tag_get_album_cover(tag))) {
-        album_cover_frame = new_frame();
-        add_to_list(tag->frames, album_cover_frame);
+// Store the payload of frame zlib compressed, set_tag() writes it that way and
+// reading its content inflates it again. Frames that would not get smaller are
+// left as they are. Returns 0, or -1 if the frame cannot be read or the library
+// was built without zlib.
+int tag_compress_frame(ID3v2_tag *tag, ID3v2_frame *frame)
+{
+    char *compressed;
+    int size;
+
+    convert_frame_to_v23(frame);
+    if (frame->version == ID3v23 && (frame->flags[1] & ID3_FRAME_FLAG_V23_COMPRESSION)) return 0;
+    if (!load_frame_data_in_arena(frame, tag->arena)) return -1;
+
+    compressed = compress_frame_payload(frame->data, frame->size, &size);
+    if (!compressed) return -1;
+    if (size >= frame->size) {
+        mem_free(compressed);
+        return 0;
     }
 
-    set_album_cover_frame(album_cover_bytes, mimetype, picture_size, album_cover_frame);
+    if (!arena_owns(tag->arena, frame->data) && !is_mapped(tag, frame->data)) mem_free(frame->data);
+    frame->data = compressed;
+    frame->source = NULL;
+    frame->size = size;
+    frame->version = ID3v23;
+    frame->flags[1] = ID3_FRAME_FLAG_V23_COMPRESSION;
+
+    return 0;
 }
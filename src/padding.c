@@ -0,0 +1,108 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#include <limits.h>
+#include <string.h>
+
+#include "constants.h"
+#include "padding.h"
+
+static ID3v2_padding_policy padding_policy = {
+    ID3_PADDING_DEFAULT_FIXED, ID3_PADDING_DEFAULT_PERCENT, ID3_PADDING_FS_BLOCK, 0
+};
+
+static ID3v2_write_stats write_stats;
+
+// The counters are bumped from any thread that writes tags
+#if defined(__GNUC__)
+#define STAT_ADD(field, value) __atomic_fetch_add(&write_stats.field, (value), __ATOMIC_RELAXED)
+#define STAT_GET(field) __atomic_load_n(&write_stats.field, __ATOMIC_RELAXED)
+#define STAT_RESET(field) __atomic_store_n(&write_stats.field, 0, __ATOMIC_RELAXED)
+#else
+#define STAT_ADD(field, value) (write_stats.field += (value))
+#define STAT_GET(field) (write_stats.field)
+#define STAT_RESET(field) (write_stats.field = 0)
+#endif
+
+// Not thread safe, set it before writing tags from other threads
+void set_padding_policy(const ID3v2_padding_policy *policy)
+{
+    padding_policy = *policy;
+}
+
+void get_padding_policy(ID3v2_padding_policy *policy)
+{
+    *policy = padding_policy;
+}
+
+// Padding for a tag whose frames take frames_size bytes. block_size is what
+// ID3_PADDING_FS_BLOCK stands for, 0 if unknown.
+int get_padding(const ID3v2_padding_policy *policy, int frames_size, int block_size)
+{
+    long long padding = policy->fixed + (long long) frames_size * policy->percent / 100;
+    long long total;
+    int block = policy->block_size == ID3_PADDING_FS_BLOCK ? block_size : policy->block_size;
+
+    if (padding < 0) padding = 0;
+    if (policy->max > 0 && padding > policy->max) padding = policy->max;
+
+    if (block > 0) {
+        total = ID3_HEADER + frames_size + padding;
+        padding += (block - total % block) % block;
+        // Rounding up must not go over the maximum either, give back a block
+        if (policy->max > 0 && padding > policy->max && padding >= block) padding -= block;
+    }
+
+    if (padding > INT_MAX - ID3_HEADER - frames_size) padding = INT_MAX - ID3_HEADER - frames_size;
+
+    return (int) padding;
+}
+
+void get_write_stats(ID3v2_write_stats *stats)
+{
+    stats->writes = STAT_GET(writes);
+    stats->in_place = STAT_GET(in_place);
+    stats->added = STAT_GET(added);
+    stats->grown = STAT_GET(grown);
+    stats->shrunk = STAT_GET(shrunk);
+    stats->failed = STAT_GET(failed);
+    stats->bytes_moved = STAT_GET(bytes_moved);
+}
+
+void reset_write_stats(void)
+{
+    STAT_RESET(writes);
+    STAT_RESET(in_place);
+    STAT_RESET(added);
+    STAT_RESET(grown);
+    STAT_RESET(shrunk);
+    STAT_RESET(failed);
+    STAT_RESET(bytes_moved);
+}
+
+// result of set_tag(), old_size of the tag it replaced and the distance the
+// audio was moved by
+void count_tag_write(int result, int old_size, long long distance, long long bytes_moved)
+{
+    STAT_ADD(writes, 1);
+
+    if (result == ID3_WRITE_FAILED) {
+        STAT_ADD(failed, 1);
+    } else if (result == ID3_WRITE_IN_PLACE) {
+        STAT_ADD(in_place, 1);
+    } else if (!old_size) {
+        STAT_ADD(added, 1);
+    } else if (distance > 0) {
+        STAT_ADD(grown, 1);
+    } else {
+        STAT_ADD(shrunk, 1);
+    }
+
+    STAT_ADD(bytes_moved, bytes_moved);
+}
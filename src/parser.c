@@ -0,0 +1,349 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "parser.h"
+#include "stats.h"
+#include "frame.h"
+#include "header.h"
+#include "unsync.h"
+
+// What the parser is reading
+#define STATE_HEADER 0		// the tag header into head
+#define STATE_FRAME_HEADER 1	// a frame header into head
+#define STATE_FRAME_DATA 2	// the payload of a frame into buffer
+#define STATE_DISCARD 3		// a frame (or the extended header) nobody asked for
+#define STATE_SKIP 4		// the padding and the footer, up to skip_to
+#define STATE_DONE 5
+
+ID3v2_parser *new_parser(ID3v2_frame_callback callback, void *user_data)
+{
+    ID3v2_parser *parser = mem_calloc(1, sizeof(ID3v2_parser));
+
+    if (!parser) return NULL;
+
+    parser->state = STATE_HEADER;
+    parser->wanted = ID3_HEADER;
+    parser->callback = callback;
+    parser->user_data = user_data;
+
+    return parser;
+}
+
+// Only the frames with these IDs reach the callback, the payload of the
+// others is skipped without being buffered. The IDs are not copied.
+void parser_select_frames(ID3v2_parser *parser, char **frame_ids, int count)
+{
+    parser->frame_ids = frame_ids;
+    parser->frame_count = count;
+}
+
+void free_parser(ID3v2_parser *parser)
+{
+    if (!parser) return;
+
+    mem_free(parser->buffer);
+    mem_free(parser);
+}
+
+// Stream bytes the parser needs before it can get any further. With an
+// unsynchronised tag this is a minimum, as some of them may be dropped.
+int parser_needed(ID3v2_parser *parser)
+{
+    switch (parser->state) {
+        case STATE_SKIP:
+            return (int) (parser->skip_to - parser->position);
+        case STATE_DONE:
+            return 0;
+        default:
+            return parser->wanted - parser->buffered;
+    }
+}
+
+static void finish(ID3v2_parser *parser, int status)
+{
+    parser->state = STATE_DONE;
+    parser->status = status;
+}
+
+// Skip what is left of the tag: the padding and the footer
+static void skip_to_end(ID3v2_parser *parser)
+{
+    parser->state = STATE_SKIP;
+    parser->skip_to = get_tag_total_size(&parser->tag_header);
+}
+
+static void next_frame(ID3v2_parser *parser)
+{
+    if (parser->frames_end - parser->position < parser->frame_header_size) {
+        skip_to_end(parser);
+        return;
+    }
+
+    parser->state = STATE_FRAME_HEADER;
+    parser->wanted = parser->frame_header_size;
+    parser->buffered = 0;
+}
+
+static int wants_frame(ID3v2_parser *parser, ID3v2_frame *frame)
+{
+    if (!parser->frame_ids) return 1;
+
+    for (int i = 0; i < parser->frame_count; i++) {
+        if (memcmp(parser->frame_ids[i], frame->frame_id, ID3_FRAME_ID) == 0) return 1;
+    }
+
+    return 0;
+}
+
+// Copy up to want bytes of the frames to dest, or drop them if dest is NULL,
+// reversing the unsynchronisation of the tag if there is one. Returns the
+// bytes produced, *used is set to the stream bytes consumed.
+static int read_frame_bytes(ID3v2_parser *parser, char *dest, int want, const char *bytes, int length, int *used)
+{
+    char scratch[4096];
+    int produced = 0;
+    int in = 0;
+    int n;
+
+    if (length > parser->frames_end - parser->position) {
+        length = (int) (parser->frames_end - parser->position);
+    }
+
+    if (!needs_tag_decoding(&parser->tag_header)) {
+        n = want < length ? want : length;
+        if (dest) {
+            count_copy(n);
+            memcpy(dest, bytes, n);
+        }
+        *used = n;
+        return n;
+    }
+
+    while (produced < want && in < length) {
+        if (parser->last_ff && bytes[in] == 0x00) {
+            // the $00 after a $FF that ended the previous chunk
+            in++;
+            parser->last_ff = 0;
+            continue;
+        }
+
+        n = want - produced < length - in ? want - produced : length - in;
+        if (!dest && n > (int) sizeof(scratch)) n = sizeof(scratch);
+
+        produced += decode_unsynchronisation(dest ? dest + produced : scratch, bytes + in, n);
+        parser->last_ff = bytes[in + n - 1] == (char) 0xFF;
+        in += n;
+    }
+
+    *used = in;
+    return produced;
+}
+
+// Each of the steps below consumes what it can of the length bytes and
+// moves parser->position past them
+
+static void read_header(ID3v2_parser *parser, const char *bytes, int length)
+{
+    int n = parser->wanted - parser->buffered;
+
+    if (n > length) n = length;
+    memcpy(parser->head + parser->buffered, bytes, n);
+    parser->buffered += n;
+    parser->position += n;
+    if (parser->buffered < parser->wanted) return;
+
+    if (!parse_tag_header(parser->head, parser->buffered, &parser->tag_header) ||
+        get_tag_orig_version(&parser->tag_header) == NO_COMPATIBLE_TAG) {
+        finish(parser, ID3_PARSE_NO_TAG);
+        return;
+    }
+
+    if ((parser->tag_header.flags & ID3_HEADER_FLAGS_HAS_EXTENDED_HEADER) &&
+        parser->wanted == ID3_HEADER) {
+        // the size of the extended header follows
+        parser->wanted += ID3_EXTENDED_HEADER_SIZE;
+        return;
+    }
+
+    parser->version = get_tag_orig_version(&parser->tag_header);
+    parser->frame_header_size = (parser->version == ID3v22) ? ID3_FRAME_v22 : ID3_FRAME;
+    parser->frames_end = ID3_HEADER + parser->tag_header.tag_size;
+
+    if (parser->tag_header.extended_header_size) {
+        // its size bytes have been read already
+        parser->state = STATE_DISCARD;
+        parser->wanted = parser->tag_header.extended_header_size;
+        parser->buffered = 0;
+    } else {
+        next_frame(parser);
+    }
+}
+
+static void deliver_frame(ID3v2_parser *parser, char *data)
+{
+    ID3v2_frame *frame = &parser->frame;
+    int encoded = is_frame_encoded(frame);
+    int stop;
+
+    frame->data = data;
+    if (encoded) {
+        // Decoded into a copy that lives as long as the callback, frames
+        // that cannot be decoded are skipped
+        frame->data = NULL;
+        frame->source = data;
+        if (!load_frame_data(frame)) {
+            frame->source = NULL;
+            next_frame(parser);
+            return;
+        }
+    }
+
+    stop = parser->callback && parser->callback(frame, parser->user_data) != 0;
+
+    if (encoded) {
+        mem_free(frame->data);
+        frame->data = NULL;
+        frame->source = NULL;
+    }
+
+    if (stop) {
+        finish(parser, ID3_PARSE_STOPPED);
+    } else {
+        next_frame(parser);
+    }
+}
+
+static void read_frame_header(ID3v2_parser *parser, const char *bytes, int length)
+{
+    int used;
+    ID3v2_frame *frame = &parser->frame;
+
+    parser->buffered += read_frame_bytes(parser, parser->head + parser->buffered,
+                                         parser->wanted - parser->buffered, bytes, length, &used);
+    parser->position += used;
+    if (parser->buffered < parser->wanted) {
+        if (parser->position >= parser->frames_end) skip_to_end(parser);
+        return;
+    }
+
+    if (!parse_frame_header(parser->head, 0, parser->version, frame) ||
+        frame->size < 0 || frame->size > parser->frames_end - parser->position) {
+        // padding, or a truncated or corrupt frame
+        skip_to_end(parser);
+        return;
+    }
+
+    frame->source = NULL;
+    parser->wanted = frame->size;
+    parser->buffered = 0;
+
+    if (!wants_frame(parser, frame)) {
+        parser->state = STATE_DISCARD;
+        return;
+    }
+
+    if (frame->size > parser->capacity) {
+        char *buffer = mem_realloc(parser->buffer, frame->size);
+        if (!buffer) {
+            finish(parser, ID3_PARSE_ERROR);
+            return;
+        }
+        parser->buffer = buffer;
+        parser->capacity = frame->size;
+    }
+
+    parser->state = STATE_FRAME_DATA;
+}
+
+static void read_frame_data(ID3v2_parser *parser, const char *bytes, int length)
+{
+    int used;
+
+    if (parser->buffered == 0 && parser->wanted <= length && !needs_tag_decoding(&parser->tag_header)) {
+        // the whole frame is in this chunk, no need to copy it
+        parser->position += parser->wanted;
+        deliver_frame(parser, (char *) bytes);
+        return;
+    }
+
+    parser->buffered += read_frame_bytes(parser, parser->buffer + parser->buffered,
+                                         parser->wanted - parser->buffered, bytes, length, &used);
+    parser->position += used;
+
+    if (parser->buffered == parser->wanted) {
+        deliver_frame(parser, parser->buffer);
+    } else if (parser->position >= parser->frames_end) {
+        // the frame shrank when its unsynchronisation was reversed
+        skip_to_end(parser);
+    }
+}
+
+static void discard(ID3v2_parser *parser, const char *bytes, int length)
+{
+    int used;
+
+    parser->buffered += read_frame_bytes(parser, NULL, parser->wanted - parser->buffered, bytes, length, &used);
+    parser->position += used;
+
+    if (parser->buffered == parser->wanted) {
+        next_frame(parser);
+    } else if (parser->position >= parser->frames_end) {
+        skip_to_end(parser);
+    }
+}
+
+static void skip(ID3v2_parser *parser, int length)
+{
+    long long n = parser->skip_to - parser->position;
+
+    if (n > length) n = length;
+    parser->position += n;
+    if (parser->position == parser->skip_to) finish(parser, ID3_PARSE_DONE);
+}
+
+// Push the next length bytes of the stream. Frames are handed to the callback
+// as soon as they are complete, only a frame that spans several chunks is
+// buffered. Returns ID3_PARSE_MORE until the end of the tag, see constants.h.
+int parser_feed(ID3v2_parser *parser, const char *bytes, int length)
+{
+    long long start;
+    int used;
+
+    while (parser->status == ID3_PARSE_MORE && (length > 0 || parser_needed(parser) == 0)) {
+        start = parser->position;
+
+        switch (parser->state) {
+            case STATE_HEADER:
+                read_header(parser, bytes, length);
+                break;
+            case STATE_FRAME_HEADER:
+                read_frame_header(parser, bytes, length);
+                break;
+            case STATE_FRAME_DATA:
+                read_frame_data(parser, bytes, length);
+                break;
+            case STATE_DISCARD:
+                discard(parser, bytes, length);
+                break;
+            default:
+                skip(parser, length);
+                break;
+        }
+
+        used = (int) (parser->position - start);
+        bytes += used;
+        length -= used;
+    }
+
+    return parser->status;
+}
@@ -0,0 +1,346 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "frame.h"
+#include "render.h"
+#include "stats.h"
+#include "text.h"
+#include "unsync.h"
+#include "utils.h"
+
+// Payloads smaller than this are copied next to their frame header rather
+// than getting an iovec of their own
+#define RENDER_COPY_LIMIT 4096
+
+// The longest rendered frame header: a v2.4 header and its data length indicator
+#define RENDER_FRAME_HEADER (ID3_FRAME + ID3_FRAME_DATA_LENGTH)
+
+// Tags are rendered as ID3v2.3, the way set_tag() writes them, or as ID3v2.4
+// when they hold text only ID3v2.4 can store (see is_v24_text_frame()) and
+// when they are appended to the file, with a footer. The frames themselves
+// are kept in the ID3v2.3 layout, see convert_frame_to_v23(). Rendering
+// converts frames read from ID3v2.4 tags, getting the size of the result
+// does not. ID3v2.4 tags are never unsynchronised.
+
+static void render_header(char *dest, const char *id, int v24, int footer, int unsynchronised, int tag_size)
+{
+    int size = syncint_encode(tag_size);
+
+    memcpy(dest, id, ID3_HEADER_TAG);
+    dest[3] = v24 ? '\x04' : '\x03';
+    dest[4] = '\x00';
+    dest[5] = footer ? ID3_HEADER_FLAGS_HAS_FOOTER : unsynchronised ? ID3_HEADER_FLAGS_HAS_UNSYNCHRONISATION : '\x00';
+    dest[6] = (char) (size >> 24);
+    dest[7] = (char) (size >> 16);
+    dest[8] = (char) (size >> 8);
+    dest[9] = (char) size;
+}
+
+static inline const char *get_payload(ID3v2_frame *frame)
+{
+    return frame->data ? frame->data : frame->source;
+}
+
+// The ID3v2.4 flags of a frame in the ID3v2.3 layout. The decompressed size
+// of a compressed frame becomes its data length indicator, in the same 4 bytes.
+static void render_v24_flags(char *dest, ID3v2_frame *frame)
+{
+    int flags = (unsigned char) frame->flags[1];
+
+    dest[8] = (char) (((unsigned char) frame->flags[0] >> 1) & 0x70);
+    dest[9] = 0;
+    if (flags & ID3_FRAME_FLAG_V23_GROUPING) dest[9] |= ID3_FRAME_FLAG_V24_GROUPING;
+    if (flags & ID3_FRAME_FLAG_V23_ENCRYPTION) dest[9] |= ID3_FRAME_FLAG_V24_ENCRYPTION;
+    if ((flags & ID3_FRAME_FLAG_V23_COMPRESSION) && frame->size >= ID3_FRAME_DATA_LENGTH) {
+        int length = syncint_encode(btoi(get_payload(frame), ID3_FRAME_DATA_LENGTH, 0));
+
+        dest[9] |= ID3_FRAME_FLAG_V24_COMPRESSION | ID3_FRAME_FLAG_V24_DATA_LENGTH;
+        dest[10] = (char) (length >> 24);
+        dest[11] = (char) (length >> 16);
+        dest[12] = (char) (length >> 8);
+        dest[13] = (char) length;
+    }
+}
+
+// Returns the length of the header, which may stand in for the first
+// payload bytes (RENDER_FRAME_HEADER at most)
+static int render_frame_header(char *dest, ID3v2_frame *frame, int v24)
+{
+    int size = v24 ? syncint_encode(frame->size) : frame->size;
+
+    memcpy(dest, frame->frame_id, ID3_FRAME_ID);
+    dest[4] = (char) (size >> 24);
+    dest[5] = (char) (size >> 16);
+    dest[6] = (char) (size >> 8);
+    dest[7] = (char) size;
+
+    if (!v24 || frame->version == ID3v24) {
+        // frames still in the ID3v2.4 layout (encrypted ones) are written as they are
+        memcpy(dest + 8, frame->flags, ID3_FRAME_FLAGS);
+        return ID3_FRAME;
+    }
+
+    render_v24_flags(dest, frame);
+    return (dest[9] & ID3_FRAME_FLAG_V24_DATA_LENGTH) ? RENDER_FRAME_HEADER : ID3_FRAME;
+}
+
+// Append the unsynchronisation of size bytes at src to the *written bytes
+// at dest, or only count them if dest is NULL. The encoder puts a $00 after
+// a $FF that ends its input, which has to go again when the next bytes do
+// not start with $00 or $E0-$FF.
+static void unsynchronise_piece(char *dest, int *written, int *ends_with_ff, const char *src, int size)
+{
+    if (!size) return;
+
+    if (*ends_with_ff && src[0] != 0x00 && (unsigned char) src[0] < 0xE0) (*written)--;
+    if (dest) {
+        count_copy(size);
+        *written += encode_unsynchronisation(dest + *written, src, size);
+    } else {
+        *written += get_unsynchronised_size(src, size);
+    }
+    *ends_with_ff = src[size - 1] == (char) 0xFF;
+}
+
+// Render the frames to dest, or only count their size if dest is NULL
+static int render_frames(ID3v2_tag *tag, char *dest, int v24)
+{
+    char header[RENDER_FRAME_HEADER];
+    int written = 0;
+    int ends_with_ff = 0;
+
+    if (!tag->frames) return 0;
+
+    for (int i = 0; i < tag->frames->count; i++) {
+        ID3v2_frame converted;
+        ID3v2_frame *frame = &converted;
+        char *payload = get_v23_frame(tag->frames->frames[i], &converted);
+        int header_size;
+
+        if (!v24 && tag->tag_header->unsynchronised) {
+            render_frame_header(header, frame, 0);
+            unsynchronise_piece(dest, &written, &ends_with_ff, header, ID3_FRAME);
+            unsynchronise_piece(dest, &written, &ends_with_ff, get_payload(frame), frame->size);
+        } else {
+            if (dest) {
+                header_size = render_frame_header(dest + written, frame, v24);
+                count_copy(frame->size - (header_size - ID3_FRAME));
+                memcpy(dest + written + header_size, get_payload(frame) + header_size - ID3_FRAME,
+                       frame->size - (header_size - ID3_FRAME));
+            }
+            written += ID3_FRAME + frame->size;
+        }
+
+        mem_free(payload);
+    }
+
+    return written;
+}
+
+// Frames read from ID3v2.4 tags are given the ID3v2.3 layout before they are
+// rendered, so that the payload of each is converted only once
+static void convert_frames(ID3v2_tag *tag)
+{
+    if (!tag->frames) return;
+
+    for (int i = 0; i < tag->frames->count; i++) convert_frame_to_v23(tag->frames->frames[i]);
+}
+
+static int get_frames_size(ID3v2_tag *tag, int v24)
+{
+    return render_frames(tag, NULL, v24);
+}
+
+static int needs_v24(ID3v2_tag *tag)
+{
+    if (!tag->frames) return 0;
+
+    for (int i = 0; i < tag->frames->count; i++) {
+        if (is_v24_text_frame(tag->frames->frames[i])) return 1;
+    }
+
+    return 0;
+}
+
+// The version render_tag() writes the tag as, ID3v23 or ID3v24
+int get_rendered_tag_version(ID3v2_tag *tag)
+{
+    return needs_v24(tag) ? ID3v24 : ID3v23;
+}
+
+// Bytes the frames take in the rendered tag, unsynchronisation included
+int get_rendered_frames_size(ID3v2_tag *tag)
+{
+    return get_frames_size(tag, needs_v24(tag));
+}
+
+// Exact size of the tag render_tag() writes: header, frames and padding
+int get_rendered_tag_size(ID3v2_tag *tag, int padding)
+{
+    return ID3_HEADER + get_rendered_frames_size(tag) + padding;
+}
+
+// Exact size of the tag render_appended_tag() writes: header, frames and footer
+int get_rendered_appended_tag_size(ID3v2_tag *tag)
+{
+    return ID3_HEADER + get_frames_size(tag, 1) + ID3_FOOTER;
+}
+
+static int render(ID3v2_tag *tag, int padding, int appended, char *buffer, int size)
+{
+    int v24, unsynchronised, frames_size, tag_size;
+
+    convert_frames(tag);
+    v24 = appended || needs_v24(tag);
+    unsynchronised = !v24 && tag->tag_header->unsynchronised;
+    frames_size = get_frames_size(tag, v24);
+    tag_size = ID3_HEADER + frames_size + padding + (appended ? ID3_FOOTER : 0);
+    if (padding < 0 || size < tag_size) return -1;
+
+    render_header(buffer, "ID3", v24, appended, unsynchronised, frames_size + padding);
+    render_frames(tag, buffer + ID3_HEADER, v24);
+    memset(buffer + ID3_HEADER + frames_size, 0, padding);
+    if (appended) render_header(buffer + ID3_HEADER + frames_size, "3DI", 1, 1, 0, frames_size);
+
+    return tag_size;
+}
+
+// Render the whole tag into buffer, followed by padding zero bytes. Returns
+// the number of bytes written, -1 if they do not fit in size.
+int render_tag(ID3v2_tag *tag, int padding, char *buffer, int size)
+{
+    long long start = start_phase();
+    int result = render(tag, padding, 0, buffer, size);
+
+    end_phase(ID3_PHASE_RENDER, start);
+    return result;
+}
+
+// Render the tag as ID3v2.4 with a footer, the way set_tag_append() writes
+// it. There is no padding, a tag with a footer may not have any.
+int render_appended_tag(ID3v2_tag *tag, char *buffer, int size)
+{
+    long long start = start_phase();
+    int result = render(tag, 0, 1, buffer, size);
+
+    end_phase(ID3_PHASE_RENDER, start);
+    return result;
+}
+
+static void add_iovec(ID3v2_rendered_tag *rendered, const char *base, int size)
+{
+    if (!size) return;
+
+    rendered->iov[rendered->count].iov_base = (void *) base;
+    rendered->iov[rendered->count].iov_len = (size_t) size;
+    rendered->count++;
+    rendered->size += size;
+}
+
+static int render_iovec(ID3v2_tag *tag, int padding, int appended, ID3v2_rendered_tag *rendered)
+{
+    int count = tag->frames ? tag->frames->count : 0;
+    int copied = ID3_HEADER + padding + (appended ? ID3_FOOTER : 0);
+    int v24, unsynchronised, max_iovecs, frames_size;
+    char *storage, *segment, *position;
+
+    memset(rendered, 0, sizeof(ID3v2_rendered_tag));
+    if (padding < 0) return -1;
+
+    // The payloads are referenced, so the frames have to be converted in the tag
+    convert_frames(tag);
+    v24 = appended || needs_v24(tag);
+    unsynchronised = !v24 && tag->tag_header->unsynchronised;
+    max_iovecs = unsynchronised ? 1 : 2 * count + 1;
+    frames_size = get_frames_size(tag, v24);
+
+    if (unsynchronised) {
+        copied += frames_size;
+    } else {
+        for (int i = 0; i < count; i++) {
+            int size = tag->frames->frames[i]->size;
+            copied += RENDER_FRAME_HEADER + (size < RENDER_COPY_LIMIT ? size : 0);
+        }
+    }
+
+    rendered->iov = mem_alloc(max_iovecs * sizeof(ID3v2_iovec) + copied);
+    if (!rendered->iov) return -1;
+    storage = (char *) (rendered->iov + max_iovecs);
+
+    if (unsynchronised) {
+        add_iovec(rendered, storage, render(tag, padding, 0, storage, copied));
+        return 0;
+    }
+
+    render_header(storage, "ID3", v24, appended, 0, frames_size + padding);
+    segment = storage;
+    position = storage + ID3_HEADER;
+
+    for (int i = 0; i < count; i++) {
+        ID3v2_frame *frame = tag->frames->frames[i];
+        int header_size = render_frame_header(position, frame, v24);
+        const char *payload = get_payload(frame) + header_size - ID3_FRAME;
+        int payload_size = frame->size - (header_size - ID3_FRAME);
+
+        position += header_size;
+
+        if (frame->size < RENDER_COPY_LIMIT) {
+            count_copy(payload_size);
+            memcpy(position, payload, payload_size);
+            position += payload_size;
+        } else {
+            add_iovec(rendered, segment, (int) (position - segment));
+            add_iovec(rendered, payload, payload_size);
+            segment = position;
+        }
+    }
+
+    memset(position, 0, padding);
+    position += padding;
+    if (appended) {
+        render_header(position, "3DI", 1, 1, 0, frames_size);
+        position += ID3_FOOTER;
+    }
+    add_iovec(rendered, segment, (int) (position - segment));
+
+    return 0;
+}
+
+// Render the tag as a list of buffers for one gathered write. Headers, small
+// frames and padding are copied into one block, bigger payloads are only
+// referenced and must stay in place until the rendered tag is freed.
+// Unsynchronised tags are copied as a whole. Returns 0 or -1.
+int render_tag_iovec(ID3v2_tag *tag, int padding, ID3v2_rendered_tag *rendered)
+{
+    long long start = start_phase();
+    int result = render_iovec(tag, padding, 0, rendered);
+
+    end_phase(ID3_PHASE_RENDER, start);
+    return result;
+}
+
+// The same for render_appended_tag()
+int render_appended_tag_iovec(ID3v2_tag *tag, ID3v2_rendered_tag *rendered)
+{
+    long long start = start_phase();
+    int result = render_iovec(tag, 0, 1, rendered);
+
+    end_phase(ID3_PHASE_RENDER, start);
+    return result;
+}
+
+void free_rendered_tag(ID3v2_rendered_tag *rendered)
+{
+    mem_free(rendered->iov);
+    memset(rendered, 0, sizeof(ID3v2_rendered_tag));
+}
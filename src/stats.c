@@ -0,0 +1,127 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "constants.h"
+#include "stats.h"
+
+// Every thread counts into its own copy, so counting needs no atomics
+#if defined(__GNUC__)
+#define THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL
+#endif
+
+static int stats_enabled;
+static THREAD_LOCAL ID3v2_stats thread_stats;
+
+static const char *phase_names[ID3_PHASES] = { "header", "frames", "content", "render", "shift" };
+
+// Not thread safe either, the counters of a thread may miss what it was
+// doing while this changes
+void set_stats_enabled(int enabled)
+{
+    stats_enabled = enabled;
+}
+
+int get_stats_enabled(void)
+{
+    return stats_enabled;
+}
+
+void get_thread_stats(ID3v2_stats *stats)
+{
+    *stats = thread_stats;
+}
+
+void reset_thread_stats(void)
+{
+    memset(&thread_stats, 0, sizeof(thread_stats));
+}
+
+const char *get_phase_name(int phase)
+{
+    if (phase < 0 || phase >= ID3_PHASES) return NULL;
+
+    return phase_names[phase];
+}
+
+void count_allocation(long long size)
+{
+    if (!stats_enabled) return;
+
+    thread_stats.allocations++;
+    thread_stats.bytes_allocated += size;
+}
+
+void count_free(void)
+{
+    if (stats_enabled) thread_stats.frees++;
+}
+
+void count_copy(long long size)
+{
+    if (stats_enabled) thread_stats.bytes_copied += size;
+}
+
+void count_read(long long size)
+{
+    if (stats_enabled && size > 0) thread_stats.bytes_read += size;
+}
+
+void count_written(long long size)
+{
+    if (stats_enabled && size > 0) thread_stats.bytes_written += size;
+}
+
+void count_moved(long long size)
+{
+    if (stats_enabled && size > 0) thread_stats.bytes_moved += size;
+}
+
+void count_syscalls(int count)
+{
+    if (stats_enabled) thread_stats.syscalls += count;
+}
+
+static long long now_ns(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (long long) (counter.QuadPart * 1e9 / frequency.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+// What to hand to end_phase(), 0 when not counting so the clock is only
+// read when someone looks at the numbers
+long long start_phase(void)
+{
+    return stats_enabled ? now_ns() : 0;
+}
+
+void end_phase(int phase, long long start)
+{
+    if (stats_enabled && start) thread_stats.phase_ns[phase] += now_ns() - start;
+}
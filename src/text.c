@@ -0,0 +1,785 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#include <limits.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+
+#if HAVE_SSE2 && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#define HAVE_SSSE3 1
+#endif
+
+#include "alloc.h"
+#include "arena.h"
+#include "constants.h"
+#include "frame.h"
+#include "stats.h"
+#include "text.h"
+
+/**
+ * Text is converted to UTF-8 straight from the frame payload. Latin-1 takes
+ * two bytes per character above $7F, UTF-16 up to three per code unit (four
+ * per surrogate pair) and invalid UTF-8 bytes are taken as Latin-1, so the
+ * UTF-8 is never more than twice the size of the text.
+ *
+ * The SIMD kernels copy runs of ASCII as they are and turn 8 Latin-1 bytes or
+ * UTF-16 code units below $800 into UTF-8 with a single shuffle. The scalar
+ * code handles the rest: byte order marks, surrogates and UTF-8 sequences.
+ *
+ * The other way, UTF-8 is encoded as Latin-1 ('?' for what it cannot hold)
+ * or UTF-16 with runs of ASCII widened 16 bytes at a time. The size is always
+ * counted first, so frame payloads take a single allocation of the right size.
+ */
+
+// UTF-16 without a byte order mark is taken as little endian, as most
+// ID3v2.3 writers without one meant it
+#define UTF16_DEFAULT_BIG_ENDIAN 0
+
+#define REPLACEMENT_CHARACTER 0xFFFD
+
+static inline int lowest_bit(unsigned int mask)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    int bit = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+// Append code point as UTF-8, or only count it if *dest is NULL
+static inline void put_code_point(char **dest, int *size, unsigned int code_point)
+{
+    char bytes[4];
+    int length;
+
+    if (code_point < 0x80) {
+        bytes[0] = (char) code_point;
+        length = 1;
+    } else if (code_point < 0x800) {
+        bytes[0] = (char) (0xC0 | (code_point >> 6));
+        bytes[1] = (char) (0x80 | (code_point & 0x3F));
+        length = 2;
+    } else if (code_point < 0x10000) {
+        bytes[0] = (char) (0xE0 | (code_point >> 12));
+        bytes[1] = (char) (0x80 | ((code_point >> 6) & 0x3F));
+        bytes[2] = (char) (0x80 | (code_point & 0x3F));
+        length = 3;
+    } else {
+        bytes[0] = (char) (0xF0 | (code_point >> 18));
+        bytes[1] = (char) (0x80 | ((code_point >> 12) & 0x3F));
+        bytes[2] = (char) (0x80 | ((code_point >> 6) & 0x3F));
+        bytes[3] = (char) (0x80 | (code_point & 0x3F));
+        length = 4;
+    }
+
+    if (*dest) {
+        memcpy(*dest, bytes, length);
+        *dest += length;
+    }
+    *size += length;
+}
+
+// Copy ASCII while a full vector fits, stops at the first byte above $7F
+#if HAVE_SSE2
+static void copy_ascii_sse2(char **dest, const char **src, const char *end, int *size)
+{
+    while (end - *src >= 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *) *src);
+        unsigned int high = _mm_movemask_epi8(bytes);
+        int run = high ? lowest_bit(high) : 16;
+
+        if (*dest) {
+            if (!high) {
+                _mm_storeu_si128((__m128i *) *dest, bytes);
+            } else {
+                memcpy(*dest, *src, run);
+            }
+            *dest += run;
+        }
+        *size += run;
+        *src += run;
+        if (high) return;
+    }
+}
+
+static inline __m128i load_units(const char *src, int big_endian)
+{
+    __m128i units = _mm_loadu_si128((const __m128i *) src);
+
+    if (big_endian) units = _mm_or_si128(_mm_slli_epi16(units, 8), _mm_srli_epi16(units, 8));
+    return units;
+}
+
+// Convert ASCII UTF-16 while a full vector fits, stops at the first vector
+// holding anything else
+static void copy_ascii_units_sse2(char **dest, const char **src, const char *end, int big_endian, int *size)
+{
+    const __m128i high_bits = _mm_set1_epi16((short) 0xFF80);
+    const __m128i zero = _mm_setzero_si128();
+
+    while (end - *src >= 16) {
+        __m128i units = load_units(*src, big_endian);
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, high_bits), zero)) != 0xFFFF) return;
+
+        if (*dest) {
+            _mm_storel_epi64((__m128i *) *dest, _mm_packus_epi16(units, units));
+            *dest += 8;
+        }
+        *size += 8;
+        *src += 16;
+    }
+}
+#endif
+
+#if HAVE_SSSE3
+// For the 8 code units below $800 of encode_units_ssse3(), indexed by the
+// units that need a second byte: where each output byte comes from in the
+// lead/continuation pairs, and how many bytes there are
+static unsigned char shuffles[256][16];
+static unsigned char shuffle_lengths[256];
+
+__attribute__((constructor))
+static void init_shuffles(void)
+{
+    for (int mask = 0; mask < 256; mask++) {
+        int length = 0;
+
+        memset(shuffles[mask], 0x80, 16);
+        for (int i = 0; i < 8; i++) {
+            shuffles[mask][length++] = (unsigned char) (2 * i);
+            if (mask & (1 << i)) shuffles[mask][length++] = (unsigned char) (2 * i + 1);
+        }
+        shuffle_lengths[mask] = (unsigned char) length;
+    }
+}
+
+static int has_ssse3(void)
+{
+    static int supported = -1;
+    if (supported < 0) supported = __builtin_cpu_supports("ssse3") ? 1 : 0;
+    return supported;
+}
+
+// UTF-8 of 8 code units below $800, 8 to 16 bytes. Every unit gets a lead
+// and a continuation byte, the shuffle drops the continuation bytes of the
+// ASCII ones. Only the UTF-8 bytes are written, dest may end before limit.
+__attribute__((target("ssse3")))
+static inline int encode_units_ssse3(char *dest, char *limit, __m128i units)
+{
+    __m128i wide = _mm_cmpgt_epi16(units, _mm_set1_epi16(0x7F));
+    __m128i lead = _mm_or_si128(_mm_andnot_si128(wide, units),
+                                _mm_and_si128(wide, _mm_or_si128(_mm_srli_epi16(units, 6), _mm_set1_epi16(0xC0))));
+    __m128i cont = _mm_or_si128(_mm_and_si128(units, _mm_set1_epi16(0x3F)), _mm_set1_epi16(0x80));
+    int mask = _mm_movemask_epi8(_mm_packs_epi16(wide, _mm_setzero_si128())) & 0xFF;
+    __m128i bytes = _mm_shuffle_epi8(_mm_or_si128(lead, _mm_slli_epi16(cont, 8)),
+                                     _mm_loadu_si128((const __m128i *) shuffles[mask]));
+    int length = shuffle_lengths[mask];
+
+    if (dest && limit - dest >= 16) {
+        _mm_storeu_si128((__m128i *) dest, bytes);
+    } else if (dest) {
+        char last[16];
+        _mm_storeu_si128((__m128i *) last, bytes);
+        memcpy(dest, last, length);
+    }
+
+    return length;
+}
+
+__attribute__((target("ssse3")))
+static void latin1_ssse3(char **dest, char *limit, const char **src, const char *end, int *size)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    while (end - *src >= 8) {
+        int length;
+
+        if (end - *src >= 16) {
+            __m128i bytes = _mm_loadu_si128((const __m128i *) *src);
+
+            if (!_mm_movemask_epi8(bytes)) {
+                if (*dest) {
+                    _mm_storeu_si128((__m128i *) *dest, bytes);
+                    *dest += 16;
+                }
+                *size += 16;
+                *src += 16;
+                continue;
+            }
+        }
+
+        length = encode_units_ssse3(*dest, limit, _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) *src), zero));
+        if (*dest) *dest += length;
+        *size += length;
+        *src += 8;
+    }
+}
+
+// Convert UTF-16 while a full vector fits, stops at the first vector holding
+// a unit from $800 up (byte order marks and surrogates included)
+__attribute__((target("ssse3")))
+static void units_ssse3(char **dest, char *limit, const char **src, const char *end, int big_endian, int *size)
+{
+    const __m128i high_bits = _mm_set1_epi16((short) 0xF800);
+    const __m128i zero = _mm_setzero_si128();
+
+    while (end - *src >= 16) {
+        __m128i units = load_units(*src, big_endian);
+        int length;
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, high_bits), zero)) != 0xFFFF) return;
+
+        length = encode_units_ssse3(*dest, limit, units);
+        if (*dest) *dest += length;
+        *size += length;
+        *src += 16;
+    }
+}
+#endif
+
+static int latin1_to_utf8(char *dest, char *limit, const char *src, const char *end)
+{
+    int size = 0;
+
+    while (src < end) {
+#if HAVE_SSSE3
+        if (has_ssse3()) {
+            latin1_ssse3(&dest, limit, &src, end, &size);
+        } else
+#endif
+        {
+#if HAVE_SSE2
+            copy_ascii_sse2(&dest, &src, end, &size);
+#endif
+        }
+        if (src == end) break;
+
+        put_code_point(&dest, &size, (unsigned char) *src++);
+    }
+
+    return size;
+}
+
+// Length of the valid UTF-8 sequence at src, 0 if there is none
+static int get_sequence_length(const unsigned char *src, const unsigned char *end)
+{
+    int length = src[0] >= 0xF0 ? 4 : src[0] >= 0xE0 ? 3 : 2;
+    unsigned char min = 0x80, max = 0xBF;
+
+    if (src[0] < 0xC2 || src[0] > 0xF4 || end - src < length) return 0;
+
+    // No overlong forms, surrogates or code points above $10FFFF
+    if (src[0] == 0xE0) min = 0xA0;
+    if (src[0] == 0xED) max = 0x9F;
+    if (src[0] == 0xF0) min = 0x90;
+    if (src[0] == 0xF4) max = 0x8F;
+    if (src[1] < min || src[1] > max) return 0;
+
+    for (int i = 2; i < length; i++) {
+        if ((src[i] & 0xC0) != 0x80) return 0;
+    }
+
+    return length;
+}
+
+static int utf8_to_utf8(char *dest, const char *src, const char *end)
+{
+    const char *begin = src;
+    int size = 0;
+
+    while (src < end) {
+        const unsigned char *bytes;
+        int length;
+
+#if HAVE_SSE2
+        copy_ascii_sse2(&dest, &src, end, &size);
+        if (src == end) break;
+#endif
+        bytes = (const unsigned char *) src;
+        if (bytes[0] < 0x80) {
+            put_code_point(&dest, &size, bytes[0]);
+            src++;
+            continue;
+        }
+
+        length = get_sequence_length(bytes, (const unsigned char *) end);
+        if (length == 3 && bytes[0] == 0xEF && bytes[1] == 0xBB && bytes[2] == 0xBF &&
+            (src == begin || src[-1] == '\0')) {
+            src += length;	// a byte order mark starting a value
+            continue;
+        }
+
+        if (length) {
+            if (dest) {
+                memcpy(dest, src, length);
+                dest += length;
+            }
+            size += length;
+        } else {
+            put_code_point(&dest, &size, bytes[0]);
+            length = 1;
+        }
+        src += length;
+    }
+
+    return size;
+}
+
+static inline unsigned int read_unit(const char *src, int big_endian)
+{
+    const unsigned char *bytes = (const unsigned char *) src;
+
+    return big_endian ? (unsigned int) (bytes[0] << 8 | bytes[1]) : (unsigned int) (bytes[1] << 8 | bytes[0]);
+}
+
+// Every value of a list may start with its own byte order mark
+static int utf16_to_utf8(char *dest, char *limit, const char *src, const char *end, int big_endian)
+{
+    const char *begin = src;
+    int size = 0;
+
+    end = src + ((end - src) & ~1);	// a lone last byte is left out
+    while (src < end) {
+        unsigned int unit, next;
+
+#if HAVE_SSSE3
+        if (has_ssse3()) {
+            units_ssse3(&dest, limit, &src, end, big_endian, &size);
+        } else
+#endif
+        {
+#if HAVE_SSE2
+            copy_ascii_units_sse2(&dest, &src, end, big_endian, &size);
+#endif
+        }
+        if (src == end) break;
+
+        unit = read_unit(src, big_endian);
+        if ((unit == 0xFEFF || unit == 0xFFFE) && (src == begin || read_unit(src - 2, 0) == 0)) {
+            if (unit == 0xFFFE) big_endian = !big_endian;
+            src += 2;
+            continue;
+        }
+        src += 2;
+
+        if (unit >= 0xD800 && unit < 0xDC00 && end - src >= 2 &&
+            (next = read_unit(src, big_endian)) >= 0xDC00 && next < 0xE000) {
+            unit = 0x10000 + ((unit - 0xD800) << 10) + (next - 0xDC00);
+            src += 2;
+        } else if (unit >= 0xD800 && unit < 0xE000) {
+            unit = REPLACEMENT_CHARACTER;
+        }
+        put_code_point(&dest, &size, unit);
+    }
+
+    return size;
+}
+
+// With dest NULL only the size is counted
+static int convert(char *dest, char *limit, const char *src, int size, int encoding)
+{
+    const char *end = src + size;
+
+    switch (encoding) {
+        case ID3_TEXT_ENCODING_ISO:
+            return latin1_to_utf8(dest, limit, src, end);
+        case ID3_TEXT_ENCODING_UTF16_WITH_BOM:
+            return utf16_to_utf8(dest, limit, src, end, UTF16_DEFAULT_BIG_ENDIAN);
+        case ID3_TEXT_ENCODING_UTF16BE_WITHOUT_BOM:
+            return utf16_to_utf8(dest, limit, src, end, 1);
+        case ID3_TEXT_ENCODING_UTF8:
+            return utf8_to_utf8(dest, src, end);
+        default:
+            return -1;
+    }
+}
+
+// Bytes text_to_utf8() writes for size bytes of text, -1 if the encoding is
+// not an ID3_TEXT_ENCODING_*
+int get_utf8_size(const char *src, int size, int encoding)
+{
+    if (size < 0) return -1;
+
+    return convert(NULL, NULL, src, size, encoding);
+}
+
+// Convert size bytes of text in the given ID3_TEXT_ENCODING_* to UTF-8. Zero
+// bytes (zero code units) are kept as they are, byte order marks starting a
+// value are dropped and anything invalid is replaced. Nothing is allocated
+// and dest is not NUL terminated. Returns the number of bytes written, or
+// -1 if they do not fit in dest_size or the encoding is unknown. Twice the
+// size of the text always fits.
+int text_to_utf8(char *dest, int dest_size, const char *src, int size, int encoding)
+{
+    int written;
+
+    if (size < 0 || encoding < ID3_TEXT_ENCODING_ISO || encoding > ID3_TEXT_ENCODING_UTF8) return -1;
+
+    // Anything smaller than the worst case is only written once known to fit
+    if (dest_size < 2 * (long long) size && get_utf8_size(src, size, encoding) > dest_size) return -1;
+
+    written = convert(dest, dest + dest_size, src, size, encoding);
+    count_copy(written);
+
+    return written;
+}
+
+// Append code point as Latin-1 ('?' if it is not one) or UTF-16, or only
+// count it if *dest is NULL
+static inline void put_encoded(char **dest, int *size, unsigned int code_point, int encoding)
+{
+    unsigned int units[2] = { code_point, 0 };
+    int big_endian = encoding == ID3_TEXT_ENCODING_UTF16BE_WITHOUT_BOM;
+    int length = 2;
+
+    if (encoding == ID3_TEXT_ENCODING_ISO) {
+        if (*dest) *(*dest)++ = code_point < 0x100 ? (char) code_point : '?';
+        *size += 1;
+        return;
+    }
+
+    if (code_point >= 0x10000) {
+        units[0] = 0xD800 + ((code_point - 0x10000) >> 10);
+        units[1] = 0xDC00 + ((code_point - 0x10000) & 0x3FF);
+        length = 4;
+    }
+
+    if (*dest) {
+        for (int i = 0; i < length / 2; i++) {
+            (*dest)[2 * i + big_endian] = (char) units[i];
+            (*dest)[2 * i + !big_endian] = (char) (units[i] >> 8);
+        }
+        *dest += length;
+    }
+    *size += length;
+}
+
+#if HAVE_SSE2
+// Widen ASCII to UTF-16 while a full vector fits, stops at the first vector
+// holding a byte above $7F or a zero byte, which may start a new value
+static void widen_ascii_sse2(char **dest, const char **src, const char *end, int big_endian, int *size)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    while (end - *src >= 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *) *src);
+
+        if (_mm_movemask_epi8(bytes) || _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, zero))) return;
+
+        if (*dest) {
+            _mm_storeu_si128((__m128i *) *dest, big_endian ? _mm_unpacklo_epi8(zero, bytes) : _mm_unpacklo_epi8(bytes, zero));
+            _mm_storeu_si128((__m128i *) (*dest + 16), big_endian ? _mm_unpackhi_epi8(zero, bytes) : _mm_unpackhi_epi8(bytes, zero));
+            *dest += 32;
+        }
+        *size += 32;
+        *src += 16;
+    }
+}
+#endif
+
+// UTF-8 to Latin-1 or UTF-16, invalid bytes are taken as Latin-1. A byte
+// order mark starting a value is dropped, and UTF-16 with a BOM gets its own
+// one in front of every value.
+static int utf8_to_encoding(char *dest, const char *src, const char *end, int encoding)
+{
+    const char *begin = src;
+    int size = 0;
+
+    while (src < end) {
+        const unsigned char *bytes;
+        unsigned int code_point;
+        int length;
+
+        if (encoding == ID3_TEXT_ENCODING_UTF16_WITH_BOM && (src == begin || src[-1] == '\0')) {
+            if (dest) {
+                memcpy(dest, "\xFF\xFE", 2);
+                dest += 2;
+            }
+            size += 2;
+        }
+
+#if HAVE_SSE2
+        if (encoding == ID3_TEXT_ENCODING_ISO) {
+            copy_ascii_sse2(&dest, &src, end, &size);
+        } else {
+            widen_ascii_sse2(&dest, &src, end, encoding == ID3_TEXT_ENCODING_UTF16BE_WITHOUT_BOM, &size);
+        }
+        if (src == end) break;
+#endif
+
+        if ((src == begin || src[-1] == '\0') && end - src >= 3 && memcmp(src, "\xEF\xBB\xBF", 3) == 0) {
+            src += 3;
+            continue;
+        }
+
+        bytes = (const unsigned char *) src;
+        length = bytes[0] < 0x80 ? 1 : get_sequence_length(bytes, (const unsigned char *) end);
+        switch (length) {
+            case 2:
+                code_point = (bytes[0] & 0x1F) << 6 | (bytes[1] & 0x3F);
+                break;
+            case 3:
+                code_point = (bytes[0] & 0x0F) << 12 | (bytes[1] & 0x3F) << 6 | (bytes[2] & 0x3F);
+                break;
+            case 4:
+                code_point = (bytes[0] & 0x07) << 18 | (bytes[1] & 0x3F) << 12 | (bytes[2] & 0x3F) << 6 |
+                             (bytes[3] & 0x3F);
+                break;
+            default:
+                code_point = bytes[0];
+                length = 1;
+                break;
+        }
+
+        put_encoded(&dest, &size, code_point, encoding);
+        src += length;
+    }
+
+    return size;
+}
+
+// With dest NULL only the size is counted
+static int encode(char *dest, const char *src, int size, int encoding)
+{
+    switch (encoding) {
+        case ID3_TEXT_ENCODING_ISO:
+        case ID3_TEXT_ENCODING_UTF16_WITH_BOM:
+        case ID3_TEXT_ENCODING_UTF16BE_WITHOUT_BOM:
+            return utf8_to_encoding(dest, src, src + size, encoding);
+        case ID3_TEXT_ENCODING_UTF8:
+            return utf8_to_utf8(dest, src, src + size);
+        default:
+            return -1;
+    }
+}
+
+// Bytes utf8_to_text() writes for size bytes of UTF-8, -1 if the encoding
+// is not an ID3_TEXT_ENCODING_*
+int get_encoded_text_size(const char *src, int size, int encoding)
+{
+    if (size < 0) return -1;
+
+    return encode(NULL, src, size, encoding);
+}
+
+// Convert size bytes of UTF-8 to the given ID3_TEXT_ENCODING_*, the other
+// way around from text_to_utf8(). Zero bytes separate the values of a list.
+// Returns the number of bytes written, or -1 if they do not fit in dest_size
+// or the encoding is unknown.
+int utf8_to_text(char *dest, int dest_size, const char *src, int size, int encoding)
+{
+    int written;
+
+    if (size < 0 || encoding < ID3_TEXT_ENCODING_ISO || encoding > ID3_TEXT_ENCODING_UTF8) return -1;
+
+    // UTF-16 with a BOM takes at most 4 bytes per byte of UTF-8 plus a BOM
+    if (dest_size < 4 * (long long) size + 2 && get_encoded_text_size(src, size, encoding) > dest_size) return -1;
+
+    written = encode(dest, src, size, encoding);
+    count_copy(written);
+
+    return written;
+}
+
+// Position after the string starting at pos, which ends with a zero of width
+// bytes. Returns size if it is not terminated.
+static int skip_string(const char *data, int pos, int size, int width)
+{
+    const char *end;
+
+    if (width == 1) {
+        end = pos < size ? memchr(data + pos, '\0', size - pos) : NULL;
+        return end ? (int) (end - data) + 1 : size;
+    }
+
+    for (; pos + 1 < size; pos += 2) {
+        if (data[pos] == '\0' && data[pos + 1] == '\0') return pos + 2;
+    }
+
+    return size;
+}
+
+// Where the text of a frame is: after the encoding in text frames (T...),
+// after the description in TXXX frames and after the language and the
+// description in COMM and USLT frames. Trailing terminators are left out.
+// Returns 0 if the size bytes at data hold no text.
+static int find_text(const char *frame_id, const char *data, int size, const char **text, int *length, int *encoding)
+{
+    int pos = ID3_FRAME_ENCODING;
+    int width;
+
+    if (!data || size < ID3_FRAME_ENCODING) return 0;
+
+    *encoding = data[0];
+    if (*encoding < ID3_TEXT_ENCODING_ISO || *encoding > ID3_TEXT_ENCODING_UTF8) return 0;
+    width = (*encoding == ID3_TEXT_ENCODING_UTF16_WITH_BOM || *encoding == ID3_TEXT_ENCODING_UTF16BE_WITHOUT_BOM) ? 2 : 1;
+
+    if (memcmp(frame_id, COMMENT_FRAME_ID, ID3_FRAME_ID) == 0 || memcmp(frame_id, "USLT", ID3_FRAME_ID) == 0) {
+        pos = skip_string(data, pos + ID3_FRAME_LANGUAGE, size, width);
+    } else if (memcmp(frame_id, "TXXX", ID3_FRAME_ID) == 0) {
+        pos = skip_string(data, pos, size, width);
+    } else if (frame_id[0] != 'T') {
+        return 0;
+    }
+    if (pos > size) pos = size;
+
+    *text = data + pos;
+    *length = size - pos;
+    if (width == 2) *length &= ~1;
+    while (*length >= width && data[pos + *length - 1] == '\0' && data[pos + *length - width] == '\0') {
+        *length -= width;
+    }
+
+    return 1;
+}
+
+static int find_frame_text(ID3v2_frame *frame, const char **text, int *length, int *encoding)
+{
+    const char *data = load_frame_data(frame);
+
+    return data && find_text(frame->frame_id, data, frame->size, text, length, encoding);
+}
+
+// 1 if length bytes of text hold a zero of width bytes, which separates the
+// values of a list once trailing terminators are left out
+static int has_terminator(const char *text, int length, int width)
+{
+    int pos = 0;
+
+    if (width == 1) return memchr(text, '\0', length) != NULL;
+
+#if HAVE_SSE2
+    for (; length - pos >= 16; pos += 16) {
+        __m128i units = _mm_loadu_si128((const __m128i *) (text + pos));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(units, _mm_setzero_si128()))) return 1;
+    }
+#endif
+    for (; pos + 1 < length; pos += 2) {
+        if (text[pos] == '\0' && text[pos + 1] == '\0') return 1;
+    }
+
+    return 0;
+}
+
+// 1 if the frame holds text ID3v2.3 cannot store: UTF-16BE or UTF-8, or
+// the values of a list in a text frame (T...). The frame is left as it is.
+int is_v24_text_frame(ID3v2_frame *frame)
+{
+    const char *data, *text;
+    char *decoded;
+    int size, length, encoding;
+    int result = 0;
+
+    if (frame->frame_id[0] != 'T' && memcmp(frame->frame_id, COMMENT_FRAME_ID, ID3_FRAME_ID) != 0 &&
+        memcmp(frame->frame_id, "USLT", ID3_FRAME_ID) != 0) {
+        return 0;
+    }
+
+    // Sets are rendered often, only the values of a list need more than
+    // the encoding to be found
+    data = peek_frame_data(frame, &size, &decoded);
+    if (!data || size < ID3_FRAME_ENCODING) return 0;
+
+    if (data[0] == ID3_TEXT_ENCODING_UTF16BE_WITHOUT_BOM || data[0] == ID3_TEXT_ENCODING_UTF8) {
+        result = 1;
+    } else if (frame->frame_id[0] == 'T' && find_text(frame->frame_id, data, size, &text, &length, &encoding)) {
+        result = has_terminator(text, length, encoding == ID3_TEXT_ENCODING_UTF16_WITH_BOM ? 2 : 1);
+    }
+    mem_free(decoded);
+
+    return result;
+}
+
+// The text of a text frame (T...), the value of a TXXX frame or the text of
+// a COMM or USLT frame as UTF-8, whatever its encoding, followed by a NUL.
+// The values of a list stay separated by NUL bytes. Returns the length
+// without the last NUL, or -1 if the frame has no text or it does not fit
+// in size bytes.
+int get_frame_text_utf8(ID3v2_frame *frame, char *buffer, int size)
+{
+    const char *text;
+    int length, encoding, written;
+
+    if (!frame || size < 1 || !find_frame_text(frame, &text, &length, &encoding)) return -1;
+
+    written = text_to_utf8(buffer, size - 1, text, length, encoding);
+    if (written < 0) return -1;
+    buffer[written] = '\0';
+
+    return written;
+}
+
+// The same in memory from arena, room for the worst case is taken so the
+// text is only converted once. *length, if not NULL, is set to the length
+// without the NUL. Returns NULL if the frame has no text.
+char *get_frame_text_utf8_in_arena(ID3v2_frame *frame, ID3v2_arena *arena, int *length)
+{
+    const char *text;
+    int text_length, encoding, written;
+    char *dest;
+
+    if (!frame || !find_frame_text(frame, &text, &text_length, &encoding)) return NULL;
+    if (text_length > (INT_MAX - 1) / 2) return NULL;
+
+    dest = arena_alloc(arena, 2 * text_length + 1);
+    if (!dest) return NULL;
+
+    written = text_to_utf8(dest, 2 * text_length, text, text_length, encoding);
+    dest[written] = '\0';
+    if (length) *length = written;
+
+    return dest;
+}
+
+// The payload of a frame_id frame holding text, which is UTF-8 with its
+// values separated by zero bytes, in the given encoding: the encoding byte,
+// for COMM frames an English language and an empty description, then the
+// text. It takes a single allocation, *payload_size is set to its size.
+// Returns NULL if the encoding is not an ID3_TEXT_ENCODING_* or the payload
+// could not be allocated.
+char *new_text_frame_payload(const char *frame_id, const char *text, int size, int encoding, int *payload_size)
+{
+    char prefix[ID3_FRAME_ENCODING + ID3_FRAME_LANGUAGE + 2];
+    int prefix_size = ID3_FRAME_ENCODING;
+    int text_size = get_encoded_text_size(text, size, encoding);
+    char *payload;
+
+    if (text_size < 0) return NULL;
+
+    prefix[0] = (char) encoding;
+    if (memcmp(frame_id, COMMENT_FRAME_ID, ID3_FRAME_ID) == 0) {
+        int width = (encoding == ID3_TEXT_ENCODING_UTF16_WITH_BOM || encoding == ID3_TEXT_ENCODING_UTF16BE_WITHOUT_BOM) ? 2 : 1;
+
+        memcpy(prefix + prefix_size, "eng", ID3_FRAME_LANGUAGE);
+        memset(prefix + prefix_size + ID3_FRAME_LANGUAGE, 0, width);
+        prefix_size += ID3_FRAME_LANGUAGE + width;
+    }
+    if (text_size > INT_MAX - prefix_size) return NULL;
+
+    payload = mem_alloc(prefix_size + text_size);
+    if (!payload) return NULL;
+
+    memcpy(payload, prefix, prefix_size);
+    encode(payload + prefix_size, text, size, encoding);
+    count_copy(prefix_size + text_size);
+    *payload_size = prefix_size + text_size;
+
+    return payload;
+}
@@ -0,0 +1,231 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+
+#if HAVE_SSE2 && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2 1
+#endif
+
+#include "unsync.h"
+
+/**
+ * Unsynchronisation inserts a $00 after every $FF that is followed by $00 or
+ * a byte >= $E0, so that no false MPEG sync appears inside the tag. Decoding
+ * drops the $00 of every $FF $00 pair.
+ *
+ * The SIMD kernels compare a whole vector against $FF and the byte after it,
+ * copy the run before the first match in one go and only fall back to a
+ * byte-wise step at the match itself.
+ */
+
+static inline int lowest_bit(unsigned int mask)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    int bit = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+// Decode the bytes in [*src, end) while a full vector plus the following byte
+// fit. dest may be equal to src, it never gets ahead of it.
+#if HAVE_SSE2
+static void decode_sse2(char **dest, const char **src, const char *end)
+{
+    const __m128i ff = _mm_set1_epi8((char) 0xFF);
+    const __m128i zero = _mm_setzero_si128();
+
+    while (end - *src >= 17) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *) *src);
+        __m128i next = _mm_loadu_si128((const __m128i *) (*src + 1));
+        unsigned int pairs = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(bytes, ff), _mm_cmpeq_epi8(next, zero)));
+
+        if (!pairs) {
+            _mm_storeu_si128((__m128i *) *dest, bytes);
+            *dest += 16;
+            *src += 16;
+        } else {
+            // Keep everything up to the $FF, skip the $00 after it
+            int run = lowest_bit(pairs) + 1;
+            memmove(*dest, *src, run);
+            *dest += run;
+            *src += run + 1;
+        }
+    }
+}
+#endif
+
+#if HAVE_AVX2
+__attribute__((target("avx2")))
+static void decode_avx2(char **dest, const char **src, const char *end)
+{
+    const __m256i ff = _mm256_set1_epi8((char) 0xFF);
+    const __m256i zero = _mm256_setzero_si256();
+
+    while (end - *src >= 33) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *) *src);
+        __m256i next = _mm256_loadu_si256((const __m256i *) (*src + 1));
+        unsigned int pairs = (unsigned int) _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(bytes, ff), _mm256_cmpeq_epi8(next, zero)));
+
+        if (!pairs) {
+            _mm256_storeu_si256((__m256i *) *dest, bytes);
+            *dest += 32;
+            *src += 32;
+        } else {
+            int run = lowest_bit(pairs) + 1;
+            memmove(*dest, *src, run);
+            *dest += run;
+            *src += run + 1;
+        }
+    }
+}
+
+static int has_avx2(void)
+{
+    static int supported = -1;
+    if (supported < 0) supported = __builtin_cpu_supports("avx2") ? 1 : 0;
+    return supported;
+}
+#endif
+
+// Returns the decoded length, dest may be the same buffer as src
+int decode_unsynchronisation(char *dest, const char *src, int length)
+{
+    char *out = dest;
+    const char *end = src + length;
+
+#if HAVE_AVX2
+    if (has_avx2()) decode_avx2(&out, &src, end);
+#endif
+#if HAVE_SSE2
+    decode_sse2(&out, &src, end);
+#endif
+
+    while (src < end) {
+        if ((*out++ = *src++) == (char) 0xFF && src < end && *src == 0x00) {
+            src++;
+        }
+    }
+
+    return (int) (out - dest);
+}
+
+static inline int needs_unsynchronisation(const char *src, const char *end)
+{
+    if (*src != (char) 0xFF) return 0;
+    if (src + 1 == end) return 1;	// a tag must not end with $FF either
+    return src[1] == 0x00 || (unsigned char) src[1] >= 0xE0;
+}
+
+// Encode while a full vector plus the following byte fit. With dest NULL
+// only the encoded length is counted.
+#if HAVE_SSE2
+static void encode_sse2(char **dest, const char **src, const char *end, int *size)
+{
+    const __m128i ff = _mm_set1_epi8((char) 0xFF);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i e0 = _mm_set1_epi8((char) 0xE0);
+
+    while (end - *src >= 17) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *) *src);
+        __m128i next = _mm_loadu_si128((const __m128i *) (*src + 1));
+        __m128i next_high = _mm_cmpeq_epi8(_mm_max_epu8(next, e0), next);
+        __m128i next_zero = _mm_cmpeq_epi8(next, zero);
+        unsigned int hits = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(bytes, ff), _mm_or_si128(next_high, next_zero)));
+        int run = hits ? lowest_bit(hits) + 1 : 16;
+
+        if (*dest) {
+            memcpy(*dest, *src, run);
+            *dest += run;
+            if (hits) *(*dest)++ = 0x00;
+        }
+        *size += run + (hits ? 1 : 0);
+        *src += run;
+    }
+}
+#endif
+
+#if HAVE_AVX2
+__attribute__((target("avx2")))
+static void encode_avx2(char **dest, const char **src, const char *end, int *size)
+{
+    const __m256i ff = _mm256_set1_epi8((char) 0xFF);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i e0 = _mm256_set1_epi8((char) 0xE0);
+
+    while (end - *src >= 33) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *) *src);
+        __m256i next = _mm256_loadu_si256((const __m256i *) (*src + 1));
+        __m256i next_high = _mm256_cmpeq_epi8(_mm256_max_epu8(next, e0), next);
+        __m256i next_zero = _mm256_cmpeq_epi8(next, zero);
+        unsigned int hits = (unsigned int) _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(bytes, ff), _mm256_or_si256(next_high, next_zero)));
+        int run = hits ? lowest_bit(hits) + 1 : 32;
+
+        if (*dest) {
+            memcpy(*dest, *src, run);
+            *dest += run;
+            if (hits) *(*dest)++ = 0x00;
+        }
+        *size += run + (hits ? 1 : 0);
+        *src += run;
+    }
+}
+#endif
+
+static int encode(char *dest, const char *src, int length)
+{
+    const char *end = src + length;
+    int size = 0;
+
+#if HAVE_AVX2
+    if (has_avx2()) encode_avx2(&dest, &src, end, &size);
+#endif
+#if HAVE_SSE2
+    encode_sse2(&dest, &src, end, &size);
+#endif
+
+    while (src < end) {
+        int insert = needs_unsynchronisation(src, end);
+        if (dest) {
+            *dest++ = *src;
+            if (insert) *dest++ = 0x00;
+        }
+        size += 1 + insert;
+        src++;
+    }
+
+    return size;
+}
+
+// dest must have room for get_unsynchronised_size() bytes (at most 2 * length),
+// returns the encoded length
+int encode_unsynchronisation(char *dest, const char *src, int length)
+{
+    return encode(dest, src, length);
+}
+
+int get_unsynchronised_size(const char *src, int length)
+{
+    return encode(NULL, src, length);
+}
@@ -7,11 +7,33 @@
  * file that was distributed with this source code.
  */
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "alloc.h"
+#include "stats.h"
 #include "utils.h"
+#include "arena.h"
+
+static int error_reporting = 1;
+
+// Errors are reported with perror() unless disabled, e.g. by programs
+// loading tags from many threads that check the return values instead
+void set_error_reporting(int enabled)
+{
+    error_reporting = enabled;
+}
+
+void report_error(const char *message)
+{
+    if (error_reporting) perror(message);
+}
 
 unsigned int btoi(const char *bytes, int size, int offset)
 {
@@ -28,7 +50,7 @@ unsigned int btoi(const char *bytes, int size, int offset)
 char *itob(int integer)
 {
     int size = 4;
-    char *result = malloc(size);
+    char *result = mem_alloc(size);
 
     // We need to reverse the bytes because Intel uses little endian.
     char *aux = (char*) &integer;
@@ -41,17 +63,11 @@ char *itob(int integer)
 
 int syncint_encode(int value)
 {
-    int out, mask = 0x7F;
-
-    while (mask ^ 0x7FFFFFFF) {
-        out = value & ~mask;
-        out <<= 1;
-        out |= value & mask;
-        mask = ((mask + 1) << 8) - 1;
-        value = out;
-    }
+    // 7 bits per byte. Done unsigned, the old mask arithmetic overflowed an
+    // int and optimizing compilers turned the loop into an endless one.
+    unsigned int v = (unsigned int) value;
 
-    return out;
+    return (int) ((v & 0x7F) | ((v & 0x3F80) << 1) | ((v & 0x1FC000) << 2) | ((v & 0xFE00000) << 3));
 }
 
 int syncint_decode(int value)
@@ -70,48 +86,217 @@ int syncint_decode(int value)
     return result;
 }
 
-void add_to_list(ID3v2_frame_list *main, ID3v2_frame *frame)
+static inline uint32_t frame_id_key(const char *frame_id)
+{
+    uint32_t key;
+    memcpy(&key, frame_id, ID3_FRAME_ID);
+    return key;
+}
+
+static inline int compare_index_entries(const ID3v2_frame_index_entry *a, const ID3v2_frame_index_entry *b)
+{
+    if (a->id != b->id) return a->id < b->id ? -1 : 1;
+    return a->position - b->position;
+}
+
+static int compare_index_entries_qsort(const void *a, const void *b)
+{
+    return compare_index_entries(a, b);
+}
+
+static void *list_alloc(ID3v2_frame_list *list, void *old, int old_size, int size)
+{
+    void *memory;
+
+    if (!list->arena) return mem_realloc(old, size);
+
+    memory = arena_alloc(list->arena, size);
+    if (memory && old) memcpy(memory, old, old_size);
+    return memory;
+}
+
+static int grow_list(ID3v2_frame_list *list)
+{
+    int capacity = list->capacity ? list->capacity * 2 : 16;
+    ID3v2_frame **frames;
+    ID3v2_frame_index_entry *index;
+
+    frames = list_alloc(list, list->frames, list->capacity * sizeof(ID3v2_frame *), capacity * sizeof(ID3v2_frame *));
+    if (!frames) return 0;
+    list->frames = frames;
+
+    index = list_alloc(list, list->index, list->capacity * sizeof(ID3v2_frame_index_entry), capacity * sizeof(ID3v2_frame_index_entry));
+    if (!index) return 0;
+    list->index = index;
+
+    list->capacity = capacity;
+    return 1;
+}
+
+static void build_index(ID3v2_frame_list *list)
+{
+    for (int i = 0; i < list->count; i++) {
+        list->index[i].id = frame_id_key(list->frames[i]->frame_id);
+        list->index[i].position = i;
+    }
+    if (list->count > 1) qsort(list->index, list->count, sizeof(ID3v2_frame_index_entry), compare_index_entries_qsort);
+    list->index_valid = 1;
+}
+
+// Position in the index of the first entry not lower than (id, position)
+static int index_lower_bound(ID3v2_frame_list *list, uint32_t id, int position)
+{
+    ID3v2_frame_index_entry key = { id, position };
+    int low = 0, high = list->count;
+
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (compare_index_entries(&list->index[middle], &key) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+void add_to_list(ID3v2_frame_list *list, ID3v2_frame *frame)
 {
-    ID3v2_frame_list *current;
+    if (list->count == list->capacity && !grow_list(list)) return;
 
-    // if empty list
-    if (main->start == NULL) {
-        main->start = main;
-        main->last = main;
-        main->frame = frame;
+    list->frames[list->count] = frame;
+
+    if (list->index_valid && frame->frame_id[0]) {
+        // Appended frames sort after every frame with the same ID
+        uint32_t id = frame_id_key(frame->frame_id);
+        int position = index_lower_bound(list, id, list->count);
+        memmove(&list->index[position + 1], &list->index[position],
+                (list->count - position) * sizeof(ID3v2_frame_index_entry));
+        list->index[position].id = id;
+        list->index[position].position = list->count;
     } else {
-        current = new_frame_list();
-        current->frame = frame;
-        current->start = main->start;
-        main->last->next = current;
-        main->last = current;
+        // Frame IDs are usually set right after adding an empty frame, index them on the next lookup
+        list->index_valid = 0;
     }
+
+    list->count++;
 }
 
-ID3v2_frame *get_from_list(ID3v2_frame_list *list, char *frame_id)
+// The index keeps the frame IDs seen when it was built. A frame renamed since
+// then is caught when the hit does not match and the index gets rebuilt.
+ID3v2_frame *get_nth_from_list(ID3v2_frame_list *list, char *frame_id, int n)
 {
-    while (list != NULL && list->frame != NULL) {
-        if (strncmp(list->frame->frame_id, frame_id, 4) == 0) return list->frame;
-        list = list->next;
+    uint32_t id = frame_id_key(frame_id);
+    int position;
+
+    if (!list || n < 0) return NULL;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (!list->index_valid) build_index(list);
+
+        position = index_lower_bound(list, id, 0) + n;
+        if (position >= list->count || list->index[position].id != id) return NULL;
+
+        ID3v2_frame *frame = list->frames[list->index[position].position];
+        if (frame_id_key(frame->frame_id) == id) return frame;
+
+        list->index_valid = 0;
     }
+
     return NULL;
 }
 
+ID3v2_frame *get_from_list(ID3v2_frame_list *list, char *frame_id)
+{
+    return get_nth_from_list(list, frame_id, 0);
+}
+
+// Take the first frame_id frame out of the list and return it, see free_tag_frame()
+ID3v2_frame *remove_from_list(ID3v2_frame_list *list, char *frame_id)
+{
+    ID3v2_frame *frame = get_from_list(list, frame_id);
+    int position = 0;
+
+    if (!frame) return NULL;
+
+    while (list->frames[position] != frame) position++;
+    memmove(&list->frames[position], &list->frames[position + 1], (list->count - position - 1) * sizeof(ID3v2_frame *));
+    list->count--;
+    list->index_valid = 0;
+
+    return frame;
+}
+
+int count_in_list(ID3v2_frame_list *list, char *frame_id)
+{
+    uint32_t id = frame_id_key(frame_id);
+
+    if (!list) return 0;
+    if (!list->index_valid) build_index(list);
+
+    return index_lower_bound(list, id, INT_MAX) - index_lower_bound(list, id, 0);
+}
+
+int is_mapped(ID3v2_tag *tag, const char *data)
+{
+    return tag->mapping && data >= tag->mapping && data < tag->mapping + tag->mapping_size;
+}
+
+void unmap_tag(ID3v2_tag *tag)
+{
+    if (!tag->mapping) return;
+
+    if (is_mapped(tag, tag->raw)) tag->raw = NULL;
+#ifndef _WIN32
+    count_syscalls(1);
+    munmap(tag->mapping, tag->mapping_size);
+#endif
+    tag->mapping = NULL;
+    tag->mapping_size = 0;
+}
+
+// Tags loaded in an arena or mapped from a file may still own heap memory
+// if frames were added or changed afterwards, so check each pointer.
+static void free_tag_memory(ID3v2_tag *tag, void *pointer)
+{
+    if (is_mapped(tag, pointer) || arena_owns(tag->arena, pointer)) return;
+    mem_free(pointer);
+}
+
 void free_tag(ID3v2_tag *tag)
 {
-    ID3v2_frame_list *list;
-
-    free(tag->raw);
-    free(tag->tag_header);
-    list = tag->frames;
-    while (list) {
-        if (list->frame) free(list->frame->data);
-        free(list->frame);
-        ID3v2_frame_list *prev = list;
-        list = list->next;
-        free(prev);
+    ID3v2_frame_list *list = tag->frames;
+
+    free_tag_memory(tag, tag->raw);
+    free_tag_memory(tag, tag->tag_header);
+    if (list) {
+        for (int i = 0; i < list->count; i++) {
+            free_tag_memory(tag, list->frames[i]->data);
+            free_tag_memory(tag, list->frames[i]);
+        }
+        free_tag_memory(tag, list->frames);
+        free_tag_memory(tag, list->index);
+        free_tag_memory(tag, list);
     }
-    free(tag);
+    if (tag->fallback) {
+        for (int i = 0; i < tag->fallback->count; i++) {
+            mem_free(tag->fallback->frames[i]->data);
+            mem_free(tag->fallback->frames[i]);
+        }
+        mem_free(tag->fallback->frames);
+        mem_free(tag->fallback->index);
+        mem_free(tag->fallback);
+    }
+    unmap_tag(tag);
+    free_tag_memory(tag, tag);
+}
+
+// Free a frame taken out of the tag, leaving what the tag's arena or mapping owns
+void free_tag_frame(ID3v2_tag *tag, ID3v2_frame *frame)
+{
+    free_tag_memory(tag, frame->data);
+    free_tag_memory(tag, frame);
 }
 
 char *get_mime_type_from_filename(const char *filename)
@@ -127,7 +312,7 @@ int has_bom(uint16_t *string)
 
 uint16_t *char_to_utf16(char *string, int size)
 {
-    uint16_t *result = malloc(size  *sizeof(uint16_t));
+    uint16_t *result = mem_alloc(size  *sizeof(uint16_t));
     memcpy(result, string, size);
     return result;
 }
@@ -153,7 +338,7 @@ char *get_path_to_file(const char *file)
     char *file_name = strrchr(file, '/');
     unsigned long size = strlen(file) - strlen(file_name) + 1; // 1 = trailing '/'
 
-    char *file_path = malloc(size);
+    char *file_path = mem_alloc(size);
     strncpy(file_path, file, size);
 
     return file_path;
@@ -0,0 +1,135 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+// Apply the same frame edits to many files from a pool of threads, e.g.
+//   id3v2edit -s TPE2="Some Artist" -d COMM *.mp3
+// Prints the files that could not be written and a summary.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "id3v2lib.h"
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "usage: %s [-j threads] [-a | -A] [-s FRAME=text]... [-d FRAME]... file...\n", program);
+    fprintf(stderr, "  -j threads     number of threads (default: one per CPU)\n");
+    fprintf(stderr, "  -a             write files atomically (new file + rename)\n");
+    fprintf(stderr, "  -A             append the tag to files without one, the audio is never moved\n");
+    fprintf(stderr, "  -s FRAME=text  set a text frame (T...) or the comment (COMM) to UTF-8 text,\n");
+    fprintf(stderr, "                 written as Latin-1 if it fits, as UTF-16 otherwise\n");
+    fprintf(stderr, "  -d FRAME       remove every frame with this ID\n");
+}
+
+// Latin-1 if every character of the UTF-8 text is in it, UTF-16 otherwise.
+// Both are ID3v2.3 encodings, UTF-8 would make set_tag() write ID3v2.4,
+// which older players cannot read.
+static char get_text_encoding(const char *text)
+{
+    const unsigned char *c = (const unsigned char *) text;
+
+    while (*c) {
+        if (*c < 0x80) {
+            c++;
+        } else if ((*c == 0xC2 || *c == 0xC3) && (c[1] & 0xC0) == 0x80) {
+            // U+0080 to U+00FF
+            c += 2;
+        } else {
+            return ID3_TEXT_ENCODING_UTF16_WITH_BOM;
+        }
+    }
+
+    return ID3_TEXT_ENCODING_ISO;
+}
+
+int main(int argc, char *argv[])
+{
+    ID3v2_edit_options options = { 0, 0, 0 };
+    ID3v2_edit_stats stats;
+    ID3v2_edit_result *results;
+    ID3v2_frame_edit *edits;
+    int edit_count = 0;
+    int count;
+    int result = 0;
+    int option;
+
+    edits = calloc(argc, sizeof(ID3v2_frame_edit));
+    if (!edits) return 1;
+
+    while ((option = getopt(argc, argv, "j:aAs:d:h")) != -1) {
+        char *equals;
+
+        switch (option) {
+            case 'j':
+                options.threads = atoi(optarg);
+                break;
+            case 'a':
+                options.atomic = 1;
+                break;
+            case 'A':
+                options.append = 1;
+                break;
+            case 's':
+                equals = strchr(optarg, '=');
+                if (!equals) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                *equals = '\0';
+                edits[edit_count].frame_id = optarg;
+                edits[edit_count].text = equals + 1;
+                edits[edit_count].encoding = get_text_encoding(equals + 1);
+                edit_count++;
+                break;
+            case 'd':
+                edits[edit_count].frame_id = optarg;
+                edits[edit_count].text = NULL;
+                edit_count++;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    count = argc - optind;
+    if (count <= 0 || edit_count == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    results = calloc(count, sizeof(ID3v2_edit_result));
+    if (!results) return 1;
+
+    set_error_reporting(0);
+
+    if (edit_files(argv + optind, count, edits, edit_count, &options, results, &stats) != 0) {
+        fprintf(stderr, "%s: unsupported edit or could not start\n", argv[0]);
+        return 1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (results[i].result == ID3_WRITE_FAILED) {
+            fprintf(stderr, "%s: %s\n", argv[optind + i], strerror(results[i].error));
+            result = 1;
+        }
+    }
+
+    printf("files: %ld, in place: %ld, rewritten: %ld, unchanged: %ld, errors: %ld\n",
+           stats.files, stats.in_place, stats.rewritten, stats.unchanged, stats.errors);
+    printf("%.3f s, %.0f files/s\n", stats.seconds, stats.files / (stats.seconds > 0 ? stats.seconds : 1e-9));
+
+    free(results);
+    free(edits);
+
+    return result;
+}
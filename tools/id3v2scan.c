@@ -0,0 +1,147 @@
+/*
+ * This file is part of the id3v2lib library
+ *
+ * Copyright (c) 2013, Lorenzo Ruiz
+ *
+ * For the full copyright and license information, please view the LICENSE
+ * file that was distributed with this source code.
+ */
+
+// Scan the tags of every file under the given directories from a pool of
+// threads. Prints title, artist and album of each tagged file, or only the
+// throughput with -b. With -c the three frames are kept in a cache file, so
+// files that did not change are not opened the next time.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "id3v2lib.h"
+
+// What print_tag() needs, the only frames kept in the cache
+static char *cached_frames[] = { "TIT2", "TPE1", "TALB" };
+
+static void print_text_frame(ID3v2_frame *frame)
+{
+    char text[1024];
+    int length = get_frame_text_utf8(frame, text, sizeof(text));
+
+    // Printed as UTF-8 whatever the encoding, the values of a list separated by '/'
+    for (int i = 0; i < length; i++) {
+        if (text[i] == '\0') text[i] = '/';
+    }
+    if (length > 0) fputs(text, stdout);
+}
+
+static void print_tag(const char *file_name, ID3v2_tag *tag, int error, void *user_data)
+{
+    (void) user_data;
+
+    // Files without a tag are left out, the ones that could not be read are reported
+    if (!tag) {
+        if (error) fprintf(stderr, "%s: %s\n", file_name, strerror(error));
+        return;
+    }
+
+    flockfile(stdout);
+    fputs(file_name, stdout);
+    putchar('\t');
+    print_text_frame(tag_get_title(tag));
+    putchar('\t');
+    print_text_frame(tag_get_artist(tag));
+    putchar('\t');
+    print_text_frame(tag_get_album(tag));
+    putchar('\n');
+    funlockfile(stdout);
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "usage: %s [-j threads] [-1] [-c cache] [-b] directory...\n", program);
+    fprintf(stderr, "  -j threads  number of threads (default: one per CPU)\n");
+    fprintf(stderr, "  -1          use the ID3v1 tag for what the ID3v2 tag lacks\n");
+    fprintf(stderr, "  -c cache    keep the tags in this file, unchanged files are not read again\n");
+    fprintf(stderr, "  -b          benchmark, only print files/s and MB/s\n");
+}
+
+int main(int argc, char *argv[])
+{
+    ID3v2_scan_options options = { 0, print_tag, NULL, 0, NULL };
+    ID3v2_scan_stats total = { 0, 0, 0, 0, 0, 0 };
+    const char *cache_file = NULL;
+    int benchmark = 0;
+    int result = 0;
+    int option;
+
+    while ((option = getopt(argc, argv, "j:1c:bh")) != -1) {
+        switch (option) {
+            case 'j':
+                options.threads = atoi(optarg);
+                break;
+            case '1':
+                options.id3v1 = 1;
+                break;
+            case 'c':
+                cache_file = optarg;
+                break;
+            case 'b':
+                benchmark = 1;
+                options.callback = NULL;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    set_error_reporting(0);
+
+    if (cache_file) {
+        options.cache = open_tag_cache(cache_file, cached_frames, 3);
+        if (!options.cache) {
+            fprintf(stderr, "%s: could not open %s\n", argv[0], cache_file);
+            return 1;
+        }
+    }
+
+    for (int i = optind; i < argc; i++) {
+        ID3v2_scan_stats stats;
+
+        if (scan_directory(argv[i], &options, &stats) != 0) {
+            fprintf(stderr, "%s: could not scan %s\n", argv[0], argv[i]);
+            result = 1;
+            continue;
+        }
+
+        total.files += stats.files;
+        total.tags += stats.tags;
+        total.errors += stats.errors;
+        total.cached += stats.cached;
+        total.bytes += stats.bytes;
+        total.seconds += stats.seconds;
+    }
+
+    if (options.cache) {
+        if (save_tag_cache(options.cache) != 0) {
+            fprintf(stderr, "%s: could not save %s\n", argv[0], cache_file);
+            result = 1;
+        }
+        close_tag_cache(options.cache);
+    }
+
+    if (benchmark) {
+        double seconds = total.seconds > 0 ? total.seconds : 1e-9;
+        printf("files: %ld, tags: %ld, errors: %ld, cached: %ld, tag bytes: %lld\n",
+               total.files, total.tags, total.errors, total.cached, total.bytes);
+        printf("%.3f s, %.0f files/s, %.2f MB/s\n",
+               total.seconds, total.files / seconds, total.bytes / seconds / (1024 * 1024));
+    }
+
+    return result;
+}